@@ -0,0 +1,281 @@
+// Frame throughput benchmark for the render path.
+//
+// Runs composed stimulus programs on the offscreen backend over a sweep
+// of resolutions and frame counts and writes one CSV row per frame:
+//
+//   program,width,height,frames,frame,draw_us,finish_us
+//
+// draw_us is the time to set the phase and submit the draw, finish_us the
+// time until the GPU has finished the frame. Needs no display, no DRM
+// device and no GPIO, so it runs on Mesa llvmpipe.
+//
+// "patches" draws PATCH_COUNT randomly placed gabor patches per frame, a new
+// set every frame, as a sparse noise protocol would. "noise" is white noise
+// in 8 pixel blocks, a new frame every refresh. The "-lut" programs draw the
+// same gratings from a lookup texture.
+//
+// With -c it benchmarks nothing and instead checks the noise programs: each
+// frame is drawn into a float framebuffer, read back and compared with
+// renderNoiseCpu(), which should match it bit for bit. The seeds include two
+// 289^3 apart, which only the top digit of the hash tells apart. Exits
+// nonzero on any mismatch, or if no noise program was checked.
+//
+// Usage: ./bench [-c] [-p sin,square,gabor,plaid,annulus,patches,noise,sin-lut,square-lut,gabor-lut] [-s 640x480,1920x1080] [-n 60,600] [-o out.csv]
+
+#define RPG_NO_PYTHON
+#include "rpg.c"
+
+#define MAX_SWEEP 16
+#define PATCH_COUNT 256
+#define PATCH_FRAMES 16
+#define CHECK_SPECTRA 2
+
+static const uint32_t checkSeeds[] = {0, 12345, 12345 + 289 * 289 * 289, UINT32_MAX};
+
+typedef struct {
+    const char* name;
+    stimulusType type;
+    int patches;
+    int lut;
+} program;
+
+static program programs[] = {
+    {"sin", {CARRIER_SINE, ENVELOPE_NONE, TEMPORAL_DRIFT, 0}, 0, 0},
+    {"square", {CARRIER_SQUARE, ENVELOPE_NONE, TEMPORAL_DRIFT, 0}, 0, 0},
+    {"gabor", {CARRIER_SINE, ENVELOPE_GAUSSIAN, TEMPORAL_DRIFT, 0}, 0, 0},
+    {"plaid", {CARRIER_PLAID, ENVELOPE_NONE, TEMPORAL_DRIFT, 0}, 0, 0},
+    {"annulus", {CARRIER_SINE, ENVELOPE_ANNULUS, TEMPORAL_COUNTERPHASE, 0}, 0, 0},
+    {"patches", {CARRIER_SINE, ENVELOPE_GAUSSIAN, TEMPORAL_DRIFT, 0}, PATCH_COUNT, 0},
+    {"noise", {CARRIER_NOISE, ENVELOPE_NONE, TEMPORAL_DRIFT, 0}, 0, 0},
+    {"sin-lut", {CARRIER_SINE, ENVELOPE_NONE, TEMPORAL_DRIFT, 0}, 0, 1},
+    {"square-lut", {CARRIER_SQUARE, ENVELOPE_NONE, TEMPORAL_DRIFT, 0}, 0, 1},
+    {"gabor-lut", {CARRIER_SINE, ENVELOPE_GAUSSIAN, TEMPORAL_DRIFT, 0}, 0, 1},
+};
+
+static shader buildPatchProgram(program* prog, stimulusParams params) {
+    shader myShader = buildPatches(prog->type, params);
+    float* patches = malloc(PATCH_FRAMES * prog->patches * PATCH_FLOATS * sizeof(float));
+    srand48(1);
+    for (int i = 0; i < PATCH_FRAMES * prog->patches; i++) {
+        float* p = patches + i * PATCH_FLOATS;
+        p[0] = drand48() * 2 - 1;   // x
+        p[1] = drand48() * 2 - 1;   // y
+        p[2] = 0.002;               // sigma
+        p[3] = drand48() * M_PI;    // angle
+        p[4] = 40.0;                // spatial
+        p[5] = 1.0;                 // contrast
+        p[6] = drand48() * 2 * M_PI; // phase
+    }
+    setPatches(&myShader, patches, prog->patches, PATCH_FRAMES);
+    free(patches);
+    return myShader;
+}
+
+static int programCount = sizeof(programs) / sizeof(programs[0]);
+
+static int parseList(char* list, char** items) {
+    int count = 0;
+    for (char* item = strtok(list, ","); item && count < MAX_SWEEP; item = strtok(NULL, ",")) {
+        items[count++] = item;
+    }
+    return count;
+}
+
+static void runProgram(FILE* out, GLconfig* configPtr, program* prog, int frames) {
+    stimulusParams params = defaultParams();
+    params.angle = 0.7;
+    params.angle2 = 0.7 + M_PI / 2;
+    params.cyclesPerSecond = 2.0;
+    shader myShader = prog->patches ? buildPatchProgram(prog, params) :
+                      prog->lut ? buildLutStimulus(prog->type, params) : buildStimulus(prog->type, params);
+    glUseProgram(myShader.programId);
+    setStimulusUniforms(&myShader, &myShader.params);
+    configPtr->currentShaderPtr = &myShader;
+    int phaseLocation = glGetUniformLocation(myShader.programId, "phase");
+
+    for (int q = 0; q < frames; q++) {
+        long start = get_time_micros();
+        glUniform1f(phaseLocation, stimulusPhase(TIMEBASE_FRAME, myShader.params.cyclesPerSecond, q, 0));
+        drawStimulus(&myShader, q);
+        long drawn = get_time_micros();
+        presentFrame(configPtr);
+        long finished = get_time_micros();
+
+        fprintf(out, "%s,%d,%d,%d,%d,%ld,%ld\n", prog->name, drm.mode.hdisplay, drm.mode.vdisplay,
+                frames, q, drawn - start, finished - drawn);
+    }
+
+    destroyVBO(&myShader);
+    destroyShaders(&myShader);
+}
+
+// Number of pixels of frames frames of a noise program, over checkSeeds
+// and white and pink spectra, where the GPU and renderNoiseCpu() differ.
+static long checkNoise(GLconfig* configPtr, program* prog, int frames) {
+    int width = drm.mode.hdisplay;
+    int height = drm.mode.vdisplay;
+    GLfloat* gpu = malloc((size_t)width * height * 4 * sizeof(GLfloat));
+    float* cpu = malloc((size_t)width * height * sizeof(float));
+    if (gpu == NULL || cpu == NULL) {
+        fprintf(stderr, "Memory allocation for the noise check failed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    GLuint fbo, texture;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_EXT, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    long mismatches = 0;
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "ERROR: Could not render to a float texture, noise not checked.\n");
+        mismatches = -1;
+    }
+
+    for (int s = 0; s < CHECK_SPECTRA && mismatches >= 0; s++) {
+        for (size_t n = 0; n < sizeof(checkSeeds) / sizeof(checkSeeds[0]); n++) {
+            stimulusParams params = defaultParams();
+            params.seed = checkSeeds[n];
+            params.spectrum = s;
+            shader myShader = buildStimulus(prog->type, params);
+            glUseProgram(myShader.programId);
+            setStimulusUniforms(&myShader, &myShader.params);
+            configPtr->currentShaderPtr = &myShader;
+
+            for (int q = 0; q < frames; q++) {
+                drawStimulus(&myShader, q);
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, gpu);
+                renderNoiseCpu(prog->type.carrier, &myShader.params, q, cpu, width, height, 1);
+                long frameMismatches = 0;
+                for (long i = 0; i < (long)width * height; i++) {
+                    frameMismatches += memcmp(&gpu[4 * i], &cpu[i], sizeof(float)) != 0;
+                }
+                if (frameMismatches) {
+                    fprintf(stderr, "%s %dx%d seed %u spectrum %d frame %d: %ld pixels differ\n", prog->name,
+                            width, height, params.seed, s, q, frameMismatches);
+                }
+                mismatches += frameMismatches;
+            }
+
+            destroyVBO(&myShader);
+            destroyShaders(&myShader);
+        }
+    }
+
+    GLenum errorCheckValue = glGetError();
+    if (errorCheckValue != GL_NO_ERROR) {
+        fprintf(stderr, "ERROR: Could not check the noise %s.\n", glGetErrorStr(errorCheckValue));
+        mismatches = -1;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+    free(gpu);
+    free(cpu);
+    return mismatches;
+}
+
+int main(int argc, char** argv) {
+    char programList[256] = "sin,square,gabor";
+    char sizeList[256] = "640x480,1280x720,1920x1080";
+    char frameList[256] = "240";
+    const char* outPath = NULL;
+    int check = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "cp:s:n:o:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            check = 1;
+            break;
+        case 'p':
+            snprintf(programList, sizeof(programList), "%s", optarg);
+            break;
+        case 's':
+            snprintf(sizeList, sizeof(sizeList), "%s", optarg);
+            break;
+        case 'n':
+            snprintf(frameList, sizeof(frameList), "%s", optarg);
+            break;
+        case 'o':
+            outPath = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c] [-p sin,square,gabor,plaid,annulus,patches,noise,sin-lut,square-lut,gabor-lut] [-s WxH,...] [-n frames,...] [-o out.csv]\n", argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    FILE* out;
+    if (outPath) {
+        out = fopen(outPath, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Unable to open %s: %s\n", outPath, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    } else {
+        // Keep the CSV on stdout and send the renderer's own messages to stderr.
+        fflush(stdout);
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    char* names[MAX_SWEEP];
+    char* sizes[MAX_SWEEP];
+    char* counts[MAX_SWEEP];
+    int nameCount = parseList(programList, names);
+    int sizeCount = parseList(sizeList, sizes);
+    int countCount = parseList(frameList, counts);
+
+    if (!check) {
+        fprintf(out, "program,width,height,frames,frame,draw_us,finish_us\n");
+    }
+    int failed = 0;
+    int checked = 0;
+
+    for (int s = 0; s < sizeCount; s++) {
+        int width, height;
+        if (sscanf(sizes[s], "%dx%d", &width, &height) != 2) {
+            fprintf(stderr, "Bad size '%s', expected WIDTHxHEIGHT\n", sizes[s]);
+            continue;
+        }
+        setOffscreenMode(width, height, 60);
+        GLconfig config = setup(0, PRESENT_OFFSCREEN);
+        glViewport(0, 0, width, height);
+
+        for (int n = 0; n < nameCount; n++) {
+            program* prog = NULL;
+            for (int p = 0; p < programCount; p++) {
+                if (strcmp(programs[p].name, names[n]) == 0) {
+                    prog = &programs[p];
+                }
+            }
+            if (prog == NULL) {
+                fprintf(stderr, "Unknown program '%s'\n", names[n]);
+                continue;
+            }
+            for (int c = 0; c < countCount; c++) {
+                if (!check) {
+                    runProgram(out, &config, prog, atoi(counts[c]));
+                } else if (isNoiseCarrier(prog->type.carrier)) {
+                    long mismatches = checkNoise(&config, prog, atoi(counts[c]));
+                    fprintf(stderr, "%s %dx%d %s frames: %s\n", prog->name, width, height, counts[c],
+                            mismatches == 0 ? "matches render_noise" : "FAILED");
+                    failed |= mismatches != 0;
+                    checked += atoi(counts[c]) > 0;
+                }
+            }
+        }
+
+        EGLcleanup(&config);
+    }
+
+    fclose(out);
+    if (check && !checked) {
+        fprintf(stderr, "Nothing checked: -c needs a noise program in -p and at least one frame\n");
+        return EXIT_FAILURE;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
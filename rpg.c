@@ -1,22 +1,74 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 // pthread affinity, the same as Python.h sets
+#endif
+#ifndef RPG_NO_PYTHON
 #include <Python.h>
+#endif
 #include <pthread.h>
+#include <sched.h>
+#include <alloca.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <stdatomic.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <gbm.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <time.h>
 #include <math.h>
-#include <wiringPi.h>
 
 #define PI 3.141
 #define PARAMETER_LENGTH 7
 
-//gcc -shared -o rpg.so -fPIC rpg.c -O3 -lEGL -lGLESv2 -ldrm -lgbm -lm -I/usr/include/libdrm -I/usr/include/python3.11
+// How finished frames get onto the screen. PRESENT_PAGEFLIP queues a
+// vblank-synchronised flip and never does a modeset after the first frame,
+// PRESENT_SETCRTC is the original modeset-every-frame path. PRESENT_OFFSCREEN
+// renders into an EGL pbuffer with no display at all (works on llvmpipe).
+// PRESENT_ATOMIC commits frames with atomic KMS and lets the display
+// controller compose background, stimulus and sync layer from planes of
+// their own where it can.
+#define PRESENT_SETCRTC 0
+#define PRESENT_PAGEFLIP 1
+#define PRESENT_OFFSCREEN 2
+#define PRESENT_ATOMIC 3
+
+// Where the stimulus phase comes from. TIMEBASE_CLOCK uses the predicted
+// scanout time of each frame, TIMEBASE_FRAME counts presented frames and
+// multiplies by the refresh period of the mode, so it cannot pick up any
+// clock jitter at all.
+#define TIMEBASE_CLOCK 0
+#define TIMEBASE_FRAME 1
+
+// What a sequence does after missing vblanks, which it counts from the
+// kernel's vblank sequence numbers. RECOVER_ADVANCE keeps to the schedule:
+// the frames that should have been shown meanwhile are skipped and the phase
+// jumps to where it should be, so trials keep their length in vblanks.
+// RECOVER_HOLD shows every frame and the trial runs longer by the missed
+// vblanks. The phase follows the timebase either way: on TIMEBASE_CLOCK it
+// keeps to the clock across a miss, on TIMEBASE_FRAME it moves on per frame
+// shown.
+#define RECOVER_HOLD 0
+#define RECOVER_ADVANCE 1
+
+// Build with make, see the Makefile. Defining RPG_NO_PYTHON leaves out the
+// Python module so the renderer can be compiled into a plain executable (see
+// bench.c).
 
 
 unsigned int
@@ -32,12 +84,79 @@ static const EGLint configAttribs[] = {
     EGL_NONE
 };
 
+static const EGLint pbufferConfigAttribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 8,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+    EGL_NONE
+};
+
 static const EGLint contextAttribs[] = {
      EGL_CONTEXT_CLIENT_VERSION, 2,
      EGL_NONE
 };
 
 
+// Building blocks for composeFragSource(). A stimulus is a carrier, times an
+// envelope, modulated in time.
+#define CARRIER_SINE 0
+#define CARRIER_SQUARE 1
+#define CARRIER_SAWTOOTH 2
+#define CARRIER_PLAID 3     // sum of two sine gratings, angle and angle2
+#define CARRIER_NOISE 4     // uniform noise in blocks, 1/f^spectrum with spectrum > 0
+#define CARRIER_BINARY_NOISE 5 // the same, thresholded to black and white
+#define CARRIER_SPARSE_NOISE 6 // a density fraction of blocks black or white, the rest grey
+
+#define ENVELOPE_NONE 0
+#define ENVELOPE_GAUSSIAN 1
+#define ENVELOPE_CIRCLE 2
+#define ENVELOPE_ANNULUS 3
+
+#define TEMPORAL_DRIFT 0
+#define TEMPORAL_COUNTERPHASE 1
+#define TEMPORAL_FLICKER 2
+
+// Parameters that can stay uniforms. Anything not asked for is folded into
+// the generated program as a constant.
+#define PARAM_ANGLE (1 << 0)
+#define PARAM_SPATIAL (1 << 1)
+#define PARAM_CONTRAST (1 << 2)
+#define PARAM_CENTER (1 << 3)
+#define PARAM_SIZE (1 << 4)   // sigma, radius and innerRadius
+#define PARAM_ANGLE2 (1 << 5)
+#define PARAM_ALL 0x3f
+
+// Everything a stimulus program takes apart from phase. Positions and sizes
+// are in units of half the screen height, centred on the screen.
+typedef struct {
+    float angle;
+    float spatial;
+    float cyclesPerSecond;
+    float contrast;
+    float angle2;
+    float centerX;
+    float centerY;
+    float sigma;
+    float radius;
+    float innerRadius;
+    // noise carriers
+    uint32_t seed;
+    float blockSize;      // pixels, a whole number
+    float spectrum;       // power falls as 1/f^spectrum, 0 for white
+    float density;        // sparse noise, fraction of blocks not grey
+    int framesPerUpdate;  // refreshes each noise frame is shown for
+} stimulusParams;
+
+typedef struct {
+    int carrier;
+    int envelope;
+    int temporal;
+    int uniforms; // PARAM_* bits
+} stimulusType;
+
 typedef struct {
     GLuint vertexShaderId;
     GLuint fragmentShaderId;
@@ -45,20 +164,35 @@ typedef struct {
     GLuint VBOId;
     GLuint programId;
     int VBOlength;
-    float angle;
-    float spatial;
-    float cyclesPerSecond;
+    stimulusParams params;
     float aspectRatio;
+    stimulusType type;
+    uint64_t sourceHash; // of the fragment source, identifies the program
+    struct patchSet* patches; // NULL for a full screen stimulus
+    struct movie* movie;      // NULL unless it plays a movie file
+    struct image* image;      // NULL unless it shows an image
+    GLuint lutTexture;        // one period of the carrier, 0 unless drawn from it
 } shader;
 
+struct cycleCache;
+
 typedef struct {
     int device;
     EGLDisplay display;
     EGLContext context;
     EGLSurface surface;
     shader* currentShaderPtr;
+    int presentMode;
+    int timebase;
+    int cacheMode;
+    struct cycleCache* currentCache; // cycle to play back instead of rendering
+    int recovery;
+    int damageTracking; // scissor each frame to what changes, needs EGL_EXT_buffer_age
 } GLconfig;
 
+#define DAMAGE_HISTORY 4 // frames of damage kept, so the oldest back buffer age that helps
+#define SKEW_SLOTS 5 // -2 to 2 vblanks
+
 typedef struct {
     drmModeModeInfo mode;
     struct gbm_device *gbmDevice;
@@ -67,14 +201,444 @@ typedef struct {
     uint32_t connectorId;
     struct gbm_bo *previousBo; //needs to be null
     uint32_t previousFb;
+    struct gbm_bo *pendingBo; // queued by drmModePageFlip, not on screen yet
+    int flipPending;
+    int modeSet;
+    int crtcIndex; // position in drmModeRes.crtcs, needed by drmWaitVBlank
+    EGLSurface surface;  // outputs after the first, the first uses GLconfig.surface
+    shader* shaderPtr;   // what the output shows, NULL for the first output's stimulus
+    int drawn;           // a new frame is waiting to be flipped
+    long flipTime;       // scanout time of the last completed flip
+    long skewCount;      // flips compared with the first output's
+    double skewSum;
+    long skewMax;        // largest skew either way
+    long firstSkew;      // skew of the run's first frame, what skewSlots count from
+    long skewSlots[SKEW_SLOTS]; // flips at each whole number of vblanks from firstSkew
+    int slipped;         // flips that went out a vblank apart from the first output's
+    uint16_t* savedGamma; // the CRTC's own gamma ramps, red, green then blue, while we replace them
+    struct drm_mode_rect damageHistory[DAMAGE_HISTORY]; // what each of the latest frames drew over background, newest first
+    int damageFrames;    // frames in damageHistory
+    struct drm_mode_rect damage[2]; // changed since the frame on screen, for the kernel: stimulus, sync patch
+    int damageClips;     // rects in damage
+    int damaged;         // damage holds for the frame about to go out
+    struct drm_mode_rect frameRect; // what the frame about to go out draws over background
+    int rectDrawn;       // frameRect holds
+    int patched;         // the frame about to go out carries the sync patch
+    int dirtyFbFailed;   // the driver takes no drmModeDirtyFB()
+    int flipLanded;      // the frame pulse thread saw the flip complete, flipEvent holds it
+    unsigned int flipEvent[3]; // vblank sequence, seconds and microseconds of that flip
 } drmConfig;
 
+// Outputs driven from the one DRM device, each on its own CRTC with its own
+// gbm_surface, all rendered by the one context. drm is the first: the vblank
+// clock, the frame pulse and the frame statistics follow it. The others are
+// flipped together with it and their skew against it is recorded.
+#define MAX_OUTPUTS 4
+
 drmConfig drm;
+drmConfig* outputs[MAX_OUTPUTS] = {&drm};
+int outputCount = 1;
+
+// All times are CLOCK_MONOTONIC microseconds, the same clock the kernel uses
+// for vblank and page flip event timestamps.
+typedef struct {
+    double refreshPeriod;       // microseconds per vblank, from drm.mode
+    long lastVblank;            // timestamp of the most recent vblank we know of
+    unsigned int lastSequence;  // and its vblank counter
+    unsigned long presentCount; // frames that have actually reached the screen
+} vblankClock;
+
+vblankClock frameClock;
 
-struct timeval tv;
 long get_time_micros() {
-    gettimeofday(&tv,NULL);
-    return 1000000 * tv.tv_sec + tv.tv_usec;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000L * ts.tv_sec + ts.tv_nsec / 1000;
+}
+
+static double getRefreshPeriod(drmModeModeInfo* mode) {
+    if (mode->clock && mode->htotal && mode->vtotal) {
+        // clock is in kHz
+        return (double)mode->htotal * mode->vtotal * 1000.0 / mode->clock;
+    }
+    return 1000000.0 / (mode->vrefresh ? mode->vrefresh : 60);
+}
+
+// Record that a frame hit the screen at the vblank with this sequence number.
+static void recordPresent(unsigned int sequence, long timestamp) {
+    frameClock.lastSequence = sequence;
+    frameClock.lastVblank = timestamp;
+    frameClock.presentCount++;
+}
+
+// Ask the kernel for the counter and timestamp of the most recent vblank on
+// our CRTC. Returns 0 on success.
+static int queryVblank(int device, unsigned int *sequence, long *timestamp) {
+    drmVBlank vbl;
+    memset(&vbl, 0, sizeof(vbl));
+    vbl.request.type = DRM_VBLANK_RELATIVE;
+    if (drm.crtcIndex == 1) {
+        vbl.request.type |= DRM_VBLANK_SECONDARY;
+    } else if (drm.crtcIndex > 1) {
+        vbl.request.type |= (drm.crtcIndex << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+    }
+    vbl.request.sequence = 0;
+    if (drmWaitVBlank(device, &vbl)) {
+        return -1;
+    }
+    *sequence = vbl.reply.sequence;
+    *timestamp = 1000000L * vbl.reply.tval_sec + vbl.reply.tval_usec;
+    return 0;
+}
+
+static void syncVblankClock(int device) {
+    unsigned int sequence;
+    long timestamp;
+    frameClock.refreshPeriod = getRefreshPeriod(&drm.mode);
+    if (queryVblank(device, &sequence, &timestamp) == 0) {
+        frameClock.lastSequence = sequence;
+        frameClock.lastVblank = timestamp;
+    } else {
+        frameClock.lastVblank = get_time_micros();
+    }
+}
+
+// Best estimate of when the frame we are about to draw will be scanned out:
+// the first vblank from now, pushed back by one if a flip is already queued
+// for it.
+long predictNextVblank() {
+    long now = get_time_micros();
+    double period = frameClock.refreshPeriod;
+    long elapsed = now - frameClock.lastVblank;
+    long vblanks = elapsed < 0 ? 1 : (long)(elapsed / period) + 1;
+    if (drm.flipPending) {
+        vblanks++;
+    }
+    return frameClock.lastVblank + (long)(vblanks * period + 0.5);
+}
+
+// Temporal phase of the stimulus in radians, wrapped to [0, 2pi). This is
+// worked out in double on the CPU so it stays exact over multi-hour sessions;
+// only the wrapped value is handed to the shader as a float.
+static float wrapPhase(double cycles) {
+    float phase = (float)(2.0 * M_PI * (cycles - floor(cycles)));
+    if (phase >= (float)(2.0 * M_PI)) {
+        phase = 0.0f;
+    }
+    return phase;
+}
+
+// Phase of frame frameIndex of a run locked to a refresh period in microseconds.
+static float framePhase(double refreshPeriod, float cyclesPerSecond, long frameIndex) {
+    return wrapPhase((double)frameIndex * refreshPeriod * cyclesPerSecond / 1000000.0);
+}
+
+static float stimulusPhase(int timebase, float cyclesPerSecond, long frameIndex, long elapsedMicros) {
+    if (timebase == TIMEBASE_FRAME) {
+        return framePhase(frameClock.refreshPeriod, cyclesPerSecond, frameIndex);
+    }
+    return wrapPhase((double)elapsedMicros * cyclesPerSecond / 1000000.0);
+}
+
+// GPIO through the kernel's GPIO character device (v2 uAPI).
+//
+// The trigger is the first rising edge on the trigger line after a display
+// is armed. The kernel timestamps each edge on CLOCK_MONOTONIC when it
+// happens, and we sleep in poll() until then instead of spinning on the
+// level, so the trigger time does not depend on when we got scheduled.
+//
+// The optional frame pulse goes high on every flip completion. Its rising
+// edge is the timing mark, and it goes low again pulseWidth microseconds
+// later. While it is on, a thread of its own reads the page flip events off
+// the DRM device, so the edge follows the flip as soon as the kernel reports
+// it rather than when the render thread next comes to wait for the flip, and
+// lowers the line, so the render thread never sleeps for it. waitForFlip()
+// then takes the flips the thread has seen instead of reading the device
+// itself. Frames put on screen by a modeset, or offscreen, raise the line
+// from the render thread straight away.
+//
+// Line numbers are offsets on chipPath, which on a Pi are the BCM GPIO
+// numbers, and -1 means no line, for the trigger as for the pulse.
+// Pointing chipPath at a gpio-sim or gpio-mockup chip runs all of this
+// without a Pi.
+#define TRIGGER_HISTORY 1024
+
+typedef struct {
+    char chipPath[PATH_MAX];
+    int triggerFd;          // line request for the trigger input, or -1
+    int triggerLine;
+    int pulseFd;            // line request for the frame pulse output, or -1
+    int pulseLine;
+    long pulseWidth;
+    long pulseStart;        // when the pulse went high, 0 while low
+    pthread_t pulseThread;
+    int pulseThreadRunning;
+    int pulseWake;          // eventfd that wakes the pulse thread
+    atomic_int stopPulse;
+    int flipDevice;         // DRM device whose flip events the pulse thread reads, or -1
+    pthread_mutex_t pulseLock; // the line, pulseStart, flipDevice and each output's flipLanded
+    pthread_cond_t flipLanded;
+    long latencies[TRIGGER_HISTORY]; // trigger edge to first scanout, microseconds
+    int latencyCount;       // total recorded, the history keeps the newest
+} gpioConfig;
+
+gpioConfig gpio = {
+    .chipPath = "/dev/gpiochip0",
+    .triggerFd = -1,
+    .triggerLine = -1,
+    .pulseFd = -1,
+    .pulseLine = -1,
+    .pulseWidth = 1000,
+    .pulseWake = -1,
+    .flipDevice = -1,
+    .pulseLock = PTHREAD_MUTEX_INITIALIZER,
+    .flipLanded = PTHREAD_COND_INITIALIZER,
+};
+
+static int requestLine(int line, uint64_t flags, const char* consumer) {
+    int chipFd = open(gpio.chipPath, O_RDWR | O_CLOEXEC);
+    if (chipFd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", gpio.chipPath, strerror(errno));
+        return -1;
+    }
+    struct gpio_v2_line_request request;
+    memset(&request, 0, sizeof(request));
+    request.offsets[0] = line;
+    request.num_lines = 1;
+    request.config.flags = flags;
+    snprintf(request.consumer, sizeof(request.consumer), "%s", consumer);
+    int result = ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request);
+    int error = errno;
+    close(chipFd);
+    if (result < 0) {
+        fprintf(stderr, "Unable to request line %d of %s: %s\n", line, gpio.chipPath, strerror(error));
+        errno = error;
+        return -1;
+    }
+    return request.fd;
+}
+
+static void setLine(int fd, int value) {
+    struct gpio_v2_line_values values = {.bits = value ? 1 : 0, .mask = 1};
+    ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+}
+
+static void wakePulseThread() {
+    uint64_t one = 1;
+    if (write(gpio.pulseWake, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "Unable to wake the frame pulse thread: %s\n", strerror(errno));
+    }
+}
+
+// Called with pulseLock held. A frame that lands while the line is still high
+// from the one before gets a falling edge first, so every frame has its edge.
+static void raiseFramePulse() {
+    if (gpio.pulseStart) {
+        setLine(gpio.pulseFd, 0);
+    }
+    setLine(gpio.pulseFd, 1);
+    gpio.pulseStart = get_time_micros();
+}
+
+// The render thread put a frame on screen itself.
+static void startFramePulse() {
+    if (!gpio.pulseThreadRunning) {
+        return;
+    }
+    pthread_mutex_lock(&gpio.pulseLock);
+    raiseFramePulse();
+    pthread_mutex_unlock(&gpio.pulseLock);
+    wakePulseThread();
+}
+
+// data is the drmConfig of the output the flip was queued on.
+static void pulseFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *data) {
+    drmConfig* out = data;
+    pthread_mutex_lock(&gpio.pulseLock);
+    if (out == &drm) {
+        raiseFramePulse();
+    }
+    out->flipEvent[0] = sequence;
+    out->flipEvent[1] = tv_sec;
+    out->flipEvent[2] = tv_usec;
+    out->flipLanded = 1;
+    pthread_cond_broadcast(&gpio.flipLanded);
+    pthread_mutex_unlock(&gpio.pulseLock);
+}
+
+static void* framePulseThread(void* arg) {
+    drmEventContext evctx = {
+        .version = 2,
+        .page_flip_handler = pulseFlipHandler,
+    };
+    while (!atomic_load(&gpio.stopPulse)) {
+        pthread_mutex_lock(&gpio.pulseLock);
+        struct timespec timeout;
+        struct timespec* timeoutPtr = NULL;
+        if (gpio.pulseStart) {
+            long remaining = gpio.pulseStart + gpio.pulseWidth - get_time_micros();
+            if (remaining <= 0) {
+                setLine(gpio.pulseFd, 0);
+                gpio.pulseStart = 0;
+            } else {
+                timeout.tv_sec = remaining / 1000000;
+                timeout.tv_nsec = remaining % 1000000 * 1000;
+                timeoutPtr = &timeout;
+            }
+        }
+        int device = gpio.flipDevice;
+        pthread_mutex_unlock(&gpio.pulseLock);
+
+        struct pollfd pfd[2] = {
+            {.fd = gpio.pulseWake, .events = POLLIN},
+            {.fd = device, .events = POLLIN},
+        };
+        if (ppoll(pfd, device >= 0 ? 2 : 1, timeoutPtr, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Frame pulse poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(gpio.pulseWake, &count, sizeof(count)) != sizeof(count)) {
+                continue;
+            }
+        }
+        if (device >= 0 && (pfd[1].revents & POLLIN)) {
+            drmHandleEvent(device, &evctx);
+        }
+    }
+    return NULL;
+}
+
+static void stopPulseThread() {
+    if (!gpio.pulseThreadRunning) {
+        return;
+    }
+    atomic_store(&gpio.stopPulse, 1);
+    wakePulseThread();
+    pthread_join(gpio.pulseThread, NULL);
+    gpio.pulseThreadRunning = 0;
+    close(gpio.pulseWake);
+    gpio.pulseWake = -1;
+}
+
+static int startPulseThread() {
+    gpio.pulseWake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (gpio.pulseWake < 0) {
+        return -1;
+    }
+    atomic_store(&gpio.stopPulse, 0);
+    int error = pthread_create(&gpio.pulseThread, NULL, framePulseThread, NULL);
+    if (error) {
+        close(gpio.pulseWake);
+        gpio.pulseWake = -1;
+        errno = error;
+        return -1;
+    }
+    gpio.pulseThreadRunning = 1;
+    return 0;
+}
+
+// Hand the flip events of device to the pulse thread, or take them back
+// with -1. Only done while no flip is pending.
+static void setFramePulseDevice(int device) {
+    if (!gpio.pulseThreadRunning || gpio.flipDevice == device) {
+        return;
+    }
+    pthread_mutex_lock(&gpio.pulseLock);
+    gpio.flipDevice = device;
+    pthread_mutex_unlock(&gpio.pulseLock);
+    wakePulseThread();
+}
+
+static void closeFramePulse() {
+    stopPulseThread();
+    gpio.flipDevice = -1;
+    if (gpio.pulseFd >= 0) {
+        setLine(gpio.pulseFd, 0);
+        close(gpio.pulseFd);
+        gpio.pulseFd = -1;
+    }
+    gpio.pulseLine = -1;
+    gpio.pulseStart = 0;
+}
+
+void closeGpio() {
+    if (gpio.triggerFd >= 0) {
+        close(gpio.triggerFd);
+    }
+    gpio.triggerFd = -1;
+    gpio.triggerLine = -1;
+    closeFramePulse();
+}
+
+// Line -1 turns the pulse off. Returns 0 on success.
+int setFramePulse(int line, long width) {
+    closeFramePulse();
+    gpio.pulseWidth = width;
+    if (line < 0) {
+        return 0;
+    }
+    gpio.pulseFd = requestLine(line, GPIO_V2_LINE_FLAG_OUTPUT, "rpg frame pulse");
+    if (gpio.pulseFd < 0) {
+        return -1;
+    }
+    if (startPulseThread() < 0) {
+        int error = errno;
+        close(gpio.pulseFd);
+        gpio.pulseFd = -1;
+        errno = error;
+        return -1;
+    }
+    gpio.pulseLine = line;
+    return 0;
+}
+
+// Sleep until a rising edge on line. edgeTime gets the kernel's timestamp of
+// the edge and wakeTime when we got to run after it. Returns 0 on success.
+int waitForTrigger(int line, long* edgeTime, long* wakeTime) {
+    if (gpio.triggerFd < 0 || gpio.triggerLine != line) {
+        if (gpio.triggerFd >= 0) {
+            close(gpio.triggerFd);
+        }
+        gpio.triggerLine = -1;
+        gpio.triggerFd = requestLine(line, GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING, "rpg trigger");
+        if (gpio.triggerFd < 0) {
+            return -1;
+        }
+        fcntl(gpio.triggerFd, F_SETFL, O_NONBLOCK);
+        gpio.triggerLine = line;
+    }
+
+    // edges from before the display was armed do not count
+    struct gpio_v2_line_event event;
+    while (read(gpio.triggerFd, &event, sizeof(event)) == sizeof(event)) {
+        continue;
+    }
+
+    struct pollfd pfd = {.fd = gpio.triggerFd, .events = POLLIN};
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Waiting for the trigger failed: %s\n", strerror(errno));
+            return -1;
+        }
+        if (read(gpio.triggerFd, &event, sizeof(event)) == sizeof(event)) {
+            *wakeTime = get_time_micros();
+            *edgeTime = event.timestamp_ns / 1000;
+            return 0;
+        }
+    }
+}
+
+static void recordTriggerLatency(long latency) {
+    gpio.latencies[gpio.latencyCount % TRIGGER_HISTORY] = latency;
+    gpio.latencyCount++;
 }
 
 // The following code related to DRM/GBM was adapted from the following sources:
@@ -106,6 +670,45 @@ static drmModeEncoder* findEncoder(drmModeConnector *connector, int device) {
     return NULL;
 }
 
+static int crtcInUse(uint32_t crtcId) {
+    for (int i = 0; i < outputCount; i++) {
+        if (outputs[i]->crtc && outputs[i]->crtc->crtc_id == crtcId) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A CRTC for another output: the one already driving the connector if no
+// output has it, else the first free one any of its encoders can drive.
+// Returns its position in resources->crtcs, or -1.
+static int findFreeCrtc(drmModeRes *resources, drmModeConnector *connector, int device) {
+    drmModeEncoder *encoder = findEncoder(connector, device);
+    if (encoder) {
+        uint32_t crtcId = encoder->crtc_id;
+        drmModeFreeEncoder(encoder);
+        for (int c = 0; c < resources->count_crtcs; c++) {
+            if (crtcId && resources->crtcs[c] == crtcId && !crtcInUse(crtcId)) {
+                return c;
+            }
+        }
+    }
+    for (int e = 0; e < connector->count_encoders; e++) {
+        encoder = drmModeGetEncoder(device, connector->encoders[e]);
+        if (encoder == NULL) {
+            continue;
+        }
+        uint32_t possible = encoder->possible_crtcs;
+        drmModeFreeEncoder(encoder);
+        for (int c = 0; c < resources->count_crtcs; c++) {
+            if ((possible & (1u << c)) && !crtcInUse(resources->crtcs[c])) {
+                return c;
+            }
+        }
+    }
+    return -1;
+}
+
 static int getDisplay(EGLDisplay *display, int device, int mode) {
     drmModeRes *resources = drmModeGetResources(device);
     if (resources == NULL)  {
@@ -135,6 +738,12 @@ static int getDisplay(EGLDisplay *display, int device, int mode) {
     }
 
     drm.crtc = drmModeGetCrtc(device, encoder->crtc_id);
+    drm.crtcIndex = 0;
+    for (int i = 0; i < resources->count_crtcs; i++) {
+        if (resources->crtcs[i] == encoder->crtc_id) {
+            drm.crtcIndex = i;
+        }
+    }
     drmModeFreeEncoder(encoder);
     drmModeFreeConnector(connector);
     drmModeFreeResources(resources);
@@ -160,142 +769,1447 @@ static int matchConfigToVisual(EGLDisplay display, EGLint visualId, EGLConfig *c
 
 
 
+// Tell the kernel which part of fb changed, for drivers that copy or
+// compress what they scan out. Only sent for a frame with partial damage.
+static void sendDamage(drmConfig* out, uint32_t fb, int device) {
+    if (!out->damaged || out->dirtyFbFailed) {
+        return;
+    }
+    out->damaged = 0;
+    drmModeClip clips[2];
+    for (int i = 0; i < out->damageClips; i++) {
+        clips[i] = (drmModeClip){out->damage[i].x1, out->damage[i].y1, out->damage[i].x2, out->damage[i].y2};
+    }
+    if (drmModeDirtyFB(device, fb, clips, out->damageClips) != 0) {
+        // most drivers scan out the whole buffer anyway and say so once
+        out->dirtyFbFailed = 1;
+    }
+}
+
 static void gbmSwapBuffers(EGLDisplay *display, EGLSurface *surface, int device) {
     eglSwapBuffers(*display, *surface);
+    drm.drawn = 1;
+
+    for (int i = 0; i < outputCount; i++) {
+        drmConfig* out = outputs[i];
+        if (!out->drawn) {
+            continue;
+        }
+        out->drawn = 0;
+        struct gbm_bo *bo = gbm_surface_lock_front_buffer(out->gbmSurface);
+        if (bo == NULL) {
+            fprintf(stderr, "Failed to lock front buffer\n");
+            continue;
+        }
+        uint32_t handle = gbm_bo_get_handle(bo).u32;
+        uint32_t pitch = gbm_bo_get_stride(bo);
+        uint32_t fb;
+
+        drmModeAddFB(device, out->mode.hdisplay, out->mode.vdisplay, 24, 32, pitch, handle, &fb);
+
+        sendDamage(out, fb, device);
+        drmModeSetCrtc(device, out->crtc->crtc_id, fb, 0, 0, &(out->connectorId), 1, &(out->mode)); //vsynching occurs in here, somehow.
+
+        // The modeset returns once the new framebuffer has been latched, so the
+        // latest vblank is the one it went out on.
+        if (out == &drm) {
+            unsigned int sequence;
+            long timestamp;
+            if (queryVblank(device, &sequence, &timestamp) == 0) {
+                recordPresent(sequence, timestamp);
+            } else {
+                recordPresent(frameClock.lastSequence + 1, get_time_micros());
+            }
+            startFramePulse();
+        }
+
+        if (out->previousBo) {
+            drmModeRmFB(device, out->previousFb);
+            gbm_surface_release_buffer(out->gbmSurface, out->previousBo);
+        }
+
+        out->previousBo = bo;
+        out->previousFb = fb;
+    }
+}
 
-    struct gbm_bo *bo = gbm_surface_lock_front_buffer(drm.gbmSurface);
-    if (bo == NULL) {
-        fprintf(stderr, "Failed to lock front buffer\n");
+// Framebuffers for the page flip path are created once per gbm_bo and kept
+// in the bo's user data. gbm calls this when the gbm_surface destroys the bo.
+static void destroyFbCallback(struct gbm_bo *bo, void *data) {
+    uint32_t *fb = data;
+    int device = gbm_device_get_fd(gbm_bo_get_device(bo));
+    drmModeRmFB(device, *fb);
+    free(fb);
+}
+
+static uint32_t getFbForBo(struct gbm_bo *bo, int device) {
+    uint32_t *fb = gbm_bo_get_user_data(bo);
+    if (fb) {
+        return *fb;
     }
+
+    fb = malloc(sizeof(uint32_t));
     uint32_t handle = gbm_bo_get_handle(bo).u32;
     uint32_t pitch = gbm_bo_get_stride(bo);
-    uint32_t fb;
+    if (drmModeAddFB(device, gbm_bo_get_width(bo), gbm_bo_get_height(bo), 24, 32, pitch, handle, fb)) {
+        fprintf(stderr, "Failed to create framebuffer: %s\n", strerror(errno));
+        free(fb);
+        return 0;
+    }
+    gbm_bo_set_user_data(bo, fb, destroyFbCallback);
+    return *fb;
+}
 
-    drmModeAddFB(device, drm.mode.hdisplay, drm.mode.vdisplay, 24, 32, pitch, handle, &fb);
+// data is the drmConfig of the output the flip was queued on.
+static void pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *data) {
+    drmConfig* out = data;
+    out->flipPending = 0;
+    out->flipTime = 1000000L * tv_sec + tv_usec;
+    if (out == &drm) {
+        recordPresent(sequence, out->flipTime);
+    }
+}
 
-    drmModeSetCrtc(device, drm.crtc->crtc_id, fb, 0, 0, &(drm.connectorId), 1, &(drm.mode)); //vsynching occurs in here, somehow.
+static int flipsPending() {
+    for (int i = 0; i < outputCount; i++) {
+        if (outputs[i]->flipPending) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    if (drm.previousBo) {
-        drmModeRmFB(device, drm.previousFb);
-        gbm_surface_release_buffer(drm.gbmSurface, drm.previousBo);
+// Skew of an output's flip against the first output's flip of the same
+// frame. The two CRTCs keep a steady offset while they stay in step, so each
+// skew is rounded to whole vblanks from the first frame's and counted. The
+// offset most of the run was at is the baseline, and every flip at any other
+// is one that went out on a different vblank from the first output's.
+static void recordSkew(drmConfig* out) {
+    long skew = out->flipTime - drm.flipTime;
+    if (out->skewCount == 0) {
+        out->firstSkew = skew;
+    }
+    int slot = (int)lround((skew - out->firstSkew) / frameClock.refreshPeriod) + SKEW_SLOTS / 2;
+    slot = slot < 0 ? 0 : slot >= SKEW_SLOTS ? SKEW_SLOTS - 1 : slot;
+    out->skewSlots[slot]++;
+    long baseline = 0;
+    for (int i = 0; i < SKEW_SLOTS; i++) {
+        if (out->skewSlots[i] > baseline) {
+            baseline = out->skewSlots[i];
+        }
     }
+    out->skewCount++;
+    out->slipped = out->skewCount - baseline;
+    out->skewSum += skew;
+    if (labs(skew) > labs(out->skewMax)) {
+        out->skewMax = skew;
+    }
+}
 
-    drm.previousBo = bo;
-    drm.previousFb = fb;
+static void resetSkew() {
+    for (int i = 0; i < outputCount; i++) {
+        outputs[i]->skewCount = 0;
+        outputs[i]->skewSum = 0.0;
+        outputs[i]->skewMax = 0;
+        outputs[i]->firstSkew = 0;
+        memset(outputs[i]->skewSlots, 0, sizeof(outputs[i]->skewSlots));
+        outputs[i]->slipped = 0;
+    }
 }
 
-static void gbmClean(int device) {
-    // set the previous crtc
-    drmModeSetCrtc(device, drm.crtc->crtc_id, drm.crtc->buffer_id, drm.crtc->x, drm.crtc->y, &drm.connectorId, 1, &drm.crtc->mode);
-    drmModeFreeCrtc(drm.crtc);
+// Block until the outstanding flips on every output have completed. The bos
+// that were on screen before them can then go back to their gbm_surfaces.
+static void waitForFlip(int device) {
+    drmEventContext evctx = {
+        .version = 2,
+        .page_flip_handler = pageFlipHandler,
+    };
+    struct pollfd pfd = { .fd = device, .events = POLLIN };
+
+    if (gpio.pulseThreadRunning) {
+        // the frame pulse thread reads the events and hands the flips over
+        setFramePulseDevice(device);
+        pthread_mutex_lock(&gpio.pulseLock);
+        for (;;) {
+            for (int i = 0; i < outputCount; i++) {
+                drmConfig* out = outputs[i];
+                if (out->flipLanded) {
+                    out->flipLanded = 0;
+                    pageFlipHandler(device, out->flipEvent[0], out->flipEvent[1], out->flipEvent[2], out);
+                }
+            }
+            if (!flipsPending()) {
+                break;
+            }
+            pthread_cond_wait(&gpio.flipLanded, &gpio.pulseLock);
+        }
+        pthread_mutex_unlock(&gpio.pulseLock);
+    }
 
-    if (drm.previousBo) {
-        drmModeRmFB(device, drm.previousFb);
-        gbm_surface_release_buffer(drm.gbmSurface, drm.previousBo);
+    while (flipsPending()) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll on the DRM device failed: %s\n", strerror(errno));
+            return;
+        }
+        drmHandleEvent(device, &evctx);
     }
 
-    gbm_surface_destroy(drm.gbmSurface);
-    gbm_device_destroy(drm.gbmDevice);
+    if (drm.pendingBo) {
+        for (int i = 1; i < outputCount; i++) {
+            if (outputs[i]->pendingBo) {
+                recordSkew(outputs[i]);
+            }
+        }
+    }
+    for (int i = 0; i < outputCount; i++) {
+        drmConfig* out = outputs[i];
+        if (out->pendingBo) {
+            if (out->previousBo) {
+                gbm_surface_release_buffer(out->gbmSurface, out->previousBo);
+            }
+            out->previousBo = out->pendingBo;
+            out->pendingBo = NULL;
+        }
+    }
 }
 
-const char* vertexShaderSource =
-    "attribute vec3 pos;"
-    "varying vec3 fragPos;"
-    "void main() {"
-    "    gl_Position = vec4(pos, 1.0);"
-    "    fragPos = pos;"
-    "}";
+static void flipOutput(drmConfig* out, struct gbm_bo *bo, uint32_t fb, int device) {
+    if (!out->modeSet) {
+        if (drmModeSetCrtc(device, out->crtc->crtc_id, fb, 0, 0, &(out->connectorId), 1, &(out->mode))) {
+            fprintf(stderr, "Failed to set mode: %s\n", strerror(errno));
+        }
+        out->modeSet = 1;
+        unsigned int sequence;
+        long timestamp;
+        if (out == &drm && queryVblank(device, &sequence, &timestamp) == 0) {
+            recordPresent(sequence, timestamp);
+        }
+        if (out == &drm) {
+            startFramePulse();
+        }
+        if (out->previousBo) {
+            gbm_surface_release_buffer(out->gbmSurface, out->previousBo);
+        }
+        out->previousBo = bo;
+        return;
+    }
 
-char sinFragSourceBuffer[] = 
-    "uniform float time;"
-    "uniform float angle;"
-    "uniform float spatial;"
-    "uniform float aspectRatio;"
-    "uniform float cyclesPerSecond;"
-    "varying vec3 fragPos;"
-    "float phase = 0.0;"
+    if (drmModePageFlip(device, out->crtc->crtc_id, fb, DRM_MODE_PAGE_FLIP_EVENT, out)) {
+        fprintf(stderr, "Failed to queue page flip: %s\n", strerror(errno));
+        gbm_surface_release_buffer(out->gbmSurface, bo);
+        return;
+    }
+    out->pendingBo = bo;
+    out->flipPending = 1;
+}
 
-    "float cosine = cos(angle)*spatial*aspectRatio;"
-    "float sine = sin(angle)*spatial;"
-    "void main() {"
-    " phase = 2.0 * 3.1415 * time * cyclesPerSecond;"
-    " float m = sin(cosine*fragPos.x + sine*fragPos.y + phase) * 0.5 + 0.5;"
-    " gl_FragColor = vec4(m, m, m, 1.0);"
-    "}";
+// Photodiode sync patch.
+//
+// Sequence frames carry their frame number, their index in the present
+// times, in a row of square cells running from a corner of the screen
+// along its top or bottom edge. Cell i, counted from the corner, is white
+// where bit i of the code is set and black where it is not. SYNC_GRAY
+// codes the number so that exactly one cell changes from each frame to the
+// next, and a camera exposing across two frames reads one number or the
+// other, never a mix; SYNC_BINARY is the number itself, so the corner cell
+// alone alternates every frame for a single photodiode. Numbers wrap after
+// 2^bits frames, which is also where the Gray code comes back round.
+//
+// The cells are scissored clears, with no program run for them.
+#define SYNC_TOP_LEFT 0
+#define SYNC_TOP_RIGHT 1
+#define SYNC_BOTTOM_LEFT 2
+#define SYNC_BOTTOM_RIGHT 3
 
-const char* sinFragSource = sinFragSourceBuffer;
+#define SYNC_BINARY 0
+#define SYNC_GRAY 1
 
-char squareFragSourceBuffer[] = 
-    "uniform float time;"
-    "uniform float angle;"
-    "uniform float spatial;"
-    "uniform float aspectRatio;"
-    "uniform float cyclesPerSecond;"
-    "varying vec3 fragPos;"
-    "float phase = 0.0;"
+#define SYNC_MAX_BITS 24
 
-    "float cosine = cos(angle)*spatial*aspectRatio;"
-    "float sine = sin(angle)*spatial;"
-    "void main() {"
-    " phase = 2.0 * 3.1415 * time * cyclesPerSecond;"
-    " float m = smoothstep(-0.05, 0.05, sin(cosine*fragPos.x + sine*fragPos.y + phase));"
-    " gl_FragColor = vec4(m, m, m, 1.0);"
-    "}";
+typedef struct {
+    int enabled;
+    int corner;
+    int code;
+    int bits;
+    int cellSize; // pixels
+} syncPatchConfig;
+
+syncPatchConfig syncPatch = {1, SYNC_TOP_LEFT, SYNC_GRAY, 8, 16};
+
+// Returns -1, changing nothing, for a corner, code or size there is no
+// such thing as.
+int setSyncPatch(int enabled, int corner, int code, int bits, int cellSize) {
+    if (corner < SYNC_TOP_LEFT || corner > SYNC_BOTTOM_RIGHT || (code != SYNC_BINARY && code != SYNC_GRAY) ||
+        bits < 1 || bits > SYNC_MAX_BITS || cellSize < 1) {
+        return -1;
+    }
+    syncPatch = (syncPatchConfig){enabled, corner, code, bits, cellSize};
+    return 0;
+}
 
-const char* squareFragSource = squareFragSourceBuffer;
+// What the cells show for frame.
+uint32_t syncCode(unsigned long frame) {
+    uint32_t number = frame & ((1u << syncPatch.bits) - 1);
+    return syncPatch.code == SYNC_GRAY ? number ^ (number >> 1) : number;
+}
 
-char gaborFragSourceBuffer[] = 
-    "uniform vec4 color;"
-    "uniform float time;"
-    "varying vec3 fragPos;"
-    "float phase = 0.00000;"
-    "const float spatial = 20.1000;"
-    "const float angle = 1.00000;"
-    "const float sigma = 0.10000;"
-    "const float center_x = 0.00000;"
-    "const float center_y = 0.00000;"
-    "float cosine = cos(angle)*spatial;"
-    "float sine = sin(angle)*spatial;"
-    "float gaussian(float x, float y) {"
-    "  return  exp( -((x-center_x)*(x-center_x) + (y-center_y)*(y-center_y) ) / sigma ) ;"
-    "}"
-    "void main() {"
-    " phase = time / 0.2;"
-    " float m = gaussian(fragPos.x, fragPos.y) * sin(cosine*fragPos.x + sine*fragPos.y + phase) * 0.5 + 0.5;"
-    " gl_FragColor =  vec4(m, m, m, 1.0);"
-    "}";
+// A rect of width by height in the patch's corner of out, top left origin.
+static void cornerRect(drmConfig* out, int width, int height, struct drm_mode_rect* rect) {
+    int right = syncPatch.corner == SYNC_TOP_RIGHT || syncPatch.corner == SYNC_BOTTOM_RIGHT;
+    int bottom = syncPatch.corner == SYNC_BOTTOM_LEFT || syncPatch.corner == SYNC_BOTTOM_RIGHT;
+    rect->x1 = right ? out->mode.hdisplay - width : 0;
+    rect->y1 = bottom ? out->mode.vdisplay - height : 0;
+    rect->x2 = rect->x1 + width;
+    rect->y2 = rect->y1 + height;
+}
 
-const char* gaborFragSource = gaborFragSourceBuffer;
+void syncPatchRect(drmConfig* out, struct drm_mode_rect* rect) {
+    cornerRect(out, syncPatch.bits * syncPatch.cellSize, syncPatch.cellSize, rect);
+}
 
-// Get the EGL error back as a string. Useful for debugging.
-static const char *eglGetErrorStr() {
-    switch (eglGetError()){
-    case EGL_SUCCESS:
-        return "The last function succeeded without error.";
-    case EGL_NOT_INITIALIZED:
-        return "EGL is not initialized, or could not be initialized, for the "
-               "specified EGL display connection.";
-    case EGL_BAD_ACCESS:
-        return "EGL cannot access a requested resource (for example a context "
-               "is bound in another thread).";
-    case EGL_BAD_ALLOC:
-        return "EGL failed to allocate resources for the requested operation.";
-    case EGL_BAD_ATTRIBUTE:
-        return "An unrecognized attribute or attribute value was passed in the "
-               "attribute list.";
-    case EGL_BAD_CONTEXT:
-        return "An EGLContext argument does not name a valid EGL rendering "
-               "context.";
-    case EGL_BAD_CONFIG:
-        return "An EGLConfig argument does not name a valid EGL frame buffer "
-               "configuration.";
-    case EGL_BAD_CURRENT_SURFACE:
-        return "The current surface of the calling thread is a window, pixel "
-               "buffer or pixmap that is no longer valid.";
-    case EGL_BAD_DISPLAY:
-        return "An EGLDisplay argument does not name a valid EGL display "
-               "connection.";
-    case EGL_BAD_SURFACE:
+// Draw the patch for frame on out, between beginDamage() and endDamage(),
+// which turns the scissor test back off.
+void drawSyncPatch(drmConfig* out, unsigned long frame) {
+    struct drm_mode_rect rect;
+    syncPatchRect(out, &rect);
+    uint32_t code = syncCode(frame);
+    int right = rect.x1 > 0;
+    GLfloat clearColor[4];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+    glEnable(GL_SCISSOR_TEST);
+    for (int i = 0; i < syncPatch.bits; i++) {
+        float level = (code >> i) & 1 ? 1.0f : 0.0f;
+        int x = right ? rect.x2 - (i + 1) * syncPatch.cellSize : rect.x1 + i * syncPatch.cellSize;
+        glScissor(x, out->mode.vdisplay - rect.y2, syncPatch.cellSize, syncPatch.cellSize);
+        glClearColor(level, level, level, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+}
+
+// Atomic modesetting with hardware planes.
+//
+// PRESENT_ATOMIC puts the first output's frames on screen with nonblocking
+// atomic commits instead of drmModePageFlip(). Where its CRTC has overlay
+// planes the display controller composes the screen rather than the GPU:
+// the background is a dumb buffer filled once with the background level and
+// shown on the primary plane, the stimulus buffer goes on an overlay
+// cropped to the rect the frame draws over background (beginDamage() then
+// renders only that rect), and the sync layer, a square in the sync patch's
+// corner that is dark on even frames and light on odd ones, is a pair of
+// dumb buffers on an overlay above it. Neither the background nor the sync
+// layer is ever rendered. On frames that carry the sync patch, the sync
+// layer's overlay scans the patch out of the stimulus buffer instead, so
+// the stimulus crop stays the stimulus.
+//
+// With one overlay there is no sync layer. The GPU composes the whole
+// screen on the primary plane, as with page flips, when:
+//
+//   - the CRTC has no overlay,
+//   - frames carry the sync patch but there is no sync layer, or
+//   - the driver turns the layout down.
+//
+// Each new crop gets a test commit before the frame is drawn, and one the
+// driver refuses drops the planes from then on, so that frame is drawn
+// whole. Partial damage goes with the plane the stimulus is on as
+// FB_DAMAGE_CLIPS.
+//
+// Outputs added with addOutput() are still flipped with drmModePageFlip().
+#define PLANE_FB_ID 0
+#define PLANE_CRTC_ID 1
+#define PLANE_SRC_X 2
+#define PLANE_SRC_Y 3
+#define PLANE_SRC_W 4
+#define PLANE_SRC_H 5
+#define PLANE_CRTC_X 6
+#define PLANE_CRTC_Y 7
+#define PLANE_CRTC_W 8
+#define PLANE_CRTC_H 9
+#define PLANE_DAMAGE_CLIPS 10 // the only one a plane may lack
+#define PLANE_PROPS 11
+
+#define SYNC_LAYER_SIZE 32 // pixels
+
+static const char* planePropNames[PLANE_PROPS] = {
+    "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+    "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "FB_DAMAGE_CLIPS",
+};
+
+typedef struct {
+    uint32_t id; // 0 if there is no such plane
+    uint32_t props[PLANE_PROPS];
+} planeConfig;
+
+typedef struct {
+    uint32_t handle;
+    uint32_t pitch;
+    uint64_t size;
+    uint32_t fb;
+    uint8_t* pixels;
+} dumbBuffer;
+
+typedef struct {
+    int active;              // the first output is committed atomically
+    planeConfig primary;     // the background, or the whole frame when the GPU composes it
+    planeConfig stimulus;    // overlay for the stimulus buffer
+    planeConfig sync;        // overlay above it for the sync layer
+    int useStimulus;         // the planes the driver has taken so far
+    int useSync;
+    uint32_t crtcModeId;     // properties for the modeset
+    uint32_t crtcActive;
+    uint32_t connectorCrtcId;
+    uint32_t modeBlob;
+    dumbBuffer background;
+    dumbBuffer marker[2];    // the sync layer, dark then light
+    struct drm_mode_rect crop; // the last stimulus crop the driver took
+    int cropPatched;         // and whether the sync patch went with it
+    unsigned long commits;
+} atomicConfig;
+
+atomicConfig atomic;
+
+void resetDamage();
+
+// Id of the property called name on an object, with its value, or 0.
+static uint32_t findProperty(int device, uint32_t objectId, uint32_t objectType, const char* name, uint64_t* value) {
+    drmModeObjectProperties* props = drmModeObjectGetProperties(device, objectId, objectType);
+    uint32_t id = 0;
+    for (uint32_t i = 0; props && i < props->count_props && !id; i++) {
+        drmModePropertyRes* prop = drmModeGetProperty(device, props->props[i]);
+        if (prop && strcmp(prop->name, name) == 0) {
+            id = prop->prop_id;
+            if (value) {
+                *value = props->prop_values[i];
+            }
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return id;
+}
+
+static void getPlaneConfig(int device, uint32_t planeId, planeConfig* plane) {
+    plane->id = planeId;
+    for (int p = 0; p < PLANE_PROPS; p++) {
+        plane->props[p] = findProperty(device, planeId, DRM_MODE_OBJECT_PLANE, planePropNames[p], NULL);
+        if (plane->props[p] == 0 && p != PLANE_DAMAGE_CLIPS) {
+            plane->id = 0;
+            return;
+        }
+    }
+}
+
+// The first output's primary plane and the two lowest overlays its CRTC
+// can show XRGB8888 on. Returns -1 without a primary plane.
+static int findPlanes(int device) {
+    drmModePlaneRes* planes = drmModeGetPlaneResources(device);
+    if (planes == NULL) {
+        return -1;
+    }
+    uint32_t primary = 0;
+    uint32_t overlays[2] = {0, 0};
+    uint64_t zpos[2] = {UINT64_MAX, UINT64_MAX};
+    for (uint32_t i = 0; i < planes->count_planes; i++) {
+        drmModePlane* plane = drmModeGetPlane(device, planes->planes[i]);
+        if (plane == NULL) {
+            continue;
+        }
+        int usable = 0;
+        for (uint32_t f = 0; f < plane->count_formats && (plane->possible_crtcs & (1u << drm.crtcIndex)); f++) {
+            usable |= plane->formats[f] == GBM_FORMAT_XRGB8888;
+        }
+        int onCrtc = plane->crtc_id == drm.crtc->crtc_id;
+        uint32_t id = plane->plane_id;
+        drmModeFreePlane(plane);
+        uint64_t type;
+        uint64_t z = i;
+        if (!usable || !findProperty(device, id, DRM_MODE_OBJECT_PLANE, "type", &type)) {
+            continue;
+        }
+        findProperty(device, id, DRM_MODE_OBJECT_PLANE, "zpos", &z);
+        if (type == DRM_PLANE_TYPE_PRIMARY && (primary == 0 || onCrtc)) {
+            primary = id;
+        } else if (type == DRM_PLANE_TYPE_OVERLAY && z < zpos[0]) {
+            overlays[1] = overlays[0];
+            zpos[1] = zpos[0];
+            overlays[0] = id;
+            zpos[0] = z;
+        } else if (type == DRM_PLANE_TYPE_OVERLAY && z < zpos[1]) {
+            overlays[1] = id;
+            zpos[1] = z;
+        }
+    }
+    drmModeFreePlaneResources(planes);
+
+    if (primary) {
+        getPlaneConfig(device, primary, &atomic.primary);
+    }
+    if (overlays[0]) {
+        getPlaneConfig(device, overlays[0], &atomic.stimulus);
+    }
+    if (overlays[1]) {
+        getPlaneConfig(device, overlays[1], &atomic.sync);
+    }
+    return atomic.primary.id ? 0 : -1;
+}
+
+static void destroyDumb(int device, dumbBuffer* buffer) {
+    if (buffer->fb) {
+        drmModeRmFB(device, buffer->fb);
+    }
+    if (buffer->pixels) {
+        munmap(buffer->pixels, buffer->size);
+    }
+    if (buffer->handle) {
+        drmModeDestroyDumbBuffer(device, buffer->handle);
+    }
+    memset(buffer, 0, sizeof(dumbBuffer));
+}
+
+// An XRGB8888 framebuffer in memory we can write, filled with grey level.
+static int createDumb(int device, int width, int height, int level, dumbBuffer* buffer) {
+    memset(buffer, 0, sizeof(dumbBuffer));
+    uint64_t offset;
+    if (drmModeCreateDumbBuffer(device, width, height, 32, 0, &buffer->handle, &buffer->pitch, &buffer->size) ||
+        drmModeMapDumbBuffer(device, buffer->handle, &offset)) {
+        destroyDumb(device, buffer);
+        return -1;
+    }
+    buffer->pixels = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, device, offset);
+    if (buffer->pixels == MAP_FAILED) {
+        buffer->pixels = NULL;
+    }
+    if (buffer->pixels == NULL || drmModeAddFB(device, width, height, 24, 32, buffer->pitch, buffer->handle, &buffer->fb)) {
+        destroyDumb(device, buffer);
+        return -1;
+    }
+    memset(buffer->pixels, level, buffer->size);
+    return 0;
+}
+
+// Fill the background plane with the drive level stimuli have around them.
+void fillBackground(int level) {
+    if (atomic.background.pixels) {
+        memset(atomic.background.pixels, level, atomic.background.size);
+    }
+}
+
+// Show rect of fb on plane at the same place on the screen, or nothing
+// if fb is 0.
+static void addPlane(drmModeAtomicReq* req, planeConfig* plane, uint32_t fb, const struct drm_mode_rect* rect) {
+    uint32_t* props = plane->props;
+    if (fb == 0 || rect->x2 <= rect->x1 || rect->y2 <= rect->y1) {
+        drmModeAtomicAddProperty(req, plane->id, props[PLANE_FB_ID], 0);
+        drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_ID], 0);
+        return;
+    }
+    uint32_t width = rect->x2 - rect->x1;
+    uint32_t height = rect->y2 - rect->y1;
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_FB_ID], fb);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_ID], drm.crtc->crtc_id);
+    // source in 16.16 fixed point
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_X], (uint64_t)rect->x1 << 16);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_Y], (uint64_t)rect->y1 << 16);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_W], (uint64_t)width << 16);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_H], (uint64_t)height << 16);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_X], rect->x1);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_Y], rect->y1);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_W], width);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_H], height);
+}
+
+// Commit one frame of the layout: fb is the stimulus buffer, rect the part
+// of it on screen and damageBlob, if not 0, its FB_DAMAGE_CLIPS. The sync
+// layer's plane shows the sync patch from fb if patched, else the marker.
+static int commitLayout(int device, uint32_t fb, const struct drm_mode_rect* rect, int patched, uint32_t damageBlob,
+                        uint32_t flags) {
+    struct drm_mode_rect screen = {0, 0, drm.mode.hdisplay, drm.mode.vdisplay};
+    struct drm_mode_rect corner;
+    cornerRect(&drm, SYNC_LAYER_SIZE, SYNC_LAYER_SIZE, &corner);
+    drmModeAtomicReq* req = drmModeAtomicAlloc();
+    if (req == NULL) {
+        return -1;
+    }
+    if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+        drmModeAtomicAddProperty(req, drm.crtc->crtc_id, atomic.crtcModeId, atomic.modeBlob);
+        drmModeAtomicAddProperty(req, drm.crtc->crtc_id, atomic.crtcActive, 1);
+        drmModeAtomicAddProperty(req, drm.connectorId, atomic.connectorCrtcId, drm.crtc->crtc_id);
+    }
+    planeConfig* shown = &atomic.primary;
+    if (atomic.useStimulus) {
+        addPlane(req, &atomic.primary, atomic.background.fb, &screen);
+        addPlane(req, &atomic.stimulus, fb, rect);
+        shown = &atomic.stimulus;
+    } else {
+        addPlane(req, &atomic.primary, fb, &screen);
+        if (atomic.stimulus.id) {
+            addPlane(req, &atomic.stimulus, 0, NULL);
+        }
+    }
+    if (damageBlob && shown->props[PLANE_DAMAGE_CLIPS]) {
+        drmModeAtomicAddProperty(req, shown->id, shown->props[PLANE_DAMAGE_CLIPS], damageBlob);
+    }
+    if (atomic.useSync && patched) {
+        struct drm_mode_rect patch;
+        syncPatchRect(&drm, &patch);
+        addPlane(req, &atomic.sync, fb, &patch);
+    } else if (atomic.useSync) {
+        addPlane(req, &atomic.sync, atomic.marker[atomic.commits & 1].fb, &corner);
+    } else if (atomic.sync.id) {
+        addPlane(req, &atomic.sync, 0, NULL);
+    }
+    int result = drmModeAtomicCommit(device, req, flags, &drm);
+    drmModeAtomicFree(req);
+    return result;
+}
+
+// Give up a plane the driver will not take, the sync layer first. Returns
+// 0 once there are none left to give up.
+static int dropPlane() {
+    if (atomic.useSync) {
+        atomic.useSync = 0;
+        return 1;
+    }
+    if (atomic.useStimulus) {
+        atomic.useStimulus = 0;
+        // the buffers only hold their crops, the next frames must be whole
+        resetDamage();
+        return 1;
+    }
+    return 0;
+}
+
+// Switch the first output over to atomic commits and settle which layers
+// get planes, with a test commit of the whole layout. Returns -1, leaving
+// the output to drmModePageFlip(), if the driver has no atomic modesetting.
+int initAtomic(int device) {
+    memset(&atomic, 0, sizeof(atomic));
+    if (drmSetClientCap(device, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) || drmSetClientCap(device, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        fprintf(stderr, "No atomic modesetting, flipping pages instead\n");
+        return -1;
+    }
+    uint32_t crtcId = drm.crtc->crtc_id;
+    atomic.crtcModeId = findProperty(device, crtcId, DRM_MODE_OBJECT_CRTC, "MODE_ID", NULL);
+    atomic.crtcActive = findProperty(device, crtcId, DRM_MODE_OBJECT_CRTC, "ACTIVE", NULL);
+    atomic.connectorCrtcId = findProperty(device, drm.connectorId, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", NULL);
+    if (!atomic.crtcModeId || !atomic.crtcActive || !atomic.connectorCrtcId || findPlanes(device) < 0 ||
+        drmModeCreatePropertyBlob(device, &drm.mode, sizeof(drm.mode), &atomic.modeBlob)) {
+        fprintf(stderr, "Atomic modesetting without the properties we need, flipping pages instead\n");
+        memset(&atomic, 0, sizeof(atomic));
+        return -1;
+    }
+
+    // 0.5 is 127.5 levels, which the GPU rounds up
+    if (atomic.stimulus.id && createDumb(device, drm.mode.hdisplay, drm.mode.vdisplay, 128, &atomic.background) == 0) {
+        atomic.useStimulus = 1;
+    }
+    if (atomic.useStimulus && atomic.sync.id &&
+        createDumb(device, SYNC_LAYER_SIZE, SYNC_LAYER_SIZE, 0, &atomic.marker[0]) == 0 &&
+        createDumb(device, SYNC_LAYER_SIZE, SYNC_LAYER_SIZE, 255, &atomic.marker[1]) == 0) {
+        atomic.useSync = 1;
+    }
+    // the background stands in for the stimulus buffer, it is the same shape
+    struct drm_mode_rect screen = {0, 0, drm.mode.hdisplay, drm.mode.vdisplay};
+    while (atomic.useStimulus &&
+           commitLayout(device, atomic.background.fb, &screen, 0, 0, DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_TEST_ONLY)) {
+        dropPlane();
+    }
+    atomic.crop = screen;
+    atomic.active = 1;
+    printf("Atomic modesetting, %s\n", atomic.useSync ? "background, stimulus and sync layer on planes of their own" :
+           atomic.useStimulus ? "background and stimulus on planes of their own, no sync layer" : "composed on the GPU");
+    return 0;
+}
+
+// Try a stimulus crop, with the sync patch or without, that the driver has
+// not taken yet with a test commit, before a frame is drawn for it, and
+// drop the planes if it is refused.
+static void testCrop(int device, const struct drm_mode_rect* rect, int patched) {
+    if (!atomic.useStimulus || (memcmp(rect, &atomic.crop, sizeof(*rect)) == 0 && patched == atomic.cropPatched)) {
+        return;
+    }
+    if (patched && !atomic.useSync) {
+        fprintf(stderr, "No plane for the sync patch, composing on the GPU from now on\n");
+        while (dropPlane()) {
+        }
+        return;
+    }
+    if (commitLayout(device, atomic.background.fb, rect, patched, 0, DRM_MODE_ATOMIC_TEST_ONLY)) {
+        fprintf(stderr, "The driver turned down a stimulus crop, composing on the GPU from now on\n");
+        while (dropPlane()) {
+        }
+        return;
+    }
+    atomic.crop = *rect;
+    atomic.cropPatched = patched;
+}
+
+// Take the overlays off the screen, so the CRTC can go back to its old
+// framebuffer with drmModeSetCrtc().
+static void disableOverlays(int device) {
+    drmModeAtomicReq* req = drmModeAtomicAlloc();
+    if (req == NULL) {
+        return;
+    }
+    if (atomic.stimulus.id) {
+        addPlane(req, &atomic.stimulus, 0, NULL);
+    }
+    if (atomic.sync.id) {
+        addPlane(req, &atomic.sync, 0, NULL);
+    }
+    drmModeAtomicCommit(device, req, 0, NULL);
+    drmModeAtomicFree(req);
+}
+
+// Once nothing scans out of the dumb buffers any more.
+static void closeAtomic(int device) {
+    destroyDumb(device, &atomic.background);
+    destroyDumb(device, &atomic.marker[0]);
+    destroyDumb(device, &atomic.marker[1]);
+    if (atomic.modeBlob) {
+        drmModeDestroyPropertyBlob(device, atomic.modeBlob);
+    }
+    memset(&atomic, 0, sizeof(atomic));
+}
+
+// The atomic counterpart of flipOutput() for the first output.
+static void atomicFlip(struct gbm_bo *bo, uint32_t fb, int device) {
+    struct drm_mode_rect rect = {0, 0, drm.mode.hdisplay, drm.mode.vdisplay};
+    if (drm.rectDrawn && atomic.useStimulus) {
+        rect = drm.frameRect;
+    }
+    uint32_t damageBlob = 0;
+    if (drm.damaged) {
+        drmModeCreatePropertyBlob(device, drm.damage, drm.damageClips * sizeof(struct drm_mode_rect), &damageBlob);
+        drm.damaged = 0;
+    }
+
+    if (!drm.modeSet) {
+        if (commitLayout(device, fb, &rect, drm.patched, damageBlob, DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+            fprintf(stderr, "Failed to set mode: %s\n", strerror(errno));
+        }
+        drm.modeSet = 1;
+        unsigned int sequence;
+        long timestamp;
+        if (queryVblank(device, &sequence, &timestamp) == 0) {
+            recordPresent(sequence, timestamp);
+        }
+        startFramePulse();
+        if (drm.previousBo) {
+            gbm_surface_release_buffer(drm.gbmSurface, drm.previousBo);
+        }
+        drm.previousBo = bo;
+    } else {
+        uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+        int result = commitLayout(device, fb, &rect, drm.patched, damageBlob, flags);
+        if (result && errno == EINVAL && atomic.useStimulus) {
+            // the crop passed testCrop() but not now; the buffer only holds
+            // the crop, so it is not shown and the next frame is drawn whole
+            while (dropPlane()) {
+            }
+        }
+        if (result) {
+            fprintf(stderr, "Failed to commit frame: %s\n", strerror(errno));
+            gbm_surface_release_buffer(drm.gbmSurface, bo);
+        } else {
+            drm.pendingBo = bo;
+            drm.flipPending = 1;
+        }
+    }
+    if (damageBlob) {
+        // the commit holds its own reference
+        drmModeDestroyPropertyBlob(device, damageBlob);
+    }
+    drm.rectDrawn = 0;
+    drm.patched = 0;
+    atomic.commits++;
+}
+
+// Queue the new front buffer with drmModePageFlip instead of a modeset. Only
+// the very first frame does a drmModeSetCrtc. The flip is not waited on here:
+// the next frame is rendered while it is pending, and we only block on it
+// before queuing the following flip.
+//
+// Every output with a new frame is flipped, and all the front buffers are
+// locked first so the flip ioctls go out back to back and land on the same
+// vblank cycle on each CRTC.
+static void gbmPageFlip(EGLDisplay *display, EGLSurface *surface, int device) {
+    eglSwapBuffers(*display, *surface);
+    drm.drawn = 1;
+    waitForFlip(device);
+
+    struct gbm_bo *bos[MAX_OUTPUTS];
+    uint32_t fbs[MAX_OUTPUTS];
+    for (int i = 0; i < outputCount; i++) {
+        drmConfig* out = outputs[i];
+        bos[i] = NULL;
+        if (!out->drawn) {
+            continue;
+        }
+        out->drawn = 0;
+        bos[i] = gbm_surface_lock_front_buffer(out->gbmSurface);
+        if (bos[i] == NULL) {
+            fprintf(stderr, "Failed to lock front buffer\n");
+            continue;
+        }
+        fbs[i] = getFbForBo(bos[i], device);
+        if (!fbs[i]) {
+            gbm_surface_release_buffer(out->gbmSurface, bos[i]);
+            bos[i] = NULL;
+            continue;
+        }
+        // before the flip is queued, so the driver has it when fb goes out;
+        // an atomic commit carries its own FB_DAMAGE_CLIPS
+        if (!(i == 0 && atomic.active)) {
+            sendDamage(out, fbs[i], device);
+        }
+    }
+
+    for (int i = 0; i < outputCount; i++) {
+        if (bos[i] && i == 0 && atomic.active) {
+            atomicFlip(bos[i], fbs[i], device);
+        } else if (bos[i]) {
+            flipOutput(outputs[i], bos[i], fbs[i], device);
+        }
+    }
+}
+
+static void presentFrame(GLconfig* configPtr) {
+    if (configPtr->presentMode == PRESENT_PAGEFLIP || configPtr->presentMode == PRESENT_ATOMIC) {
+        gbmPageFlip(&(configPtr->display), &(configPtr->surface), configPtr->device);
+    } else if (configPtr->presentMode == PRESENT_OFFSCREEN) {
+        // Nothing is scanned out. The frame counts as presented once the
+        // GPU has finished it.
+        glFinish();
+        recordPresent(frameClock.lastSequence + 1, get_time_micros());
+        startFramePulse();
+    } else {
+        gbmSwapBuffers(&(configPtr->display), &(configPtr->surface), configPtr->device);
+    }
+}
+
+// Luminance calibration.
+//
+// setCalibration() takes the luminance measured at evenly spaced drive
+// levels from 0 to 1 and inverts it, so that drive level m gives the
+// fraction m of the way from the darkest to the brightest luminance. The
+// inverse goes into the gamma ramp of every output's CRTC, where the display
+// pipeline applies it for free. Only where the CRTC has no gamma ramp (or
+// there is no CRTC, offscreen) is it done in the generated programs instead,
+// as a lookup in a 1D texture after the stimulus is computed. That choice is
+// made when a program is built, so calibrate before building stimuli. An
+// output added later gets the calibration in its ramp too, or, if it has
+// none, the whole calibration moves into the programs.
+#define GAMMA_NONE 0
+#define GAMMA_HARDWARE 1
+#define GAMMA_SHADER 2
+
+#define GAMMA_LUT_SIZE 1024
+#define GAMMA_TEXTURE_UNIT 1
+
+typedef struct {
+    int mode;
+    float lut[GAMMA_LUT_SIZE]; // drive level for luminance i / (GAMMA_LUT_SIZE - 1)
+    GLuint texture;            // the lut, for GAMMA_SHADER
+} calibrationConfig;
+
+calibrationConfig calibration = {.mode = GAMMA_NONE};
+
+// Drive level for luminance fraction x, interpolated in the lut.
+static float calibratedLevel(float x) {
+    float position = x * (GAMMA_LUT_SIZE - 1);
+    if (position <= 0.0f) {
+        return calibration.lut[0];
+    }
+    if (position >= GAMMA_LUT_SIZE - 1) {
+        return calibration.lut[GAMMA_LUT_SIZE - 1];
+    }
+    int i = (int)position;
+    float t = position - i;
+    return calibration.lut[i] * (1.0f - t) + calibration.lut[i + 1] * t;
+}
+
+// Fill the lut from luminance measured at count evenly spaced drive levels.
+// Returns -1 unless it rises from the first level to the last.
+static int invertLuminance(const float* measured, int count) {
+    if (count < 2 || !(measured[count - 1] > measured[0])) {
+        return -1;
+    }
+    float lo = measured[0];
+    float hi = measured[count - 1];
+    for (int k = 1; k < count; k++) {
+        if (measured[k] < measured[k - 1]) {
+            return -1;
+        }
+    }
+    int k = 0;
+    for (int i = 0; i < GAMMA_LUT_SIZE; i++) {
+        float target = lo + (hi - lo) * i / (GAMMA_LUT_SIZE - 1);
+        while (k < count - 2 && measured[k + 1] < target) {
+            k++;
+        }
+        float step = measured[k + 1] - measured[k];
+        float t = step > 0.0f ? (target - measured[k]) / step : 0.0f;
+        t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+        calibration.lut[i] = (k + t) / (count - 1);
+    }
+    return 0;
+}
+
+static void restoreGamma(drmConfig* out, int device) {
+    if (out->savedGamma == NULL) {
+        return;
+    }
+    int size = out->crtc->gamma_size;
+    drmModeCrtcSetGamma(device, out->crtc->crtc_id, size, out->savedGamma, out->savedGamma + size,
+                        out->savedGamma + 2 * size);
+    free(out->savedGamma);
+    out->savedGamma = NULL;
+}
+
+// Returns 0 once the output's CRTC has the calibration in its gamma ramp.
+static int loadGamma(drmConfig* out, int device) {
+    int size = out->crtc ? out->crtc->gamma_size : 0;
+    if (size < 2) {
+        return -1;
+    }
+    if (out->savedGamma == NULL) {
+        out->savedGamma = malloc(3 * size * sizeof(uint16_t));
+        if (out->savedGamma == NULL ||
+            drmModeCrtcGetGamma(device, out->crtc->crtc_id, size, out->savedGamma, out->savedGamma + size,
+                                out->savedGamma + 2 * size)) {
+            free(out->savedGamma);
+            out->savedGamma = NULL;
+            return -1;
+        }
+    }
+    uint16_t* ramp = malloc(size * sizeof(uint16_t));
+    for (int i = 0; i < size; i++) {
+        ramp[i] = (uint16_t)(calibratedLevel((float)i / (size - 1)) * 65535.0f + 0.5f);
+    }
+    int result = drmModeCrtcSetGamma(device, out->crtc->crtc_id, size, ramp, ramp, ramp);
+    free(ramp);
+    if (result) {
+        restoreGamma(out, device);
+        return -1;
+    }
+    return 0;
+}
+
+static void loadGammaTexture() {
+    unsigned char levels[GAMMA_LUT_SIZE];
+    for (int i = 0; i < GAMMA_LUT_SIZE; i++) {
+        levels[i] = (unsigned char)(calibration.lut[i] * 255.0f + 0.5f);
+    }
+    glActiveTexture(GL_TEXTURE0 + GAMMA_TEXTURE_UNIT);
+    if (calibration.texture == 0) {
+        glGenTextures(1, &calibration.texture);
+    }
+    glBindTexture(GL_TEXTURE_2D, calibration.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, GAMMA_LUT_SIZE, 1, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, levels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Put every output back on its own gamma ramp and forget the calibration.
+void clearCalibration(int device) {
+    for (int i = 0; i < outputCount; i++) {
+        restoreGamma(outputs[i], device);
+    }
+    if (calibration.texture) {
+        glDeleteTextures(1, &calibration.texture);
+        calibration.texture = 0;
+    }
+    calibration.mode = GAMMA_NONE;
+    fillBackground(128);
+}
+
+// Apply the lut in the programs instead of the CRTCs' gamma ramps.
+static void useShaderCalibration(GLconfig* configPtr) {
+    for (int i = 0; i < outputCount; i++) {
+        restoreGamma(outputs[i], configPtr->device);
+    }
+    printf("No CRTC gamma ramp, calibration is applied in the programs\n");
+    loadGammaTexture();
+    calibration.mode = GAMMA_SHADER;
+    // the programs' background, looked up half way between the middle texels
+    int below = (int)(calibration.lut[GAMMA_LUT_SIZE / 2 - 1] * 255.0f + 0.5f);
+    int above = (int)(calibration.lut[GAMMA_LUT_SIZE / 2] * 255.0f + 0.5f);
+    fillBackground((below + above + 1) / 2);
+}
+
+// measured holds the luminance at count evenly spaced drive levels from 0
+// to 1, in any unit. NULL clears the calibration. Returns GAMMA_HARDWARE or
+// GAMMA_SHADER for where it is applied, or -1 if the table is unusable.
+int setCalibration(GLconfig* configPtr, const float* measured, int count) {
+    if (measured == NULL) {
+        clearCalibration(configPtr->device);
+        return GAMMA_NONE;
+    }
+    if (invertLuminance(measured, count) < 0) {
+        fprintf(stderr, "The luminance table must rise from its first level to its last\n");
+        return -1;
+    }
+
+    int hardware = configPtr->device >= 0;
+    for (int i = 0; i < outputCount && hardware; i++) {
+        hardware = loadGamma(outputs[i], configPtr->device) == 0;
+    }
+    if (hardware) {
+        fillBackground(128);
+        calibration.mode = GAMMA_HARDWARE;
+        if (calibration.texture) {
+            glDeleteTextures(1, &calibration.texture);
+            calibration.texture = 0;
+        }
+        return GAMMA_HARDWARE;
+    }
+
+    useShaderCalibration(configPtr);
+    return GAMMA_SHADER;
+}
+
+// A new output gets the calibration already in use. Returns where it is
+// applied now.
+static int calibrateOutput(GLconfig* configPtr, drmConfig* out) {
+    if (calibration.mode != GAMMA_HARDWARE || loadGamma(out, configPtr->device) == 0) {
+        return calibration.mode;
+    }
+    useShaderCalibration(configPtr);
+    fprintf(stderr, "Stimuli built before this output was added are not calibrated, build them again\n");
+    return GAMMA_SHADER;
+}
+
+static void gbmClean(int device) {
+    if (device < 0) {
+        // offscreen, there is no DRM state to restore
+        return;
+    }
+    waitForFlip(device);
+    setFramePulseDevice(-1);
+
+    for (int i = outputCount - 1; i > 0; i--) {
+        drmConfig* out = outputs[i];
+        restoreGamma(out, device);
+        if (out->crtc->mode_valid) {
+            drmModeSetCrtc(device, out->crtc->crtc_id, out->crtc->buffer_id, out->crtc->x, out->crtc->y, &out->connectorId, 1, &out->crtc->mode);
+        } else {
+            // the CRTC was off before we took it
+            drmModeSetCrtc(device, out->crtc->crtc_id, 0, 0, 0, NULL, 0, NULL);
+        }
+        drmModeFreeCrtc(out->crtc);
+        if (out->previousBo) {
+            if (out->previousFb) {
+                drmModeRmFB(device, out->previousFb);
+            }
+            gbm_surface_release_buffer(out->gbmSurface, out->previousBo);
+        }
+        gbm_surface_destroy(out->gbmSurface);
+        free(out);
+    }
+    outputCount = 1;
+
+    // set the previous crtc and its gamma
+    restoreGamma(&drm, device);
+    if (atomic.active) {
+        disableOverlays(device);
+    }
+    drmModeSetCrtc(device, drm.crtc->crtc_id, drm.crtc->buffer_id, drm.crtc->x, drm.crtc->y, &drm.connectorId, 1, &drm.crtc->mode);
+    drmModeFreeCrtc(drm.crtc);
+    if (atomic.active) {
+        closeAtomic(device);
+    }
+
+    if (drm.previousBo) {
+        // page flip framebuffers belong to the bo and go with the surface
+        if (drm.previousFb) {
+            drmModeRmFB(device, drm.previousFb);
+        }
+        gbm_surface_release_buffer(drm.gbmSurface, drm.previousBo);
+    }
+
+    gbm_surface_destroy(drm.gbmSurface);
+    gbm_device_destroy(drm.gbmDevice);
+}
+
+const char* vertexShaderSource =
+    "attribute vec3 pos;"
+    "varying vec3 fragPos;"
+    "void main() {"
+    "    gl_Position = vec4(pos, 1.0);"
+    "    fragPos = pos;"
+    "}";
+
+// Fragment program composer.
+//
+// Instead of one hand written program per stimulus, composeFragSource()
+// writes a program with only the code the chosen carrier, envelope and
+// temporal modulation need. Parameters that are fixed for the run are
+// written in as constants (the grating vector is even precomputed on the
+// CPU), so the per-pixel work is the minimum for that stimulus.
+
+#define FRAG_SOURCE_LENGTH 4096
+
+static void appendSource(char* buffer, size_t size, const char* format, ...) {
+    size_t used = strlen(buffer);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer + used, size - used, format, args);
+    va_end(args);
+}
+
+static void declareParam(char* buffer, size_t size, const char* name, float value, int isUniform) {
+    if (isUniform) {
+        appendSource(buffer, size, "uniform float %s;", name);
+    } else {
+        appendSource(buffer, size, "const float %s = %#.9g;", name, value);
+    }
+}
+
+// Without a gamma ramp in the CRTC the calibration is looked up from the
+// drive level m. GAMMA_LUT_SIZE texels span [0, 1] from centre to centre.
+static void appendCalibration(char* buffer, size_t size) {
+    if (calibration.mode == GAMMA_SHADER) {
+        appendSource(buffer, size, " m = texture2D(gammaLut, vec2(m * %#.9g + %#.9g, 0.5)).r;",
+                     (GAMMA_LUT_SIZE - 1.0) / GAMMA_LUT_SIZE, 0.5 / GAMMA_LUT_SIZE);
+    }
+}
+
+static void declareCalibration(char* buffer, size_t size) {
+    if (calibration.mode == GAMMA_SHADER) {
+        appendSource(buffer, size, "uniform sampler2D gammaLut;");
+    }
+}
+
+// The carrier waveform, in [-1, 1]
+static void appendWave(char* buffer, size_t size, int carrier) {
+    if (carrier == CARRIER_SQUARE) {
+        appendSource(buffer, size, "float wave(float a) { return smoothstep(-0.05, 0.05, sin(a)) * 2.0 - 1.0; }");
+    } else if (carrier == CARRIER_SAWTOOTH) {
+        appendSource(buffer, size, "float wave(float a) { return fract(a * 0.159154943) * 2.0 - 1.0; }");
+    } else {
+        appendSource(buffer, size, "float wave(float a) { return sin(a); }");
+    }
+}
+
+// Noise.
+//
+// Every block of blockSize pixels gets a value from a counter-based hash of
+// (seed, noise frame, octave, block), so any frame can be drawn, or computed
+// again offline, from the seed alone. The noise frame is the frame index
+// divided by framesPerUpdate. The hash is a chain of the permutation
+// polynomial (34x^2 + x) mod 289 over the base 289 digits of each input,
+// all NOISE_KEY_DIGITS of them for the 32 bit seed and frame, so no two
+// seeds give the same noise. The shader reduces 34x + 1 before it
+// multiplies, so nothing in the chain passes 2^18 and single precision
+// floats keep it exact. The seed and frame part of the chain is worked out
+// on the CPU once a frame and passed in as noiseKeys, so a fragment only
+// hashes its block. Two chains, in opposite orders, give a value in 83521
+// steps.
+//
+// With spectrum > 0 there are NOISE_OCTAVES octaves of blocks, each twice
+// the size of the last and weighted by 2^(octave * spectrum / 2), with the
+// weights summing to one so nothing clips. 1 gives pink noise.
+#define NOISE_MODULUS 289
+#define NOISE_OCTAVES 6
+#define NOISE_KEY_DIGITS 4 // 289^4 > 2^32
+#define NOISE_SECOND_CHAIN 144 // where the second chain starts, from the octave
+
+static int isNoiseCarrier(int carrier) {
+    return carrier == CARRIER_NOISE || carrier == CARRIER_BINARY_NOISE || carrier == CARRIER_SPARSE_NOISE;
+}
+
+static int noiseOctaves(const stimulusType* type, const stimulusParams* params) {
+    return type->carrier == CARRIER_SPARSE_NOISE || params->spectrum == 0.0f ? 1 : NOISE_OCTAVES;
+}
+
+static void noiseWeights(const stimulusParams* params, int octaves, float* weights) {
+    float sum = 0.0f;
+    for (int k = 0; k < octaves; k++) {
+        weights[k] = powf(2.0f, k * params->spectrum / 2.0f);
+        sum += weights[k];
+    }
+    for (int k = 0; k < octaves; k++) {
+        weights[k] /= sum;
+    }
+}
+
+static int noisePermute(int x) {
+    x %= NOISE_MODULUS;
+    return (34 * x * x + x) % NOISE_MODULUS;
+}
+
+static int noiseDigit(uint32_t value, int digit) {
+    for (int i = 0; i < digit; i++) {
+        value /= NOISE_MODULUS;
+    }
+    return value % NOISE_MODULUS;
+}
+
+// The seed and frame part of both chains, for one octave.
+static void noiseKey(uint32_t seed, uint32_t noiseFrame, int octave, int key[2]) {
+    int a = noisePermute(octave);
+    int b = noisePermute(octave + NOISE_SECOND_CHAIN);
+    for (int i = 0; i < NOISE_KEY_DIGITS; i++) {
+        a = noisePermute(a + noiseDigit(seed, i));
+        b = noisePermute(b + noiseDigit(noiseFrame, NOISE_KEY_DIGITS - 1 - i));
+    }
+    for (int i = 0; i < NOISE_KEY_DIGITS; i++) {
+        a = noisePermute(a + noiseDigit(noiseFrame, i));
+        b = noisePermute(b + noiseDigit(seed, NOISE_KEY_DIGITS - 1 - i));
+    }
+    key[0] = a;
+    key[1] = b;
+}
+
+static uint32_t noiseFrame(const stimulusParams* params, long frame) {
+    return (uint32_t)(frame / (params->framesPerUpdate > 0 ? params->framesPerUpdate : 1));
+}
+
+// The value, in [0, 1), of block (bx, by); the same sums as noiseBlock() in
+// the shader, so the same floats.
+static float noiseBlockValue(const int key[2], int bx, int by) {
+    int a = key[0];
+    a = noisePermute(a + bx % NOISE_MODULUS);
+    a = noisePermute(a + bx / NOISE_MODULUS);
+    a = noisePermute(a + by % NOISE_MODULUS);
+    a = noisePermute(a + by / NOISE_MODULUS);
+    int c = key[1];
+    c = noisePermute(c + by / NOISE_MODULUS);
+    c = noisePermute(c + by % NOISE_MODULUS);
+    c = noisePermute(c + bx / NOISE_MODULUS);
+    c = noisePermute(c + bx % NOISE_MODULUS);
+    return ((float)(a * NOISE_MODULUS + c) + 0.5f) * (float)(1.0 / (NOISE_MODULUS * NOISE_MODULUS));
+}
+
+// The carrier, in [-1, 1], from the block values of each octave.
+static float noiseCarrierValue(int carrier, const stimulusParams* params, int octaves, const float* weights,
+                               const float* u) {
+    if (carrier == CARRIER_SPARSE_NOISE) {
+        return u[0] < params->density * 0.5f ? -1.0f : u[0] < params->density ? 1.0f : 0.0f;
+    }
+    float v = weights[0] * (u[0] * 2.0f - 1.0f);
+    for (int k = 1; k < octaves; k++) {
+        v += weights[k] * (u[k] * 2.0f - 1.0f);
+    }
+    if (carrier == CARRIER_BINARY_NOISE) {
+        return v < 0.0f ? -1.0f : 1.0f;
+    }
+    return v;
+}
+
+// noise(), the carrier of a noise stimulus, in [-1, 1].
+static void appendNoise(char* buffer, size_t size, const stimulusType* type, const stimulusParams* params) {
+    int octaves = noiseOctaves(type, params);
+    float weights[NOISE_OCTAVES];
+    noiseWeights(params, octaves, weights);
+    appendSource(buffer, size,
+        "uniform vec2 noiseKeys[%d];"
+        // the reduction can leave 289 in place of 0
+        "float mod289(float x) { x -= floor(x * %#.9g) * 289.0; return x - 289.0 * step(288.5, x); }"
+        "float permute(float x) { return mod289(x * mod289(34.0 * x + 1.0)); }"
+        "float noiseBlock(vec2 key, float blockSize) {"
+        " vec2 b = floor(gl_FragCoord.xy / blockSize);"
+        " vec2 hi = floor((b + 0.5) * %#.9g);"
+        " vec2 lo = b - hi * 289.0;"
+        " float a = permute(permute(permute(permute(key.x + lo.x) + hi.x) + lo.y) + hi.y);"
+        " float c = permute(permute(permute(permute(key.y + hi.y) + lo.y) + hi.x) + lo.x);"
+        " return (a * 289.0 + c + 0.5) * %#.9g;"
+        "}"
+        "float noise() {", octaves, 1.0 / NOISE_MODULUS, 1.0 / NOISE_MODULUS,
+        (float)(1.0 / (NOISE_MODULUS * NOISE_MODULUS)));
+    for (int k = 0; k < octaves; k++) {
+        appendSource(buffer, size, " float u%d = noiseBlock(noiseKeys[%d], %#.9g);", k, k,
+                     roundf(params->blockSize) * (float)(1 << k));
+    }
+    if (type->carrier == CARRIER_SPARSE_NOISE) {
+        appendSource(buffer, size, " return u0 < %#.9g ? -1.0 : u0 < %#.9g ? 1.0 : 0.0;",
+                     params->density * 0.5f, params->density);
+    } else {
+        appendSource(buffer, size, " float v = %#.9g * (u0 * 2.0 - 1.0);", weights[0]);
+        for (int k = 1; k < octaves; k++) {
+            appendSource(buffer, size, " v += %#.9g * (u%d * 2.0 - 1.0);", weights[k], k);
+        }
+        if (type->carrier == CARRIER_BINARY_NOISE) {
+            appendSource(buffer, size, " v = v < 0.0 ? -1.0 : 1.0;");
+        }
+        appendSource(buffer, size, " return v;");
+    }
+    appendSource(buffer, size, "}");
+}
+
+// Set the keys for frame frame of a noise stimulus, with its program in use.
+static void setNoiseKeys(shader* shaderPtr, long frame) {
+    int octaves = noiseOctaves(&shaderPtr->type, &shaderPtr->params);
+    GLfloat keys[NOISE_OCTAVES * 2];
+    uint32_t index = noiseFrame(&shaderPtr->params, frame);
+    for (int k = 0; k < octaves; k++) {
+        int key[2];
+        noiseKey(shaderPtr->params.seed, index, k, key);
+        keys[2 * k] = key[0];
+        keys[2 * k + 1] = key[1];
+    }
+    glUniform2fv(glGetUniformLocation(shaderPtr->programId, "noiseKeys"), octaves, keys);
+}
+
+void composeFragSource(const stimulusType* type, const stimulusParams* params, float aspectRatio, char* buffer, size_t size) {
+    int uniforms = type->uniforms;
+    int plaid = type->carrier == CARRIER_PLAID;
+    int noise = isNoiseCarrier(type->carrier);
+    int foldWave = !(uniforms & (PARAM_ANGLE | PARAM_SPATIAL | (plaid ? PARAM_ANGLE2 : 0)));
+
+    buffer[0] = '\0';
+    appendSource(buffer, size,
+        "uniform float phase;"
+        "varying vec3 fragPos;"
+        "const float aspectRatio = %#.9g;", aspectRatio);
+    declareCalibration(buffer, size);
+
+    if (noise) {
+        // no wave
+    } else if (foldWave) {
+        appendSource(buffer, size, "const vec2 wave1 = vec2(%#.9g, %#.9g);",
+                     cos(params->angle) * params->spatial, sin(params->angle) * params->spatial);
+        if (plaid) {
+            appendSource(buffer, size, "const vec2 wave2 = vec2(%#.9g, %#.9g);",
+                         cos(params->angle2) * params->spatial, sin(params->angle2) * params->spatial);
+        }
+    } else {
+        declareParam(buffer, size, "angle", params->angle, uniforms & PARAM_ANGLE);
+        declareParam(buffer, size, "spatial", params->spatial, uniforms & PARAM_SPATIAL);
+        if (plaid) {
+            declareParam(buffer, size, "angle2", params->angle2, uniforms & PARAM_ANGLE2);
+        }
+    }
+    declareParam(buffer, size, "contrast", params->contrast, uniforms & PARAM_CONTRAST);
+
+    if (type->envelope != ENVELOPE_NONE) {
+        if (uniforms & PARAM_CENTER) {
+            appendSource(buffer, size, "uniform float centerX;" "uniform float centerY;");
+        } else {
+            appendSource(buffer, size, "const vec2 center = vec2(%#.9g, %#.9g);",
+                         params->centerX * aspectRatio, params->centerY);
+        }
+    }
+    if (type->envelope == ENVELOPE_GAUSSIAN) {
+        declareParam(buffer, size, "sigma", params->sigma, uniforms & PARAM_SIZE);
+    } else if (type->envelope == ENVELOPE_CIRCLE || type->envelope == ENVELOPE_ANNULUS) {
+        declareParam(buffer, size, "radius", params->radius, uniforms & PARAM_SIZE);
+    }
+    if (type->envelope == ENVELOPE_ANNULUS) {
+        declareParam(buffer, size, "innerRadius", params->innerRadius, uniforms & PARAM_SIZE);
+    }
+
+    if (noise) {
+        appendNoise(buffer, size, type, params);
+    } else {
+        appendWave(buffer, size, type->carrier);
+    }
+
+    appendSource(buffer, size,
+        "void main() {"
+        " vec2 p = vec2(fragPos.x * aspectRatio, fragPos.y);");
+    if (!foldWave && !noise) {
+        appendSource(buffer, size, " vec2 wave1 = spatial * vec2(cos(angle), sin(angle));");
+        if (plaid) {
+            appendSource(buffer, size, " vec2 wave2 = spatial * vec2(cos(angle2), sin(angle2));");
+        }
+    }
+
+    const char* shift = type->temporal == TEMPORAL_DRIFT ? " + phase" : "";
+    if (noise) {
+        appendSource(buffer, size, " float w = noise();");
+    } else if (plaid) {
+        appendSource(buffer, size, " float w = 0.5 * (wave(dot(wave1, p)%s) + wave(dot(wave2, p)%s));", shift, shift);
+    } else {
+        appendSource(buffer, size, " float w = wave(dot(wave1, p)%s);", shift);
+    }
+    if (type->temporal == TEMPORAL_COUNTERPHASE) {
+        appendSource(buffer, size, " w *= cos(phase);");
+    } else if (type->temporal == TEMPORAL_FLICKER) {
+        appendSource(buffer, size, " w *= phase < 3.14159265 ? 1.0 : -1.0;");
+    }
+
+    if (type->envelope != ENVELOPE_NONE) {
+        if (uniforms & PARAM_CENTER) {
+            appendSource(buffer, size, " vec2 d = p - vec2(centerX * aspectRatio, centerY);");
+        } else {
+            appendSource(buffer, size, " vec2 d = p - center;");
+        }
+    }
+    if (type->envelope == ENVELOPE_GAUSSIAN) {
+        appendSource(buffer, size, " w *= exp(-dot(d, d) / sigma);");
+    } else if (type->envelope == ENVELOPE_CIRCLE) {
+        appendSource(buffer, size, " w *= 1.0 - smoothstep(radius - 0.005, radius, length(d));");
+    } else if (type->envelope == ENVELOPE_ANNULUS) {
+        appendSource(buffer, size,
+            " float r = length(d);"
+            " w *= smoothstep(innerRadius - 0.005, innerRadius, r) * (1.0 - smoothstep(radius - 0.005, radius, r));");
+    }
+
+    appendSource(buffer, size, " float m = 0.5 + 0.5 * contrast * w;");
+    appendCalibration(buffer, size);
+    appendSource(buffer, size,
+        " gl_FragColor = vec4(m, m, m, 1.0);"
+        "}");
+}
+
+stimulusParams defaultParams() {
+    stimulusParams params = {
+        .angle = 0.0f,
+        .spatial = 20.0f,
+        .cyclesPerSecond = 1.0f,
+        .contrast = 1.0f,
+        .angle2 = M_PI / 2,
+        .centerX = 0.0f,
+        .centerY = 0.0f,
+        .sigma = 0.1f,
+        .radius = 0.5f,
+        .innerRadius = 0.25f,
+        .seed = 0,
+        .blockSize = 8.0f,
+        .spectrum = 0.0f,
+        .density = 0.05f,
+        .framesPerUpdate = 1,
+    };
+    return params;
+}
+
+// Get the EGL error back as a string. Useful for debugging.
+static const char *eglGetErrorStr() {
+    switch (eglGetError()){
+    case EGL_SUCCESS:
+        return "The last function succeeded without error.";
+    case EGL_NOT_INITIALIZED:
+        return "EGL is not initialized, or could not be initialized, for the "
+               "specified EGL display connection.";
+    case EGL_BAD_ACCESS:
+        return "EGL cannot access a requested resource (for example a context "
+               "is bound in another thread).";
+    case EGL_BAD_ALLOC:
+        return "EGL failed to allocate resources for the requested operation.";
+    case EGL_BAD_ATTRIBUTE:
+        return "An unrecognized attribute or attribute value was passed in the "
+               "attribute list.";
+    case EGL_BAD_CONTEXT:
+        return "An EGLContext argument does not name a valid EGL rendering "
+               "context.";
+    case EGL_BAD_CONFIG:
+        return "An EGLConfig argument does not name a valid EGL frame buffer "
+               "configuration.";
+    case EGL_BAD_CURRENT_SURFACE:
+        return "The current surface of the calling thread is a window, pixel "
+               "buffer or pixmap that is no longer valid.";
+    case EGL_BAD_DISPLAY:
+        return "An EGLDisplay argument does not name a valid EGL display "
+               "connection.";
+    case EGL_BAD_SURFACE:
         return "An EGLSurface argument does not name a valid surface (window, "
                "pixel buffer or pixmap) configured for GL rendering.";
     case EGL_BAD_MATCH:
@@ -314,594 +2228,4609 @@ static const char *eglGetErrorStr() {
                "destroy all contexts and reinitialise OpenGL ES state and "
                "objects to continue rendering.";
     default:
-        break;
+        break;
+    }
+    return "Unknown error!";
+}
+
+static const char *glGetErrorStr(GLenum errorCheckValue) {
+    switch (errorCheckValue) {
+        case GL_NO_ERROR:
+            return "The last function succeeded without error.";
+        case GL_INVALID_ENUM:
+            return "An unacceptable value is specified for an enumerated argument. The offending command is ignored and has no other side effect than to set the error flag.";
+        case GL_INVALID_VALUE:
+            return "A numeric argument is out of range. The offending command is ignored and has no other side effect than to set the error flag.";
+        case GL_INVALID_OPERATION:
+            return "The specified operation is not allowed in the current state. The offending command is ignored and has no other side effect than to set the error flag.";
+        case GL_INVALID_FRAMEBUFFER_OPERATION:
+            return "The framebuffer object is not complete. The offending command is ignored and has no other side effect than to set the error flag.";
+        case GL_OUT_OF_MEMORY:
+            return "There is not enough memory left to execute the command. The state of the GL is undefined, except for the state of the error flags, after this error is recorded.";
+        default:
+            break;
+    }
+    return "Unknown error!";
+}
+
+void createCircle(GLfloat *vertices) {
+    float aspectRatio = (float)drm.mode.hdisplay / drm.mode.vdisplay;
+    float cx = 0.0;
+    float cy = 0.0;
+    float r = 0.5;
+    float delTheta = PI * 2 / trisPerCirc;
+
+    float x = r;
+    float y = 0;
+
+    for (int i = 0; i < trisPerCirc; i++) {
+        vertices[i*9+0] = x + cx;
+        vertices[i*9+1] = y*aspectRatio + cy;
+        vertices[i*9+2] = 0.0f;
+
+        x = (float)r*cosf(delTheta*(i+1));
+        y = (float)r*sinf(delTheta*(i+1));
+
+        vertices[i*9+3] = x + cx;
+        vertices[i*9+4] = y*aspectRatio + cy;
+        vertices[i*9+5] = 0.0f;
+
+        vertices[i*9+6] = cx;
+        vertices[i*9+7] = cy;
+        vertices[i*9+8] = 0.0f;
+    }
+
+    vertices[(trisPerCirc-1)*9+3] = vertices[0];
+    vertices[(trisPerCirc-1)*9+4] = vertices[1];
+    vertices[(trisPerCirc-1)*9+5] = vertices[2];
+}
+
+void createRect(GLfloat *vertices) {
+
+    float top = 1.0;
+    float right = 1.0;
+    float left = -1.0;
+    float bottom = -1.0;
+    float rect[] = {left,  top,    0.0,
+                    right, top,    0.0,
+                    left,  bottom, 0.0,
+                    left,  bottom, 0.0,
+                    right, top,    0.0,
+                    right, bottom, 0.0};
+    
+    memcpy(vertices, rect, sizeof(rect));   
+}
+
+void createVBO(shader* shaderPtr) {
+
+    int shape = 0;
+
+    GLfloat *vertices;
+
+    if (shape) {
+        shaderPtr->VBOlength = trisPerCirc * 3 * 3;
+        vertices = (GLfloat *)malloc(shaderPtr->VBOlength * sizeof(GLfloat));
+        createCircle(vertices);
+    } else {
+        shaderPtr->VBOlength = 2 * 3 * 3;
+        vertices = (GLfloat *)malloc(shaderPtr->VBOlength * sizeof(GLfloat));
+        createRect(vertices);
+    }
+
+    if (vertices == NULL) {
+        fprintf(stderr, "Memory allocation for vertices failed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    glGenBuffers(1, &(shaderPtr->VBOId));
+    glBindBuffer(GL_ARRAY_BUFFER, shaderPtr->VBOId);
+    glBufferData(GL_ARRAY_BUFFER, shaderPtr->VBOlength * sizeof(GLfloat), vertices, GL_STATIC_DRAW);
+
+    // Specify the layout of the vertex data
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
+    glEnableVertexAttribArray(0);
+
+    free(vertices);
+
+    GLenum ErrorCheckValue = glGetError();
+    if (ErrorCheckValue != GL_NO_ERROR) {
+        fprintf(stderr, "ERROR: Could not create a VBO\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void destroyPatches(struct patchSet* set);
+static void closeMovie(struct movie* mv);
+static void destroyImage(struct image* img);
+
+void destroyVBO(shader* shaderPtr) {
+    GLenum errorCheckValue = glGetError();
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glDeleteBuffers(1, &(shaderPtr->VBOId));
+    if (shaderPtr->patches) {
+        destroyPatches(shaderPtr->patches);
+        shaderPtr->patches = NULL;
+    }
+    if (shaderPtr->movie) {
+        closeMovie(shaderPtr->movie);
+        shaderPtr->movie = NULL;
+    }
+    if (shaderPtr->image) {
+        destroyImage(shaderPtr->image);
+        shaderPtr->image = NULL;
+    }
+    if (shaderPtr->lutTexture) {
+        glDeleteTextures(1, &shaderPtr->lutTexture);
+        shaderPtr->lutTexture = 0;
+    }
+
+    errorCheckValue = glGetError();
+    if (errorCheckValue != GL_NO_ERROR) {
+        fprintf(stderr, "ERROR: Could not destroy the VBO.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void createShaders(shader* shaderPtr, const char* fragSource) {
+
+    GLenum errorCheckValue = glGetError();
+    GLint compile_ok = GL_FALSE;
+
+    shaderPtr->programId = glCreateProgram();
+
+    shaderPtr->vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(shaderPtr->vertexShaderId, 1, &vertexShaderSource, NULL);
+    glCompileShader(shaderPtr->vertexShaderId);
+
+    glGetShaderiv(shaderPtr->vertexShaderId, GL_COMPILE_STATUS, &compile_ok);
+    if(!compile_ok) {
+        GLchar infoLog[512];
+        glGetShaderInfoLog(shaderPtr->vertexShaderId, 512, NULL, infoLog);
+        fprintf(stderr, "Vertex shader compilation failed: %s\n", infoLog);
+        exit(EXIT_FAILURE);
+    }
+
+    shaderPtr->fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(shaderPtr->fragmentShaderId,1, &fragSource, NULL);
+    glCompileShader(shaderPtr->fragmentShaderId);
+
+    glGetShaderiv(shaderPtr->fragmentShaderId, GL_COMPILE_STATUS, &compile_ok);
+    if(!compile_ok) {
+        GLchar infoLog[512];
+        glGetShaderInfoLog(shaderPtr->fragmentShaderId, 512, NULL, infoLog);
+        fprintf(stderr, "Fragment shader compilation failed: %s\n", infoLog);
+        exit(EXIT_FAILURE);
+    }
+
+    errorCheckValue = glGetError();
+    if (errorCheckValue != GL_NO_ERROR) {
+         fprintf(stderr, "ERROR: Could not create the at the end of shaders %s.\n", glGetErrorStr(errorCheckValue));
+    }
+}
+
+void destroyShaders(shader* shaderPtr) {
+    GLenum errorCheckValue = glGetError();
+    glUseProgram(0);
+
+    // programs loaded from a binary have no shader objects
+    if (shaderPtr->vertexShaderId) {
+        glDetachShader(shaderPtr->programId, shaderPtr->vertexShaderId);
+        glDetachShader(shaderPtr->programId, shaderPtr->fragmentShaderId);
+
+        glDeleteShader(shaderPtr->fragmentShaderId);
+        glDeleteShader(shaderPtr->vertexShaderId);
+    }
+
+    glDeleteProgram(shaderPtr->programId);
+
+    errorCheckValue = glGetError();
+    if (errorCheckValue != GL_NO_ERROR) {
+        fprintf(stderr, "ERROR: Could not destroy %s.\n", glGetErrorStr(errorCheckValue));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Parameters folded in as constants are not uniforms of the program at all,
+// so a missing uniform is skipped.
+void updateShader(shader* shaderPtr, const char* uniformName, float uniformValue) {
+    int location  = glGetUniformLocation(shaderPtr->programId, uniformName);
+    if (location != -1) {
+        glUniform1f(location, uniformValue);
+    }
+}
+
+void setStimulusUniforms(shader* shaderPtr, const stimulusParams* params) {
+    updateShader(shaderPtr, "angle", params->angle);
+    updateShader(shaderPtr, "spatial", params->spatial);
+    updateShader(shaderPtr, "contrast", params->contrast);
+    updateShader(shaderPtr, "angle2", params->angle2);
+    updateShader(shaderPtr, "centerX", params->centerX);
+    updateShader(shaderPtr, "centerY", params->centerY);
+    updateShader(shaderPtr, "sigma", params->sigma);
+    updateShader(shaderPtr, "radius", params->radius);
+    updateShader(shaderPtr, "innerRadius", params->innerRadius);
+    int location = glGetUniformLocation(shaderPtr->programId, "gammaLut");
+    if (location != -1) {
+        glUniform1i(location, GAMMA_TEXTURE_UNIT);
+    }
+}
+
+// 64 bit FNV-1a
+static uint64_t hashBytes(const void* data, size_t length, uint64_t hash) {
+    const unsigned char* c = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= c[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t hashString(const char* str, uint64_t hash) {
+    return hashBytes(str, strlen(str), hash);
+}
+
+#define HASH_SEED 14695981039346656037ULL
+
+// Program binary cache.
+//
+// Compiling and linking costs tens of milliseconds per program on the Pi and
+// an experiment builds dozens at startup. Where the driver can hand back a
+// linked program (GL_OES_get_program_binary, or GL_ARB_get_program_binary on
+// desktop GL) the binaries are kept in one file, keyed on both shader sources
+// and the GL vendor, renderer and version strings, so a driver upgrade is a
+// miss rather than a stale binary. A binary the driver rejects anyway is
+// dropped and the program compiled from source.
+//
+// The file is a magic number and the hash of the driver strings, followed by
+// entries of {uint64 key, uint32 format, uint32 length, length bytes}. New
+// entries are appended as they are built. A file that is damaged or was
+// written by another driver is rewritten as soon as it is read, so nothing is
+// ever appended to it; otherwise it is only rewritten when entries are
+// dropped.
+
+#define PROGRAM_CACHE_MAGIC 0x32475052u // "RPG2"
+#define PROGRAM_CACHE_MAX_BINARY (16 * 1024 * 1024)
+
+typedef struct programBinary {
+    uint64_t key;
+    GLenum format;
+    GLint length;
+    void* data;
+    struct programBinary* next;
+} programBinary;
+
+static PFNGLGETPROGRAMBINARYOESPROC getProgramBinary = NULL;
+static PFNGLPROGRAMBINARYOESPROC loadProgramBinaryData = NULL;
+static char programCachePath[PATH_MAX] = "";
+static int programCacheEnabled = 1;
+static int programCacheState = 0;   // 0 not yet set up, 1 in use, -1 unavailable
+static int programCacheDirty = 0;   // entries dropped, rewrite the file on close
+static uint64_t driverHash;
+static programBinary* programCacheHead = NULL;
+static long programCacheHits = 0;
+static long programCacheMisses = 0;
+static long programCacheRejects = 0;
+
+static void defaultProgramCachePath(char* path, size_t size) {
+    const char* dir = getenv("XDG_CACHE_HOME");
+    if (dir && dir[0]) {
+        snprintf(path, size, "%s/rpg_programs.bin", dir);
+    } else if ((dir = getenv("HOME")) && dir[0]) {
+        snprintf(path, size, "%s/.cache/rpg_programs.bin", dir);
+    } else {
+        snprintf(path, size, "/tmp/rpg_programs.bin");
+    }
+}
+
+static void freeProgramBinaries() {
+    while (programCacheHead) {
+        programBinary* next = programCacheHead->next;
+        free(programCacheHead->data);
+        free(programCacheHead);
+        programCacheHead = next;
+    }
+}
+
+// Returns the number of entries read, -1 if the file is damaged, or -2 if it
+// was written by a different driver.
+static int readProgramBinaries(FILE* file) {
+    uint32_t magic;
+    uint64_t driver;
+    if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != PROGRAM_CACHE_MAGIC ||
+        fread(&driver, sizeof(driver), 1, file) != 1) {
+        return -1;
+    }
+    if (driver != driverHash) {
+        return -2;
+    }
+    int count = 0;
+    for (;;) {
+        uint64_t key;
+        uint32_t format, length;
+        if (fread(&key, sizeof(key), 1, file) != 1) {
+            return count;
+        }
+        if (fread(&format, sizeof(format), 1, file) != 1 ||
+            fread(&length, sizeof(length), 1, file) != 1 ||
+            length == 0 || length > PROGRAM_CACHE_MAX_BINARY) {
+            return -1;
+        }
+        programBinary* entry = malloc(sizeof(programBinary));
+        void* data = malloc(length);
+        if (entry == NULL || data == NULL || fread(data, 1, length, file) != length) {
+            free(entry);
+            free(data);
+            return -1;
+        }
+        entry->key = key;
+        entry->format = format;
+        entry->length = length;
+        entry->data = data;
+        entry->next = programCacheHead;
+        programCacheHead = entry;
+        count++;
+    }
+}
+
+static int writeProgramCacheHeader(FILE* file) {
+    uint32_t magic = PROGRAM_CACHE_MAGIC;
+    return fwrite(&magic, sizeof(magic), 1, file) == 1 &&
+           fwrite(&driverHash, sizeof(driverHash), 1, file) == 1;
+}
+
+static int writeProgramBinary(FILE* file, programBinary* entry) {
+    uint32_t format = entry->format;
+    uint32_t length = entry->length;
+    return fwrite(&entry->key, sizeof(entry->key), 1, file) == 1 &&
+           fwrite(&format, sizeof(format), 1, file) == 1 &&
+           fwrite(&length, sizeof(length), 1, file) == 1 &&
+           fwrite(entry->data, 1, length, file) == length;
+}
+
+static void appendProgramBinary(programBinary* entry) {
+    FILE* file = fopen(programCachePath, "ab");
+    if (file == NULL) {
+        return;
+    }
+    if ((ftell(file) == 0 && !writeProgramCacheHeader(file)) || !writeProgramBinary(file, entry)) {
+        fprintf(stderr, "Unable to write program cache %s\n", programCachePath);
+    }
+    fclose(file);
+}
+
+// Write the surviving entries to a new file and move it over the old one.
+static void rewriteProgramCache() {
+    char tmpPath[PATH_MAX + 8];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", programCachePath);
+    FILE* file = fopen(tmpPath, "wb");
+    if (file == NULL) {
+        return;
+    }
+    int ok = writeProgramCacheHeader(file);
+    for (programBinary* entry = programCacheHead; entry && ok; entry = entry->next) {
+        ok = writeProgramBinary(file, entry);
+    }
+    if (fclose(file) != 0 || !ok || rename(tmpPath, programCachePath) != 0) {
+        fprintf(stderr, "Unable to write program cache %s\n", programCachePath);
+        unlink(tmpPath);
+    }
+}
+
+// Needs a current context, so it is done on the first program build.
+static int initProgramCache() {
+    if (programCacheState) {
+        return programCacheState > 0;
+    }
+    programCacheState = -1;
+    if (!programCacheEnabled) {
+        return 0;
+    }
+
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    if (extensions == NULL || (strstr(extensions, "GL_OES_get_program_binary") == NULL &&
+                               strstr(extensions, "GL_ARB_get_program_binary") == NULL)) {
+        printf("Program binaries not supported, programs are compiled every time\n");
+        return 0;
+    }
+    getProgramBinary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinaryOES");
+    loadProgramBinaryData = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinaryOES");
+    if (getProgramBinary == NULL || loadProgramBinaryData == NULL) {
+        getProgramBinary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinary");
+        loadProgramBinaryData = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinary");
+    }
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+    if (getProgramBinary == NULL || loadProgramBinaryData == NULL || formats < 1) {
+        printf("Program binaries not supported, programs are compiled every time\n");
+        return 0;
+    }
+
+    driverHash = HASH_SEED;
+    GLenum driverStrings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION};
+    for (int i = 0; i < 4; i++) {
+        const char* str = (const char*)glGetString(driverStrings[i]);
+        driverHash = hashString(str ? str : "", driverHash);
+    }
+
+    if (programCachePath[0] == '\0') {
+        defaultProgramCachePath(programCachePath, sizeof(programCachePath));
+    }
+    FILE* file = fopen(programCachePath, "rb");
+    if (file) {
+        int count = readProgramBinaries(file);
+        fclose(file);
+        if (count < 0) {
+            // keep whatever was read before the damage, and start a sound
+            // file now so new entries are not appended after it
+            printf("Program cache %s %s, rebuilding it\n", programCachePath,
+                   count == -2 ? "was built by another driver" : "is damaged");
+            rewriteProgramCache();
+        } else {
+            printf("Program cache %s: %d programs\n", programCachePath, count);
+        }
+    }
+    programCacheState = 1;
+    return 1;
+}
+
+// Write out any dropped entries and forget the cache; the next context will
+// set it up again.
+void closeProgramCache() {
+    if (programCacheState > 0 && programCacheDirty) {
+        rewriteProgramCache();
+    }
+    freeProgramBinaries();
+    programCacheDirty = 0;
+    programCacheState = 0;
+}
+
+static uint64_t programKey(const char* fragSource) {
+    return hashString(fragSource, hashString(vertexShaderSource, driverHash));
+}
+
+static int loadCachedProgram(shader* shaderPtr, uint64_t key) {
+    programBinary** link = &programCacheHead;
+    for (programBinary* entry = programCacheHead; entry; link = &entry->next, entry = entry->next) {
+        if (entry->key != key) {
+            continue;
+        }
+        GLint linked = GL_FALSE;
+        shaderPtr->programId = glCreateProgram();
+        loadProgramBinaryData(shaderPtr->programId, entry->format, entry->data, entry->length);
+        glGetProgramiv(shaderPtr->programId, GL_LINK_STATUS, &linked);
+        // an unknown format raises GL_INVALID_ENUM, which is just a rejection here
+        while (glGetError() != GL_NO_ERROR);
+        if (linked) {
+            shaderPtr->vertexShaderId = 0;
+            shaderPtr->fragmentShaderId = 0;
+            programCacheHits++;
+            return 1;
+        }
+        glDeleteProgram(shaderPtr->programId);
+        *link = entry->next;
+        free(entry->data);
+        free(entry);
+        programCacheRejects++;
+        programCacheDirty = 1;
+        return 0;
+    }
+    return 0;
+}
+
+static void storeCachedProgram(shader* shaderPtr, uint64_t key) {
+    GLint length = 0;
+    glGetProgramiv(shaderPtr->programId, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+    if (length <= 0 || length > PROGRAM_CACHE_MAX_BINARY) {
+        return;
+    }
+    programBinary* entry = malloc(sizeof(programBinary));
+    void* data = malloc(length);
+    if (entry == NULL || data == NULL) {
+        free(entry);
+        free(data);
+        return;
+    }
+    getProgramBinary(shaderPtr->programId, length, &entry->length, &entry->format, data);
+    if (glGetError() != GL_NO_ERROR || entry->length <= 0) {
+        free(entry);
+        free(data);
+        return;
+    }
+    entry->key = key;
+    entry->data = data;
+    entry->next = programCacheHead;
+    programCacheHead = entry;
+    appendProgramBinary(entry);
+}
+
+// Link a program with its shaders attached. Returns -1, with the info log
+// on stderr, if it does not link.
+static int linkProgram(GLuint programId, const char* name) {
+    glLinkProgram(programId);
+    GLint linked = GL_FALSE;
+    glGetProgramiv(programId, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        GLchar infoLog[512];
+        glGetProgramInfoLog(programId, 512, NULL, infoLog);
+        fprintf(stderr, "%s program link failed: %s\n", name, infoLog);
+        return -1;
+    }
+    return 0;
+}
+
+shader buildShadersFromSource(const char* fragSource, stimulusParams params) {
+    shader myShader;
+    myShader.sourceHash = hashString(fragSource, HASH_SEED);
+    memset(&myShader.type, 0, sizeof(myShader.type));
+    myShader.patches = NULL;
+    myShader.movie = NULL;
+    myShader.image = NULL;
+    myShader.lutTexture = 0;
+
+    int useCache = initProgramCache();
+    uint64_t key = useCache ? programKey(fragSource) : 0;
+    if (!useCache || !loadCachedProgram(&myShader, key)) {
+        createShaders(&myShader, fragSource);
+        glAttachShader(myShader.programId, myShader.vertexShaderId);
+        glAttachShader(myShader.programId, myShader.fragmentShaderId);
+        int linked = linkProgram(myShader.programId, "Stimulus") == 0;
+        GLenum errorCheckValue = glGetError();
+        if (errorCheckValue != GL_NO_ERROR) {
+            fprintf(stderr, "ERROR: Could not attach shaders %s.\n", glGetErrorStr(errorCheckValue));
+        }
+        if (useCache) {
+            programCacheMisses++;
+            // a program that did not link is never cached
+            if (linked) {
+                storeCachedProgram(&myShader, key);
+            }
+        }
+    }
+    createVBO(&myShader);
+
+    myShader.params = params;
+    myShader.aspectRatio = (float)drm.mode.hdisplay / drm.mode.vdisplay;
+    return myShader;
+}
+
+shader buildStimulus(stimulusType type, stimulusParams params) {
+    char fragSource[FRAG_SOURCE_LENGTH];
+    composeFragSource(&type, &params, (float)drm.mode.hdisplay / drm.mode.vdisplay, fragSource, sizeof(fragSource));
+    shader myShader = buildShadersFromSource(fragSource, params);
+    myShader.type = type;
+    return myShader;
+}
+
+// The original drifting square wave. Angle and spatial frequency stay
+// uniforms so thread_update() can change the angle while it runs.
+shader buildShaders(float angle, float spatial, float cyclesPerSecond) {
+    stimulusType type = {CARRIER_SQUARE, ENVELOPE_NONE, TEMPORAL_DRIFT, PARAM_ANGLE | PARAM_SPATIAL};
+    stimulusParams params = defaultParams();
+    params.angle = angle;
+    params.spatial = spatial;
+    params.cyclesPerSecond = cyclesPerSecond;
+    return buildStimulus(type, params);
+}
+
+static GLuint compileShader(GLenum type, const char* source) {
+    GLint compile_ok = GL_FALSE;
+    GLuint id = glCreateShader(type);
+    glShaderSource(id, 1, &source, NULL);
+    glCompileShader(id);
+    glGetShaderiv(id, GL_COMPILE_STATUS, &compile_ok);
+    if (!compile_ok) {
+        GLchar infoLog[512];
+        glGetShaderInfoLog(id, 512, NULL, infoLog);
+        fprintf(stderr, "Shader compilation failed: %s\n", infoLog);
+        exit(EXIT_FAILURE);
+    }
+    return id;
+}
+
+// Batched patches.
+//
+// A patch set draws many small stimuli (receptive field mapping, sparse
+// noise) with one program and one draw call. Every patch is a quad around
+// its centre with its own position, size, orientation, spatial frequency,
+// contrast and phase; the carrier, envelope and temporal modulation are
+// shared and composed as for a full screen stimulus. Patches are blended
+// over the mean grey background by their envelope, so overlapping patches
+// still look right.
+//
+// With instanced arrays (GL 3.3, ES 3 or the ARB/EXT/ANGLE extensions) the
+// quad comes from the shader's own VBO and the patches from a buffer of
+// per-patch attributes. Without them, as on the Pi 3's GLES 2 driver, the
+// patch attributes are written out once per vertex when the patches are
+// set, and it is still a single glDrawArrays.
+//
+// A set can hold several frames of patches. Frame k of a trial shows patch
+// frame k modulo the number of frames, all uploaded up front.
+
+// Floats per patch: x, y, size, angle, spatial, contrast, phase. x and y are
+// the centre as for centerX and centerY. size is the envelope's sigma or
+// radius, or the half width of the patch without an envelope.
+#define PATCH_FLOATS 7
+#define PATCH_VERTEX_FLOATS (2 + PATCH_FLOATS)
+
+typedef struct patchSet {
+    int count;       // patches in a frame
+    int frames;      // frames of patches
+    int instanced;
+    GLuint buffer;
+} patchSet;
+
+static int instancingState = 0; // 0 not checked yet, 1 available, -1 not
+static PFNGLVERTEXATTRIBDIVISOREXTPROC vertexAttribDivisor = NULL;
+static PFNGLDRAWARRAYSINSTANCEDEXTPROC drawArraysInstanced = NULL;
+
+static int initInstancing() {
+    if (instancingState) {
+        return instancingState > 0;
+    }
+    instancingState = -1;
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    const char* version = (const char*)glGetString(GL_VERSION);
+    int major = 0;
+    int minor = 0;
+    if (version && strncmp(version, "OpenGL ES ", 10) == 0) {
+        sscanf(version + 10, "%d.%d", &major, &minor);
+        major = major >= 3 ? 4 : 0; // ES 3 has them in core
+    } else if (version) {
+        sscanf(version, "%d.%d", &major, &minor);
+    }
+    int core = major > 3 || (major == 3 && minor >= 3);
+    if (!core && (extensions == NULL || (strstr(extensions, "_instanced_arrays") == NULL))) {
+        printf("Instanced arrays not supported, patches are batched per vertex\n");
+        return 0;
+    }
+    const char* suffixes[] = {"", "ARB", "EXT", "ANGLE"};
+    for (int i = 0; i < 4 && (vertexAttribDivisor == NULL || drawArraysInstanced == NULL); i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "glVertexAttribDivisor%s", suffixes[i]);
+        vertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISOREXTPROC)eglGetProcAddress(name);
+        snprintf(name, sizeof(name), "glDrawArraysInstanced%s", suffixes[i]);
+        drawArraysInstanced = (PFNGLDRAWARRAYSINSTANCEDEXTPROC)eglGetProcAddress(name);
+    }
+    if (vertexAttribDivisor == NULL || drawArraysInstanced == NULL) {
+        printf("Instanced arrays not supported, patches are batched per vertex\n");
+        return 0;
+    }
+    instancingState = 1;
+    return 1;
+}
+
+void composePatchSources(const stimulusType* type, const stimulusParams* params, float aspectRatio,
+                         char* vertBuffer, char* fragBuffer, size_t size) {
+    int plaid = type->carrier == CARRIER_PLAID;
+
+    // how far the quad reaches from the centre, in units of size; a
+    // gaussian is cut where it is under half a grey level
+    vertBuffer[0] = '\0';
+    appendSource(vertBuffer, size,
+        "attribute vec2 corner;"
+        "attribute vec4 patchA;"
+        "attribute vec3 patchB;"
+        "varying vec2 local;"
+        "varying vec2 wave1;"
+        "%s"
+        "varying vec3 patch;"
+        "const float aspectRatio = %#.9g;"
+        "void main() {"
+        " float extent = %s;"
+        " local = corner * extent;"
+        " wave1 = patchB.x * vec2(cos(patchA.w), sin(patchA.w));",
+        plaid ? "varying vec2 wave2;" : "", aspectRatio,
+        type->envelope == ENVELOPE_GAUSSIAN ? "sqrt(6.0 * patchA.z)" :
+        type->envelope == ENVELOPE_NONE ? "patchA.z" : "patchA.z + 0.005");
+    if (plaid) {
+        appendSource(vertBuffer, size, " wave2 = patchB.x * vec2(cos(patchA.w + %#.9g), sin(patchA.w + %#.9g));",
+                     params->angle2 - params->angle, params->angle2 - params->angle);
+    }
+    appendSource(vertBuffer, size,
+        " patch = vec3(patchA.z, patchB.y, patchB.z);"
+        " gl_Position = vec4(patchA.x + local.x / aspectRatio, patchA.y + local.y, 0.0, 1.0);"
+        "}");
+
+    fragBuffer[0] = '\0';
+    appendSource(fragBuffer, size,
+        "uniform float phase;"
+        "varying vec2 local;"
+        "varying vec2 wave1;"
+        "%s"
+        "varying vec3 patch;", plaid ? "varying vec2 wave2;" : "");
+    declareCalibration(fragBuffer, size);
+    if (type->envelope == ENVELOPE_ANNULUS) {
+        appendSource(fragBuffer, size, "const float innerRatio = %#.9g;", params->innerRadius / params->radius);
+    }
+    appendWave(fragBuffer, size, type->carrier);
+
+    const char* shift = type->temporal == TEMPORAL_DRIFT ? " + phase" : "";
+    appendSource(fragBuffer, size, "void main() {");
+    if (plaid) {
+        appendSource(fragBuffer, size, " float w = 0.5 * (wave(dot(wave1, local) + patch.z%s) + wave(dot(wave2, local) + patch.z%s));",
+                     shift, shift);
+    } else {
+        appendSource(fragBuffer, size, " float w = wave(dot(wave1, local) + patch.z%s);", shift);
+    }
+    if (type->temporal == TEMPORAL_COUNTERPHASE) {
+        appendSource(fragBuffer, size, " w *= cos(phase);");
+    } else if (type->temporal == TEMPORAL_FLICKER) {
+        appendSource(fragBuffer, size, " w *= phase < 3.14159265 ? 1.0 : -1.0;");
+    }
+
+    if (type->envelope == ENVELOPE_GAUSSIAN) {
+        appendSource(fragBuffer, size, " float e = exp(-dot(local, local) / patch.x);");
+    } else if (type->envelope == ENVELOPE_CIRCLE) {
+        appendSource(fragBuffer, size, " float e = 1.0 - smoothstep(patch.x - 0.005, patch.x, length(local));");
+    } else if (type->envelope == ENVELOPE_ANNULUS) {
+        appendSource(fragBuffer, size,
+            " float r = length(local);"
+            " float e = smoothstep(patch.x * innerRatio - 0.005, patch.x * innerRatio, r) * (1.0 - smoothstep(patch.x - 0.005, patch.x, r));");
+    } else {
+        appendSource(fragBuffer, size, " float e = 1.0;");
+    }
+
+    if (calibration.mode == GAMMA_SHADER) {
+        // the lookup has to come after blending with the background, so
+        // the envelope is applied here and the patch covers what is under
+        // it; overlapping patches then hide each other instead of mixing
+        appendSource(fragBuffer, size,
+            " if (e < 0.002) discard;"
+            " float m = 0.5 + 0.5 * patch.y * w * e;");
+        appendCalibration(fragBuffer, size);
+        appendSource(fragBuffer, size, " gl_FragColor = vec4(m, m, m, 1.0);" "}");
+        return;
+    }
+    appendSource(fragBuffer, size,
+        " float m = 0.5 + 0.5 * patch.y * w;"
+        " gl_FragColor = vec4(m, m, m, e);"
+        "}");
+}
+
+// A patch set with no patches yet, see setPatches(). The uniform bits of
+// type are ignored: everything that differs between patches is an attribute.
+shader buildPatches(stimulusType type, stimulusParams params) {
+    char vertSource[FRAG_SOURCE_LENGTH];
+    char fragSource[FRAG_SOURCE_LENGTH];
+    float aspectRatio = (float)drm.mode.hdisplay / drm.mode.vdisplay;
+    composePatchSources(&type, &params, aspectRatio, vertSource, fragSource, FRAG_SOURCE_LENGTH);
+
+    shader myShader;
+    memset(&myShader, 0, sizeof(myShader));
+    myShader.vertexShaderId = compileShader(GL_VERTEX_SHADER, vertSource);
+    myShader.fragmentShaderId = compileShader(GL_FRAGMENT_SHADER, fragSource);
+    myShader.programId = glCreateProgram();
+    glAttachShader(myShader.programId, myShader.vertexShaderId);
+    glAttachShader(myShader.programId, myShader.fragmentShaderId);
+    glBindAttribLocation(myShader.programId, 0, "corner");
+    glBindAttribLocation(myShader.programId, 1, "patchA");
+    glBindAttribLocation(myShader.programId, 2, "patchB");
+    glLinkProgram(myShader.programId);
+    GLint linked = GL_FALSE;
+    glGetProgramiv(myShader.programId, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        GLchar infoLog[512];
+        glGetProgramInfoLog(myShader.programId, 512, NULL, infoLog);
+        fprintf(stderr, "Patch program link failed: %s\n", infoLog);
+        exit(EXIT_FAILURE);
+    }
+    createVBO(&myShader);
+
+    patchSet* set = calloc(1, sizeof(patchSet));
+    if (set == NULL) {
+        fprintf(stderr, "Memory allocation for the patch set failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    set->frames = 1;
+    set->instanced = initInstancing();
+    glGenBuffers(1, &set->buffer);
+
+    myShader.params = params;
+    myShader.aspectRatio = aspectRatio;
+    myShader.type = type;
+    myShader.sourceHash = hashString(fragSource, hashString(vertSource, HASH_SEED));
+    myShader.patches = set;
+    return myShader;
+}
+
+static void destroyPatches(patchSet* set) {
+    glDeleteBuffers(1, &set->buffer);
+    free(set);
+}
+
+// patches holds frames * count patches of PATCH_FLOATS floats, frame by
+// frame. They are uploaded here, so drawing them costs no transfer.
+void setPatches(shader* shaderPtr, const float* patches, int count, int frames) {
+    patchSet* set = shaderPtr->patches;
+    set->count = count;
+    set->frames = frames > 0 ? frames : 1;
+    size_t total = (size_t)count * set->frames;
+    glBindBuffer(GL_ARRAY_BUFFER, set->buffer);
+    if (set->instanced) {
+        glBufferData(GL_ARRAY_BUFFER, total * PATCH_FLOATS * sizeof(float), patches, GL_STATIC_DRAW);
+        return;
+    }
+
+    // every vertex of a patch's two triangles gets a copy of the patch
+    static const float corners[6][2] = {{-1, 1}, {1, 1}, {-1, -1}, {-1, -1}, {1, 1}, {1, -1}};
+    float* vertices = malloc((total > 0 ? total : 1) * 6 * PATCH_VERTEX_FLOATS * sizeof(float));
+    if (vertices == NULL) {
+        fprintf(stderr, "Memory allocation for the patch vertices failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t p = 0; p < total; p++) {
+        for (int v = 0; v < 6; v++) {
+            float* vertex = vertices + (p * 6 + v) * PATCH_VERTEX_FLOATS;
+            vertex[0] = corners[v][0];
+            vertex[1] = corners[v][1];
+            memcpy(vertex + 2, patches + p * PATCH_FLOATS, PATCH_FLOATS * sizeof(float));
+        }
+    }
+    glBufferData(GL_ARRAY_BUFFER, total * 6 * PATCH_VERTEX_FLOATS * sizeof(float), vertices, GL_STATIC_DRAW);
+    free(vertices);
+}
+
+static void drawPatches(shader* shaderPtr, long frame) {
+    patchSet* set = shaderPtr->patches;
+    GLfloat clearColor[4];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+    float grey = calibration.mode == GAMMA_SHADER ? calibratedLevel(0.5f) : 0.5f;
+    glClearColor(grey, grey, grey, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+    if (set->count == 0) {
+        return;
+    }
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    size_t first = (size_t)(frame % set->frames) * set->count;
+    if (set->instanced) {
+        glBindBuffer(GL_ARRAY_BUFFER, shaderPtr->VBOId);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
+        glBindBuffer(GL_ARRAY_BUFFER, set->buffer);
+        size_t offset = first * PATCH_FLOATS * sizeof(float);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, PATCH_FLOATS * sizeof(float), (void*)offset);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, PATCH_FLOATS * sizeof(float), (void*)(offset + 4 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
+        vertexAttribDivisor(1, 1);
+        vertexAttribDivisor(2, 1);
+        drawArraysInstanced(GL_TRIANGLES, 0, 6, set->count);
+        vertexAttribDivisor(1, 0);
+        vertexAttribDivisor(2, 0);
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, set->buffer);
+        GLsizei stride = PATCH_VERTEX_FLOATS * sizeof(float);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void*)0);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride, (void*)(2 * sizeof(float)));
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
+        glDrawArrays(GL_TRIANGLES, first * 6, set->count * 6);
+    }
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(2);
+    glDisable(GL_BLEND);
+
+    // full screen programs draw from attribute 0 as createVBO() left it
+    glBindBuffer(GL_ARRAY_BUFFER, shaderPtr->VBOId);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
+}
+
+// Lookup texture gratings.
+//
+// A grating is a function of one coordinate, the position along its wave
+// vector. buildLutStimulus() bakes one period of the carrier into a
+// LUT_SIZE x 1 texture that repeats, and the vertex stage works out the
+// coordinate in periods, phase included. It is linear across the screen,
+// so it interpolates exactly and the fragment stage never calls sin().
+// Without an envelope, temporal modulation or a contrast uniform the
+// contrast and calibration are baked in too, and a fragment is a single
+// texture fetch. Otherwise the texture holds the bare wave and the fragment
+// stage applies the rest as composeFragSource() does.
+#define LUT_SIZE 1024   // a power of two, for GL_REPEAT on GLES2
+
+// The carrier wave at a, as wave() in composed programs.
+static float carrierWave(int carrier, double a) {
+    if (carrier == CARRIER_SQUARE) {
+        double t = (sin(a) + 0.05) / 0.1;
+        t = t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t;
+        return t * t * (3.0 - 2.0 * t) * 2.0 - 1.0;
+    } else if (carrier == CARRIER_SAWTOOTH) {
+        double t = a / (2 * M_PI);
+        return (t - floor(t)) * 2.0 - 1.0;
+    }
+    return sin(a);
+}
+
+static int lutBaked(const stimulusType* type) {
+    return type->carrier != CARRIER_PLAID && type->envelope == ENVELOPE_NONE &&
+           type->temporal == TEMPORAL_DRIFT && !(type->uniforms & PARAM_CONTRAST);
+}
+
+void composeLutSources(const stimulusType* type, const stimulusParams* params, float aspectRatio,
+                       char* vertBuffer, char* fragBuffer, size_t size) {
+    int uniforms = type->uniforms;
+    int plaid = type->carrier == CARRIER_PLAID;
+    const char* shift = type->temporal == TEMPORAL_DRIFT ? " + phase" : "";
+
+    vertBuffer[0] = '\0';
+    appendSource(vertBuffer, size,
+        "attribute vec3 pos;"
+        "uniform float phase;"
+        "varying vec2 t;"
+        "const float aspectRatio = %#.9g;", aspectRatio);
+    declareParam(vertBuffer, size, "angle", params->angle, uniforms & PARAM_ANGLE);
+    declareParam(vertBuffer, size, "spatial", params->spatial, uniforms & PARAM_SPATIAL);
+    if (plaid) {
+        declareParam(vertBuffer, size, "angle2", params->angle2, uniforms & PARAM_ANGLE2);
+    }
+    if (type->envelope != ENVELOPE_NONE) {
+        appendSource(vertBuffer, size, "varying vec2 d;");
+        if (uniforms & PARAM_CENTER) {
+            appendSource(vertBuffer, size, "uniform float centerX;" "uniform float centerY;");
+        }
+    }
+    if (type->temporal != TEMPORAL_DRIFT) {
+        appendSource(vertBuffer, size, "varying float gain;");
+    }
+    appendSource(vertBuffer, size,
+        "void main() {"
+        " gl_Position = vec4(pos, 1.0);"
+        " vec2 p = vec2(pos.x * aspectRatio, pos.y);"
+        " t.x = (dot(spatial * vec2(cos(angle), sin(angle)), p)%s) * 0.159154943;", shift);
+    if (plaid) {
+        appendSource(vertBuffer, size, " t.y = (dot(spatial * vec2(cos(angle2), sin(angle2)), p)%s) * 0.159154943;", shift);
+    } else {
+        appendSource(vertBuffer, size, " t.y = 0.0;");
+    }
+    if (type->envelope != ENVELOPE_NONE) {
+        if (uniforms & PARAM_CENTER) {
+            appendSource(vertBuffer, size, " d = p - vec2(centerX * aspectRatio, centerY);");
+        } else {
+            appendSource(vertBuffer, size, " d = p - vec2(%#.9g, %#.9g);", params->centerX * aspectRatio, params->centerY);
+        }
+    }
+    if (type->temporal == TEMPORAL_COUNTERPHASE) {
+        appendSource(vertBuffer, size, " gain = cos(phase);");
+    } else if (type->temporal == TEMPORAL_FLICKER) {
+        appendSource(vertBuffer, size, " gain = phase < 3.14159265 ? 1.0 : -1.0;");
+    }
+    appendSource(vertBuffer, size, "}");
+
+    fragBuffer[0] = '\0';
+    appendSource(fragBuffer, size, "uniform sampler2D lut;" "varying vec2 t;");
+    if (lutBaked(type)) {
+        appendSource(fragBuffer, size, "void main() { gl_FragColor = texture2D(lut, vec2(t.x, 0.5)); }");
+        return;
+    }
+    declareCalibration(fragBuffer, size);
+    declareParam(fragBuffer, size, "contrast", params->contrast, uniforms & PARAM_CONTRAST);
+    if (type->envelope != ENVELOPE_NONE) {
+        appendSource(fragBuffer, size, "varying vec2 d;");
+    }
+    if (type->envelope == ENVELOPE_GAUSSIAN) {
+        declareParam(fragBuffer, size, "sigma", params->sigma, uniforms & PARAM_SIZE);
+    } else if (type->envelope == ENVELOPE_CIRCLE || type->envelope == ENVELOPE_ANNULUS) {
+        declareParam(fragBuffer, size, "radius", params->radius, uniforms & PARAM_SIZE);
+    }
+    if (type->envelope == ENVELOPE_ANNULUS) {
+        declareParam(fragBuffer, size, "innerRadius", params->innerRadius, uniforms & PARAM_SIZE);
+    }
+    if (type->temporal != TEMPORAL_DRIFT) {
+        appendSource(fragBuffer, size, "varying float gain;");
+    }
+    appendSource(fragBuffer, size, "void main() {");
+    if (plaid) {
+        appendSource(fragBuffer, size,
+            " float w = texture2D(lut, vec2(t.x, 0.5)).r + texture2D(lut, vec2(t.y, 0.5)).r - 1.0;");
+    } else {
+        appendSource(fragBuffer, size, " float w = texture2D(lut, vec2(t.x, 0.5)).r * 2.0 - 1.0;");
+    }
+    if (type->temporal != TEMPORAL_DRIFT) {
+        appendSource(fragBuffer, size, " w *= gain;");
+    }
+    if (type->envelope == ENVELOPE_GAUSSIAN) {
+        appendSource(fragBuffer, size, " w *= exp(-dot(d, d) / sigma);");
+    } else if (type->envelope == ENVELOPE_CIRCLE) {
+        appendSource(fragBuffer, size, " w *= 1.0 - smoothstep(radius - 0.005, radius, length(d));");
+    } else if (type->envelope == ENVELOPE_ANNULUS) {
+        appendSource(fragBuffer, size,
+            " float r = length(d);"
+            " w *= smoothstep(innerRadius - 0.005, innerRadius, r) * (1.0 - smoothstep(radius - 0.005, radius, r));");
+    }
+    appendSource(fragBuffer, size, " float m = 0.5 + 0.5 * contrast * w;");
+    appendCalibration(fragBuffer, size);
+    appendSource(fragBuffer, size, " gl_FragColor = vec4(m, m, m, 1.0);" "}");
+}
+
+// A grating drawn from a lookup texture. Noise has no period to bake and
+// is built by buildStimulus() instead.
+shader buildLutStimulus(stimulusType type, stimulusParams params) {
+    if (isNoiseCarrier(type.carrier)) {
+        return buildStimulus(type, params);
+    }
+    char vertSource[FRAG_SOURCE_LENGTH];
+    char fragSource[FRAG_SOURCE_LENGTH];
+    float aspectRatio = (float)drm.mode.hdisplay / drm.mode.vdisplay;
+    composeLutSources(&type, &params, aspectRatio, vertSource, fragSource, FRAG_SOURCE_LENGTH);
+
+    shader myShader;
+    memset(&myShader, 0, sizeof(myShader));
+    myShader.vertexShaderId = compileShader(GL_VERTEX_SHADER, vertSource);
+    myShader.fragmentShaderId = compileShader(GL_FRAGMENT_SHADER, fragSource);
+    myShader.programId = glCreateProgram();
+    glAttachShader(myShader.programId, myShader.vertexShaderId);
+    glAttachShader(myShader.programId, myShader.fragmentShaderId);
+    glBindAttribLocation(myShader.programId, 0, "pos");
+    linkProgram(myShader.programId, "Lookup stimulus");
+    glUseProgram(myShader.programId);
+    glUniform1i(glGetUniformLocation(myShader.programId, "lut"), 0);
+    createVBO(&myShader);
+
+    // texel i holds the wave at the middle of its span, (i + 0.5) / LUT_SIZE
+    // of a period
+    int baked = lutBaked(&type);
+    unsigned char texels[LUT_SIZE];
+    int carrier = type.carrier == CARRIER_PLAID ? CARRIER_SINE : type.carrier;
+    for (int i = 0; i < LUT_SIZE; i++) {
+        float w = carrierWave(carrier, 2 * M_PI * (i + 0.5) / LUT_SIZE);
+        float m = baked ? 0.5f + 0.5f * params.contrast * w : 0.5f + 0.5f * w;
+        if (baked && calibration.mode == GAMMA_SHADER) {
+            m = calibratedLevel(m);
+        }
+        texels[i] = (unsigned char)(m * 255.0f + 0.5f);
+    }
+    glGenTextures(1, &myShader.lutTexture);
+    glBindTexture(GL_TEXTURE_2D, myShader.lutTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, LUT_SIZE, 1, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, texels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    // filtering would smear the sawtooth's jump over a texel
+    GLint filter = carrier == CARRIER_SAWTOOTH ? GL_NEAREST : GL_LINEAR;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    myShader.params = params;
+    myShader.aspectRatio = aspectRatio;
+    myShader.type = type;
+    myShader.sourceHash = hashString(fragSource, hashString(vertSource, HASH_SEED));
+    return myShader;
+}
+
+// Images.
+//
+// A stimulus that shows a texture, with rows top first, letterboxed on a
+// background of mean grey to keep its shape. Pixels go to GL straight from
+// the caller's memory, and a region of them can be replaced between frames
+// with updateImage(). Movies use the same program.
+typedef struct image {
+    GLuint texture;
+    int width;
+    int height;
+    int channels;   // 1 grey, 3 RGB or 4 RGBA, alpha unused
+} image;
+
+static GLenum imageFormat(int channels) {
+    switch (channels) {
+    case 1:
+        return GL_LUMINANCE;
+    case 3:
+        return GL_RGB;
+    case 4:
+        return GL_RGBA;
+    default:
+        return 0;
+    }
+}
+
+// GLES 2 takes GL_FLOAT pixels only with GL_OES_texture_float; desktop GL
+// always converts them.
+int floatPixelsSupported() {
+    const char* version = (const char*)glGetString(GL_VERSION);
+    if (version && strncmp(version, "OpenGL ES", 9) != 0) {
+        return 1;
+    }
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    return extensions && strstr(extensions, "GL_OES_texture_float") != NULL;
+}
+
+// The program that draws an image of width by height texels, through the
+// calibration where it is in the shader. Returns -1 if it does not link,
+// with shaderPtr still to destroy.
+static int buildImageProgram(shader* shaderPtr, int width, int height) {
+    float screenAspect = (float)drm.mode.hdisplay / drm.mode.vdisplay;
+    float imageAspect = (float)width / height;
+    float scaleX = imageAspect < screenAspect ? imageAspect / screenAspect : 1.0f;
+    float scaleY = imageAspect < screenAspect ? 1.0f : screenAspect / imageAspect;
+    char vertSource[FRAG_SOURCE_LENGTH];
+    char fragSource[FRAG_SOURCE_LENGTH];
+    vertSource[0] = '\0';
+    appendSource(vertSource, sizeof(vertSource),
+        "attribute vec3 pos;"
+        "varying vec2 uv;"
+        "void main() {"
+        " gl_Position = vec4(pos.x * %#.9g, pos.y * %#.9g, 0.0, 1.0);"
+        " uv = vec2(pos.x * 0.5 + 0.5, 0.5 - pos.y * 0.5);"
+        "}", scaleX, scaleY);
+    fragSource[0] = '\0';
+    appendSource(fragSource, sizeof(fragSource), "uniform sampler2D frame;" "varying vec2 uv;");
+    declareCalibration(fragSource, sizeof(fragSource));
+    appendSource(fragSource, sizeof(fragSource), "void main() {" " vec3 c = texture2D(frame, uv).rgb;");
+    if (calibration.mode == GAMMA_SHADER) {
+        const char* channels = "rgb";
+        for (int i = 0; i < 3; i++) {
+            appendSource(fragSource, sizeof(fragSource), " { float m = c.%c;", channels[i]);
+            appendCalibration(fragSource, sizeof(fragSource));
+            appendSource(fragSource, sizeof(fragSource), " c.%c = m; }", channels[i]);
+        }
+    }
+    appendSource(fragSource, sizeof(fragSource), " gl_FragColor = vec4(c, 1.0);" "}");
+
+    memset(shaderPtr, 0, sizeof(shader));
+    shaderPtr->vertexShaderId = compileShader(GL_VERTEX_SHADER, vertSource);
+    shaderPtr->fragmentShaderId = compileShader(GL_FRAGMENT_SHADER, fragSource);
+    shaderPtr->programId = glCreateProgram();
+    glAttachShader(shaderPtr->programId, shaderPtr->vertexShaderId);
+    glAttachShader(shaderPtr->programId, shaderPtr->fragmentShaderId);
+    glBindAttribLocation(shaderPtr->programId, 0, "pos");
+    int linked = linkProgram(shaderPtr->programId, "Image");
+    glUseProgram(shaderPtr->programId);
+    glUniform1i(glGetUniformLocation(shaderPtr->programId, "frame"), 0);
+    createVBO(shaderPtr);
+    shaderPtr->params = defaultParams();
+    shaderPtr->params.cyclesPerSecond = 0.0f;
+    shaderPtr->aspectRatio = screenAspect;
+    shaderPtr->sourceHash = hashString(fragSource, hashString(vertSource, HASH_SEED));
+    return linked;
+}
+
+static void drawImage(shader* shaderPtr, GLuint texture, int width, int height) {
+    if (shaderPtr->aspectRatio != (float)width / height) {
+        float grey = calibration.mode == GAMMA_SHADER ? calibratedLevel(0.5f) : 0.5f;
+        GLfloat clearColor[4];
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+        glClearColor(grey, grey, grey, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glDrawArrays(GL_TRIANGLES, 0, shaderPtr->VBOlength);
+}
+
+// An image stimulus from pixels of type GL_UNSIGNED_BYTE or GL_FLOAT (0 to
+// 1), tightly packed. GL_FLOAT needs floatPixelsSupported(). Returns -1 for
+// an image it cannot show or GL does not take.
+int buildImage(int width, int height, int channels, GLenum type, const void* pixels, shader* shaderPtr) {
+    GLenum format = imageFormat(channels);
+    if (format == 0 || width < 1 || height < 1) {
+        fprintf(stderr, "Unable to show a %dx%d image of %d channels\n", width, height, channels);
+        return -1;
+    }
+    if (type == GL_FLOAT && !floatPixelsSupported()) {
+        fprintf(stderr, "Float pixels need GL_OES_texture_float\n");
+        return -1;
+    }
+    image* img = malloc(sizeof(image));
+    if (img == NULL) {
+        fprintf(stderr, "Memory allocation for the image failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    glGenTextures(1, &img->texture);
+    glBindTexture(GL_TEXTURE_2D, img->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, type, pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GLenum errorCheckValue = glGetError();
+    if (errorCheckValue != GL_NO_ERROR) {
+        fprintf(stderr, "ERROR: Could not upload the image %s.\n", glGetErrorStr(errorCheckValue));
+        glDeleteTextures(1, &img->texture);
+        free(img);
+        return -1;
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    int linked = buildImageProgram(shaderPtr, width, height);
+    shaderPtr->image = img;
+    if (linked < 0) {
+        destroyVBO(shaderPtr);
+        destroyShaders(shaderPtr);
+        return -1;
+    }
+    return 0;
+}
+
+// Replace the width by height region at (x, y), from the top left, of an
+// image stimulus. pixels have the image's channels. Returns -1 if the
+// region does not fit, -2 if GL does not take the pixels.
+int updateImage(shader* shaderPtr, int x, int y, int width, int height, GLenum type, const void* pixels) {
+    image* img = shaderPtr->image;
+    if (x < 0 || y < 0 || width < 0 || height < 0 || x + width > img->width || y + height > img->height) {
+        return -1;
+    }
+    if (type == GL_FLOAT && !floatPixelsSupported()) {
+        return -2;
+    }
+    glBindTexture(GL_TEXTURE_2D, img->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, imageFormat(img->channels), type, pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GLenum errorCheckValue = glGetError();
+    if (errorCheckValue != GL_NO_ERROR) {
+        fprintf(stderr, "ERROR: Could not upload the image %s.\n", glGetErrorStr(errorCheckValue));
+        return -2;
+    }
+    return 0;
+}
+
+static void destroyImage(image* img) {
+    glDeleteTextures(1, &img->texture);
+    free(img);
+}
+
+// Movies.
+//
+// A movie file is a MOVIE_HEADER_BYTES header and then raw frames of width *
+// height * channels bytes, top row first, grey (1 channel) or RGB (3):
+//
+//   char magic[4]      "RPGM"
+//   uint32 version     1
+//   uint32 width, height, channels, frames
+//   float frameRate    frames per second, 0 for one frame per refresh
+//   uint32 reserved
+//
+// all little endian. The file is memory mapped. A loader thread with its own
+// context, sharing textures with the render context, stays up to MOVIE_RING
+// frames ahead: it pages frames in, uploads them into a ring of textures and
+// waits for the upload to finish, so the render thread only binds a texture
+// and draws. A slot goes back to the loader two frames after it was last
+// drawn, when the flips that followed it mean the GPU is done with it.
+//
+// A movie loops, and plays on across the trials that show it: each trial
+// starts from the frame after the last one shown. If a frame is not loaded
+// in time the newest loaded frame is shown again and counted as a stall, and
+// the loader skips ahead to catch up.
+#define MOVIE_MAGIC "RPGM"
+#define MOVIE_HEADER_BYTES 32
+#define MOVIE_RING 8
+#define MOVIE_READAHEAD 32   // frames paged in ahead of the one uploading
+#define MOVIE_PRIME_TIMEOUT 10 // seconds to wait for the loader to fill the ring
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t frames;
+    float frameRate;
+    uint32_t reserved;
+} movieHeader;
+
+typedef struct movie {
+    movieHeader header;
+    unsigned char* data;       // the mapped file
+    size_t size;
+    size_t frameBytes;
+    GLuint textures[MOVIE_RING];
+    long slotFrames[MOVIE_RING]; // movie frame in each slot, counting on through loops
+    long retiredAt[MOVIE_RING];  // render frame after which a slot was no longer shown
+    atomic_long loaded;        // slots filled, ever
+    atomic_long released;      // slots handed back to the loader, ever
+    atomic_long wanted;        // movie frame the render thread is showing
+    atomic_int stop;
+    atomic_int failed;         // the loader could not start, nothing will be loaded
+    long consumed;             // slot being shown, ever
+    long drawCount;            // frames drawn
+    long lastFrame;            // frame argument of the last draw, -1 before any
+    long trialBase;            // movie frame the current trial started from
+    long stalls;               // frames drawn without the frame wanted
+    EGLDisplay display;
+    EGLContext context;        // the loader's, shares textures with the render context
+    EGLSurface surface;        // EGL_NO_SURFACE where surfaceless contexts work
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;       // a slot was released, or stop
+    pthread_cond_t filled;     // a slot was loaded, or the loader failed
+    struct movie* next;        // in openMovies
+} movie;
+
+// Every movie with a loader running, closed by EGLcleanup() if not before.
+static movie* openMovies = NULL;
+
+static void* movieLoader(void* arg) {
+    movie* mv = arg;
+    if (!eglMakeCurrent(mv->display, mv->surface, mv->surface, mv->context)) {
+        fprintf(stderr, "The movie loader has no context! Error: %s\n", eglGetErrorStr());
+        pthread_mutex_lock(&mv->lock);
+        atomic_store(&mv->failed, 1);
+        pthread_cond_broadcast(&mv->filled);
+        pthread_mutex_unlock(&mv->lock);
+        return NULL;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    GLenum format = mv->header.channels == 3 ? GL_RGB : GL_LUMINANCE;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    long next = 0;
+
+    while (!atomic_load(&mv->stop)) {
+        long n = atomic_load(&mv->loaded);
+        pthread_mutex_lock(&mv->lock);
+        while (n - atomic_load(&mv->released) >= MOVIE_RING && !atomic_load(&mv->stop)) {
+            pthread_cond_wait(&mv->wake, &mv->lock);
+        }
+        pthread_mutex_unlock(&mv->lock);
+        if (atomic_load(&mv->stop)) {
+            break;
+        }
+
+        long wanted = atomic_load(&mv->wanted);
+        if (next < wanted) {
+            next = wanted;
+        }
+        size_t offset = MOVIE_HEADER_BYTES + (size_t)(next % mv->header.frames) * mv->frameBytes;
+        size_t ahead = MOVIE_HEADER_BYTES + (size_t)((next + MOVIE_READAHEAD) % mv->header.frames) * mv->frameBytes;
+        size_t aheadPage = ahead & ~(size_t)(pageSize - 1);
+        madvise(mv->data + aheadPage, mv->frameBytes + (ahead - aheadPage), MADV_WILLNEED);
+
+        int slot = n % MOVIE_RING;
+        glBindTexture(GL_TEXTURE_2D, mv->textures[slot]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mv->header.width, mv->header.height, format, GL_UNSIGNED_BYTE,
+                        mv->data + offset);
+        glFinish();
+        mv->slotFrames[slot] = next;
+        pthread_mutex_lock(&mv->lock);
+        atomic_store(&mv->loaded, n + 1);
+        pthread_cond_broadcast(&mv->filled);
+        pthread_mutex_unlock(&mv->lock);
+        next++;
+    }
+
+    eglMakeCurrent(mv->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    return NULL;
+}
+
+static void closeMovie(movie* mv) {
+    for (movie** link = &openMovies; *link; link = &(*link)->next) {
+        if (*link == mv) {
+            *link = mv->next;
+            break;
+        }
+    }
+    if (mv->thread) {
+        pthread_mutex_lock(&mv->lock);
+        atomic_store(&mv->stop, 1);
+        pthread_cond_signal(&mv->wake);
+        pthread_mutex_unlock(&mv->lock);
+        pthread_join(mv->thread, NULL);
+    }
+    if (mv->context != EGL_NO_CONTEXT) {
+        eglDestroyContext(mv->display, mv->context);
+    }
+    if (mv->surface != EGL_NO_SURFACE) {
+        eglDestroySurface(mv->display, mv->surface);
+    }
+    glDeleteTextures(MOVIE_RING, mv->textures);
+    munmap(mv->data, mv->size);
+    pthread_mutex_destroy(&mv->lock);
+    pthread_cond_destroy(&mv->wake);
+    pthread_cond_destroy(&mv->filled);
+    free(mv);
+}
+
+// A context for the loader thread in the render context's share group.
+static int createLoaderContext(GLconfig* configPtr, movie* mv) {
+    EGLint configId;
+    EGLConfig config;
+    EGLint numConfigs;
+    eglQueryContext(configPtr->display, configPtr->context, EGL_CONFIG_ID, &configId);
+    const EGLint configIdAttribs[] = {EGL_CONFIG_ID, configId, EGL_NONE};
+    mv->display = configPtr->display;
+    mv->surface = EGL_NO_SURFACE;
+    if (!eglChooseConfig(configPtr->display, configIdAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+        return -1;
+    }
+    mv->context = eglCreateContext(configPtr->display, config, configPtr->context, contextAttribs);
+    if (mv->context == EGL_NO_CONTEXT) {
+        return -1;
+    }
+    const char* extensions = eglQueryString(configPtr->display, EGL_EXTENSIONS);
+    if (extensions && strstr(extensions, "EGL_KHR_surfaceless_context")) {
+        return 0;
+    }
+    // otherwise it needs something to be current on
+    if (!eglChooseConfig(configPtr->display, pbufferConfigAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+        return -1;
+    }
+    const EGLint pbufferAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    mv->surface = eglCreatePbufferSurface(configPtr->display, config, pbufferAttribs);
+    return mv->surface == EGL_NO_SURFACE ? -1 : 0;
+}
+
+static int readMovieHeader(movie* mv, const char* path) {
+    if (mv->size < MOVIE_HEADER_BYTES) {
+        fprintf(stderr, "%s is too short for a movie\n", path);
+        return -1;
+    }
+    memcpy(&mv->header, mv->data, sizeof(movieHeader));
+    movieHeader* h = &mv->header;
+    if (memcmp(h->magic, MOVIE_MAGIC, 4) != 0 || h->version != 1) {
+        fprintf(stderr, "%s is not a version 1 movie file\n", path);
+        return -1;
+    }
+    if (h->width == 0 || h->height == 0 || h->frames == 0 || (h->channels != 1 && h->channels != 3) ||
+        !(h->frameRate >= 0.0f)) {
+        fprintf(stderr, "%s has a bad movie header\n", path);
+        return -1;
+    }
+    mv->frameBytes = (size_t)h->width * h->height * h->channels;
+    if ((mv->size - MOVIE_HEADER_BYTES) / mv->frameBytes < h->frames) {
+        fprintf(stderr, "%s is shorter than its %u frames\n", path, h->frames);
+        return -1;
+    }
+    return 0;
+}
+
+// A stimulus that plays the movie file at path. The file must stay in
+// place while it plays.
+int buildMovie(GLconfig* configPtr, const char* path, shader* shaderPtr) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Unable to stat %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    movie* mv = calloc(1, sizeof(movie));
+    if (mv == NULL) {
+        fprintf(stderr, "Memory allocation for the movie failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    mv->size = st.st_size;
+    mv->data = mv->size ? mmap(NULL, mv->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mv->data == MAP_FAILED) {
+        fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+        free(mv);
+        return -1;
+    }
+    pthread_mutex_init(&mv->lock, NULL);
+    pthread_cond_init(&mv->wake, NULL);
+    pthread_condattr_t monotonic;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&mv->filled, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+    mv->context = EGL_NO_CONTEXT;
+    mv->surface = EGL_NO_SURFACE;
+    mv->lastFrame = -1;
+    if (readMovieHeader(mv, path) < 0) {
+        closeMovie(mv);
+        return -1;
+    }
+    madvise(mv->data, mv->size, MADV_SEQUENTIAL);
+    if (createLoaderContext(configPtr, mv) < 0) {
+        fprintf(stderr, "Unable to create a loader context! Error: %s\n", eglGetErrorStr());
+        closeMovie(mv);
+        return -1;
+    }
+
+    GLenum format = mv->header.channels == 3 ? GL_RGB : GL_LUMINANCE;
+    glGenTextures(MOVIE_RING, mv->textures);
+    for (int i = 0; i < MOVIE_RING; i++) {
+        glBindTexture(GL_TEXTURE_2D, mv->textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, mv->header.width, mv->header.height, 0, format, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    // the loader only sees the textures once they exist
+    glFinish();
+
+    if (buildImageProgram(shaderPtr, mv->header.width, mv->header.height) < 0) {
+        shaderPtr->movie = mv;
+        destroyVBO(shaderPtr);
+        destroyShaders(shaderPtr);
+        return -1;
+    }
+
+    if (pthread_create(&mv->thread, NULL, movieLoader, mv) != 0) {
+        fprintf(stderr, "Unable to start the movie loader\n");
+        mv->thread = 0;
+        shaderPtr->movie = mv;
+        destroyVBO(shaderPtr);
+        destroyShaders(shaderPtr);
+        return -1;
+    }
+    shaderPtr->movie = mv;
+    mv->next = openMovies;
+    openMovies = mv;
+    printf("Movie %s: %ux%u, %u channels, %u frames\n", path, mv->header.width, mv->header.height,
+           mv->header.channels, mv->header.frames);
+    return 0;
+}
+
+// Block until the loader has the ring full, so a trial starts with frames
+// in hand. Returns -1 if the loader failed or took longer than
+// MOVIE_PRIME_TIMEOUT.
+int primeMovie(movie* mv) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += MOVIE_PRIME_TIMEOUT;
+    int result = 0;
+    pthread_mutex_lock(&mv->lock);
+    while (atomic_load(&mv->loaded) - atomic_load(&mv->released) < MOVIE_RING) {
+        if (atomic_load(&mv->failed)) {
+            result = -1;
+            break;
+        }
+        if (pthread_cond_timedwait(&mv->filled, &mv->lock, &deadline) == ETIMEDOUT) {
+            fprintf(stderr, "The movie loader did not fill its ring in %d s\n", MOVIE_PRIME_TIMEOUT);
+            result = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mv->lock);
+    return result;
+}
+
+static void releaseMovieSlots(movie* mv) {
+    long released = atomic_load(&mv->released);
+    long freed = released;
+    while (freed < mv->consumed && mv->retiredAt[freed % MOVIE_RING] + 2 <= mv->drawCount) {
+        freed++;
+    }
+    if (freed != released) {
+        pthread_mutex_lock(&mv->lock);
+        atomic_store(&mv->released, freed);
+        pthread_cond_signal(&mv->wake);
+        pthread_mutex_unlock(&mv->lock);
+    }
+}
+
+static void drawMovie(shader* shaderPtr, long frame) {
+    movie* mv = shaderPtr->movie;
+    if (frame <= mv->lastFrame || mv->lastFrame < 0) {
+        // a new trial picks up after the last frame shown
+        mv->trialBase = mv->lastFrame < 0 ? 0 : atomic_load(&mv->wanted) + 1;
+    }
+    mv->lastFrame = frame;
+    long wanted = mv->trialBase + frame;
+    if (mv->header.frameRate > 0.0f) {
+        wanted = mv->trialBase + (long)(frame * frameClock.refreshPeriod * mv->header.frameRate / 1000000.0 + 1e-6);
+    }
+    atomic_store(&mv->wanted, wanted);
+
+    // move on to the newest loaded frame not past the one wanted
+    long loaded = atomic_load(&mv->loaded);
+    while (mv->consumed + 1 < loaded && mv->slotFrames[(mv->consumed + 1) % MOVIE_RING] <= wanted) {
+        mv->retiredAt[mv->consumed % MOVIE_RING] = mv->drawCount;
+        mv->consumed++;
+    }
+    mv->drawCount++;
+    releaseMovieSlots(mv);
+
+    if (mv->consumed >= loaded || mv->slotFrames[mv->consumed % MOVIE_RING] != wanted) {
+        mv->stalls++;
+    }
+    if (mv->consumed < loaded) {
+        drawImage(shaderPtr, mv->textures[mv->consumed % MOVIE_RING], mv->header.width, mv->header.height);
+    }
+}
+
+// Draw frame frame of a stimulus with its program in use.
+void drawStimulus(shader* shaderPtr, long frame) {
+    if (shaderPtr->patches) {
+        drawPatches(shaderPtr, frame);
+    } else if (shaderPtr->movie) {
+        drawMovie(shaderPtr, frame);
+    } else if (shaderPtr->image) {
+        image* img = shaderPtr->image;
+        drawImage(shaderPtr, img->texture, img->width, img->height);
+    } else {
+        if (isNoiseCarrier(shaderPtr->type.carrier)) {
+            setNoiseKeys(shaderPtr, frame);
+        }
+        if (shaderPtr->lutTexture) {
+            glBindTexture(GL_TEXTURE_2D, shaderPtr->lutTexture);
+        }
+        glDrawArrays(GL_TRIANGLES, 0, shaderPtr->VBOlength);
+    }
+}
+
+// Damage-limited redraw.
+//
+// A stimulus in an aperture only changes the pixels inside it; the rest of
+// the screen is background. Each frame records the rect it draws over
+// background, and beginDamage() asks EGL how old the back buffer is
+// (EGL_EXT_buffer_age). A buffer of age n holds the frame n frames ago, so
+// only the union of the rects of that frame and every frame since needs
+// drawing, and everything else is scissored off. Age 0, contents unknown,
+// or an age older than the history, draws the whole screen. The change
+// against the frame on screen goes to the kernel with the flip, through
+// drmModeDirtyFB(), or as FB_DAMAGE_CLIPS with PRESENT_ATOMIC.
+//
+// The sync patch is drawn whole every frame, so it stays out of the
+// history and only adds its own rect to what the kernel is told.
+//
+// Rects are in pixels from the top left, as the kernel takes them. A blank
+// frame's background is a different colour, so it counts as full screen.
+
+static void fullDamage(drmConfig* out, struct drm_mode_rect* rect) {
+    rect->x1 = 0;
+    rect->y1 = 0;
+    rect->x2 = out->mode.hdisplay;
+    rect->y2 = out->mode.vdisplay;
+}
+
+static void unionDamage(struct drm_mode_rect* rect, const struct drm_mode_rect* other) {
+    rect->x1 = other->x1 < rect->x1 ? other->x1 : rect->x1;
+    rect->y1 = other->y1 < rect->y1 ? other->y1 : rect->y1;
+    rect->x2 = other->x2 > rect->x2 ? other->x2 : rect->x2;
+    rect->y2 = other->y2 > rect->y2 ? other->y2 : rect->y2;
+}
+
+static int isFullDamage(drmConfig* out, const struct drm_mode_rect* rect) {
+    return rect->x1 <= 0 && rect->y1 <= 0 && rect->x2 >= out->mode.hdisplay && rect->y2 >= out->mode.vdisplay;
+}
+
+// The rect a frame of shaderPtr draws over background on out. Only an
+// envelope bounds a stimulus; a Gaussian is cut where it no longer moves
+// the float sum off the background, so the cut is exact at any bit depth.
+void stimulusDamage(shader* shaderPtr, drmConfig* out, struct drm_mode_rect* rect) {
+    const stimulusParams* params = &shaderPtr->params;
+    int envelope = shaderPtr->type.envelope;
+    if (shaderPtr->patches || shaderPtr->movie || shaderPtr->image || envelope == ENVELOPE_NONE) {
+        fullDamage(out, rect);
+        return;
+    }
+    float radius = params->radius;
+    if (envelope == ENVELOPE_GAUSSIAN) {
+        float contrast = fabsf(params->contrast) > 1.0f ? fabsf(params->contrast) : 1.0f;
+        radius = sqrtf(params->sigma * logf(16777216.0f * contrast));
+    }
+    // from units of half the screen height to pixels, with a pixel to spare
+    float aspectRatio = shaderPtr->aspectRatio;
+    float width = out->mode.hdisplay;
+    float height = out->mode.vdisplay;
+    float left = ((params->centerX * aspectRatio - radius) / aspectRatio + 1.0f) * width / 2 - 2;
+    float right = ((params->centerX * aspectRatio + radius) / aspectRatio + 1.0f) * width / 2 + 2;
+    float top = (1.0f - (params->centerY + radius)) * height / 2 - 2;
+    float bottom = (1.0f - (params->centerY - radius)) * height / 2 + 2;
+    rect->x1 = left < 0 ? 0 : left > width ? width : (int32_t)left;
+    rect->x2 = right < 0 ? 0 : right > width ? width : (int32_t)ceilf(right);
+    rect->y1 = top < 0 ? 0 : top > height ? height : (int32_t)top;
+    rect->y2 = bottom < 0 ? 0 : bottom > height ? height : (int32_t)ceilf(bottom);
+}
+
+// Forget what the back buffers hold, after drawing that was not tracked.
+void resetDamage() {
+    for (int i = 0; i < outputCount; i++) {
+        outputs[i]->damageFrames = 0;
+        outputs[i]->damaged = 0;
+        outputs[i]->rectDrawn = 0;
+        outputs[i]->patched = 0;
+    }
+}
+
+// Record rect as what this frame of output index draws over background, and
+// scissor to the part of the back buffer that has to change. patch is the
+// sync patch the frame carries, or NULL; drawSyncPatch() scissors to it on
+// its own, and it goes to the kernel as a damage rect of its own. Drawing
+// goes to the output's surface, which must be current.
+void beginDamage(GLconfig* configPtr, int index, const struct drm_mode_rect* rect, const struct drm_mode_rect* patch) {
+    drmConfig* out = outputs[index];
+    if (out == &drm && atomic.useStimulus) {
+        // settle the planes first, so a crop the driver refuses is drawn whole
+        testCrop(configPtr->device, rect, patch != NULL);
+    }
+    memmove(out->damageHistory + 1, out->damageHistory, (DAMAGE_HISTORY - 1) * sizeof(struct drm_mode_rect));
+    out->damageHistory[0] = *rect;
+    if (out->damageFrames < DAMAGE_HISTORY) {
+        out->damageFrames++;
+    }
+
+    EGLint age = 0;
+    EGLSurface surface = index == 0 ? configPtr->surface : out->surface;
+    if (!configPtr->damageTracking || !eglQuerySurface(configPtr->display, surface, EGL_BUFFER_AGE_EXT, &age)) {
+        age = 0;
+    }
+    out->frameRect = *rect;
+    out->rectDrawn = 1;
+    out->patched = patch != NULL;
+    struct drm_mode_rect redraw;
+    if (out == &drm && atomic.useStimulus) {
+        // the stimulus plane only scans out frameRect
+        redraw = out->frameRect;
+    } else if (age < 1 || age >= out->damageFrames) {
+        fullDamage(out, &redraw);
+    } else {
+        redraw = out->damageHistory[0];
+        for (int i = 1; i <= age; i++) {
+            unionDamage(&redraw, &out->damageHistory[i]);
+        }
+    }
+    if (isFullDamage(out, &redraw)) {
+        glDisable(GL_SCISSOR_TEST);
+    } else {
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(redraw.x1, out->mode.vdisplay - redraw.y2, redraw.x2 - redraw.x1, redraw.y2 - redraw.y1);
+    }
+
+    // against the frame on screen
+    out->damaged = 0;
+    if (configPtr->damageTracking && out->damageFrames > 1) {
+        out->damage[0] = out->damageHistory[0];
+        unionDamage(&out->damage[0], &out->damageHistory[1]);
+        out->damageClips = 1;
+        if (patch) {
+            out->damage[out->damageClips++] = *patch;
+        }
+        out->damaged = !isFullDamage(out, &out->damage[0]);
+    }
+}
+
+void endDamage() {
+    glDisable(GL_SCISSOR_TEST);
+}
+
+// Cache of pre-rendered stimulus cycles.
+//
+// A drifting grating repeats after one temporal cycle, so in cache mode the
+// cycle (refresh rate / cyclesPerSecond frames) is rendered into textures once
+// when the shader is loaded. Playback then only binds a texture and draws one
+// textured quad. Cycles are kept, keyed by stimulus parameters, until the
+// memory budget forces the least recently used ones out.
+//
+// The cycle has a whole number of frames, so the drift rate is quantised to
+// refresh rate / frameCount, and playback works out the phase at that rate so
+// it steps exactly one cached frame per vblank.
+
+#define CACHE_MAX_FRAMES 600
+
+typedef struct cycleCache {
+    uint64_t key;
+    int width;
+    int height;
+    int frameCount;
+    float cyclesPerSecond;  // drift rate actually played, refresh / frameCount
+    GLuint* textures;
+    size_t bytes;
+    unsigned long lastUsed;
+    struct cycleCache* next;
+} cycleCache;
+
+cycleCache* cacheHead = NULL;
+size_t cacheBytes = 0;
+size_t cacheBudget = (size_t)256 << 20;
+unsigned long cacheUseCount = 0;
+GLuint blitProgramId = 0;
+
+const char* blitVertexSource =
+    "attribute vec3 pos;"
+    "varying vec2 uv;"
+    "void main() {"
+    "    gl_Position = vec4(pos, 1.0);"
+    "    uv = pos.xy * 0.5 + 0.5;"
+    "}";
+
+const char* blitFragSource =
+    "uniform sampler2D frame;"
+    "varying vec2 uv;"
+    "void main() {"
+    "    gl_FragColor = texture2D(frame, uv);"
+    "}";
+
+// 0 if it does not link, and then no cycle is cached.
+static GLuint getBlitProgram() {
+    if (blitProgramId) {
+        return blitProgramId;
+    }
+    GLuint vertexShaderId = compileShader(GL_VERTEX_SHADER, blitVertexSource);
+    GLuint fragmentShaderId = compileShader(GL_FRAGMENT_SHADER, blitFragSource);
+    blitProgramId = glCreateProgram();
+    glAttachShader(blitProgramId, vertexShaderId);
+    glAttachShader(blitProgramId, fragmentShaderId);
+    glBindAttribLocation(blitProgramId, 0, "pos");
+    int linked = linkProgram(blitProgramId, "Blit");
+    glDeleteShader(vertexShaderId);
+    glDeleteShader(fragmentShaderId);
+    if (linked < 0) {
+        glDeleteProgram(blitProgramId);
+        blitProgramId = 0;
+        return 0;
+    }
+
+    glUseProgram(blitProgramId);
+    glUniform1i(glGetUniformLocation(blitProgramId, "frame"), 0);
+    return blitProgramId;
+}
+
+// Program plus every parameter that can change what it draws.
+static uint64_t cacheKey(shader* shaderPtr) {
+    uint64_t key = hashBytes(&shaderPtr->sourceHash, sizeof(shaderPtr->sourceHash), HASH_SEED);
+    key = hashBytes(&shaderPtr->params, sizeof(shaderPtr->params), key);
+    return hashBytes(&shaderPtr->aspectRatio, sizeof(shaderPtr->aspectRatio), key);
+}
+
+static int cacheMatches(cycleCache* cache, shader* shaderPtr) {
+    return cache->key == cacheKey(shaderPtr) &&
+           cache->width == drm.mode.hdisplay &&
+           cache->height == drm.mode.vdisplay;
+}
+
+static void destroyCycleCache(cycleCache* cache) {
+    glDeleteTextures(cache->frameCount, cache->textures);
+    cacheBytes -= cache->bytes;
+    free(cache->textures);
+    free(cache);
+}
+
+// Drop least recently used cycles until needed more bytes fit in the budget.
+static void evictCycleCaches(size_t needed) {
+    while (cacheHead && cacheBytes + needed > cacheBudget) {
+        cycleCache** oldest = &cacheHead;
+        for (cycleCache** c = &cacheHead; *c; c = &(*c)->next) {
+            if ((*c)->lastUsed < (*oldest)->lastUsed) {
+                oldest = c;
+            }
+        }
+        cycleCache* victim = *oldest;
+        *oldest = victim->next;
+        destroyCycleCache(victim);
+    }
+}
+
+int cacheContains(cycleCache* cache) {
+    for (cycleCache* c = cacheHead; c; c = c->next) {
+        if (c == cache) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void clearCycleCache() {
+    while (cacheHead) {
+        cycleCache* next = cacheHead->next;
+        destroyCycleCache(cacheHead);
+        cacheHead = next;
+    }
+    if (blitProgramId) {
+        glDeleteProgram(blitProgramId);
+        blitProgramId = 0;
+    }
+}
+
+static cycleCache* renderCycleCache(shader* shaderPtr) {
+    int width = drm.mode.hdisplay;
+    int height = drm.mode.vdisplay;
+    int frameCount = 1;
+    if (shaderPtr->params.cyclesPerSecond > 0.0f) {
+        frameCount = (int)(1000000.0 / (frameClock.refreshPeriod * shaderPtr->params.cyclesPerSecond) + 0.5);
+    }
+    if (frameCount < 1 || frameCount > CACHE_MAX_FRAMES) {
+        fprintf(stderr, "Not caching a %d frame cycle\n", frameCount);
+        return NULL;
+    }
+    // playback needs it, so find out now
+    if (getBlitProgram() == 0) {
+        return NULL;
+    }
+    size_t bytes = (size_t)width * height * 4 * frameCount;
+    if (bytes > cacheBudget) {
+        fprintf(stderr, "Cycle of %zu MB does not fit the cache budget\n", bytes >> 20);
+        return NULL;
+    }
+    evictCycleCaches(bytes);
+
+    cycleCache* cache = malloc(sizeof(cycleCache));
+    GLuint* textures = malloc(frameCount * sizeof(GLuint));
+    if (cache == NULL || textures == NULL) {
+        fprintf(stderr, "Memory allocation for the cycle cache failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    cache->textures = textures;
+    cache->key = cacheKey(shaderPtr);
+    cache->width = width;
+    cache->height = height;
+    cache->frameCount = frameCount;
+    cache->cyclesPerSecond = shaderPtr->params.cyclesPerSecond > 0.0f ? (float)(1000000.0 / (frameClock.refreshPeriod * frameCount)) : 0.0f;
+    cache->bytes = bytes;
+
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenTextures(frameCount, cache->textures);
+    glViewport(0, 0, width, height);
+    glUseProgram(shaderPtr->programId);
+    int phaseLocation = glGetUniformLocation(shaderPtr->programId, "phase");
+
+    for (int k = 0; k < frameCount; k++) {
+        glBindTexture(GL_TEXTURE_2D, cache->textures[k]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, cache->textures[k], 0);
+        if (k == 0 && glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "ERROR: Could not render to a cycle cache texture.\n");
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glDeleteFramebuffers(1, &fbo);
+            glDeleteTextures(frameCount, cache->textures);
+            free(cache->textures);
+            free(cache);
+            return NULL;
+        }
+        glUniform1f(phaseLocation, (float)(2.0 * M_PI * k / frameCount));
+        glDrawArrays(GL_TRIANGLES, 0, shaderPtr->VBOlength);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+
+    GLenum errorCheckValue = glGetError();
+    if (errorCheckValue != GL_NO_ERROR) {
+        fprintf(stderr, "ERROR: Could not render the cycle cache %s.\n", glGetErrorStr(errorCheckValue));
+    }
+
+    cacheBytes += bytes;
+    cache->next = cacheHead;
+    cacheHead = cache;
+    printf("Cached a %d frame cycle, %zu MB in use\n", frameCount, cacheBytes >> 20);
+    return cache;
+}
+
+// Find the cycle for this shader, rendering it on a miss.
+cycleCache* getCycleCache(shader* shaderPtr) {
+    if (shaderPtr->patches || shaderPtr->movie || shaderPtr->image || isNoiseCarrier(shaderPtr->type.carrier)) {
+        // patches, movies, images and noise change from frame to frame, they are always drawn
+        return NULL;
+    }
+    if (shaderPtr->lutTexture) {
+        // already a texture fetch a pixel
+        return NULL;
+    }
+    cycleCache* cache = cacheHead;
+    while (cache && !cacheMatches(cache, shaderPtr)) {
+        cache = cache->next;
+    }
+    if (cache == NULL) {
+        cache = renderCycleCache(shaderPtr);
+    }
+    if (cache) {
+        cache->lastUsed = ++cacheUseCount;
+    }
+    return cache;
+}
+
+// Draw the cached frame closest to phase. The caller binds the blit program.
+static void drawCachedFrame(cycleCache* cache, float phase, int VBOlength) {
+    int k = (int)(phase / (2.0 * M_PI) * cache->frameCount + 0.5) % cache->frameCount;
+    glBindTexture(GL_TEXTURE_2D, cache->textures[k]);
+    glDrawArrays(GL_TRIANGLES, 0, VBOlength);
+}
+
+void loadShader(GLconfig* configPtr, shader* shaderPtr) {
+
+    glUseProgram(shaderPtr->programId);
+
+    setStimulusUniforms(shaderPtr, &shaderPtr->params);
+
+    GLenum errorCheckValue = glGetError();
+    if (errorCheckValue != GL_NO_ERROR) {
+        fprintf(stderr, "ERROR: Could not use shader program %s.\n", glGetErrorStr(errorCheckValue));
+    }
+    configPtr->currentShaderPtr = shaderPtr;
+
+    configPtr->currentCache = NULL;
+    if (configPtr->cacheMode) {
+        configPtr->currentCache = getCycleCache(shaderPtr);
+        glUseProgram(shaderPtr->programId);
+    }
+}
+
+int getDeviceDisplay(GLconfig* configPtr, int mode) {
+    // You can try chaning this to "card0" if "card1" does not work.
+    configPtr->device = open("/dev/dri/card1", O_RDWR | O_CLOEXEC);
+    if (getDisplay(&(configPtr->display), configPtr->device, mode) != 0)  {
+        fprintf(stderr, "Unable to get EGL display\n");
+        close(configPtr->device);
+        return EXIT_FAILURE;
+    }
+    return 1;
+} 
+
+// Mode used by PRESENT_OFFSCREEN in place of a connector mode.
+drmModeModeInfo offscreenMode = {
+    .hdisplay = 1920,
+    .vdisplay = 1080,
+    .vrefresh = 60,
+};
+
+void setOffscreenMode(int width, int height, int vrefresh) {
+    memset(&offscreenMode, 0, sizeof(offscreenMode));
+    offscreenMode.hdisplay = width;
+    offscreenMode.vdisplay = height;
+    offscreenMode.vrefresh = vrefresh;
+}
+
+int getOffscreenDisplay(GLconfig* configPtr) {
+    configPtr->device = -1;
+    drm.mode = offscreenMode;
+    printf("Offscreen resolution: %ix%i\n", drm.mode.hdisplay, drm.mode.vdisplay);
+
+    configPtr->display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        configPtr->display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (configPtr->display == EGL_NO_DISPLAY) {
+        configPtr->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (configPtr->display == EGL_NO_DISPLAY) {
+        fprintf(stderr, "Unable to get an offscreen EGL display\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int EGLinit(GLconfig* configPtr) {
+    int major, minor;
+    if (eglInitialize(configPtr->display, &major, &minor) && eglBindAPI(EGL_OPENGL_API)) {
+        printf("Initialized EGL version: %d.%d\n", major, minor);            
+        return 1;
+    }
+
+    fprintf(stderr, "Failed to get EGL version! Error: %s\n",  eglGetErrorStr());
+    eglTerminate(configPtr->display);
+    gbmClean(configPtr->device);
+    return EXIT_FAILURE;
+    
+}
+
+int EGLGetConfig(EGLConfig **configs, int *configIndex, GLconfig* configPtr) {
+    EGLint count, numConfigs;
+    eglGetConfigs(configPtr->display, NULL, 0, &count);
+    *configs = malloc(count * sizeof(EGLConfig));
+    if (!eglChooseConfig(configPtr->display, configAttribs, *configs, count, &numConfigs))  {
+        fprintf(stderr, "Failed to get EGL configs! Error: %s\n", eglGetErrorStr());
+        eglTerminate(configPtr->display);
+        gbmClean(configPtr->device);
+        return EXIT_FAILURE;
+    }
+
+    // I am not exactly sure why the EGL config must match the GBM format.
+    // But it works!
+
+    
+    *configIndex = matchConfigToVisual(configPtr->display, GBM_FORMAT_XRGB8888, *configs, numConfigs);
+    if (configIndex < 0)  {
+        fprintf(stderr, "Failed to find matching EGL config! Error: %s\n",  eglGetErrorStr());
+        eglTerminate(configPtr->display);
+        gbm_surface_destroy(drm.gbmSurface);
+        gbm_device_destroy(drm.gbmDevice);
+        free(configs);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int EGLGetContext(EGLConfig config, GLconfig* configPtr) {
+    
+    configPtr->context = eglCreateContext(configPtr->display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (configPtr->context == EGL_NO_CONTEXT)  {
+        fprintf(stderr, "Failed to create EGL context! Error: %s\n",  eglGetErrorStr());
+        eglTerminate(configPtr->display);
+        gbmClean(configPtr->device);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int EGLGetSurface(EGLConfig config, GLconfig* configPtr) {
+    configPtr->surface = eglCreateWindowSurface(configPtr->display, config, drm.gbmSurface, NULL);
+    if (configPtr->surface == EGL_NO_SURFACE)  {
+        fprintf(stderr, "Failed to create EGL surface! Error: %s\n",  eglGetErrorStr());
+        eglDestroyContext(configPtr->display, configPtr->context);
+        eglTerminate(configPtr->display);
+        gbmClean(configPtr->device);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+
+}
+
+int EGLGetOffscreenSurface(GLconfig* configPtr) {
+    EGLConfig config;
+    EGLint numConfigs;
+    if (!eglChooseConfig(configPtr->display, pbufferConfigAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+        fprintf(stderr, "Failed to get a pbuffer EGL config! Error: %s\n", eglGetErrorStr());
+        eglTerminate(configPtr->display);
+        return EXIT_FAILURE;
+    }
+    if (EGLGetContext(config, configPtr) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    const EGLint pbufferAttribs[] = {
+        EGL_WIDTH, drm.mode.hdisplay,
+        EGL_HEIGHT, drm.mode.vdisplay,
+        EGL_NONE
+    };
+    configPtr->surface = eglCreatePbufferSurface(configPtr->display, config, pbufferAttribs);
+    if (configPtr->surface == EGL_NO_SURFACE)  {
+        fprintf(stderr, "Failed to create EGL pbuffer! Error: %s\n",  eglGetErrorStr());
+        eglDestroyContext(configPtr->display, configPtr->context);
+        eglTerminate(configPtr->display);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void EGLcleanup(GLconfig* configPtr) {
+    while (openMovies) {
+        closeMovie(openMovies);
+    }
+    clearCycleCache();
+    closeProgramCache();
+    closeGpio();
+    clearCalibration(configPtr->device);
+    eglDestroyContext(configPtr->display, configPtr->context);
+    eglDestroySurface(configPtr->display, configPtr->surface);
+    for (int i = 1; i < outputCount; i++) {
+        eglDestroySurface(configPtr->display, outputs[i]->surface);
+    }
+    eglTerminate(configPtr->display);
+    gbmClean(configPtr->device);
+}
+
+int checkViewport(GLconfig* configPtr) {
+    int desiredWidth = drm.mode.hdisplay;
+    int desiredHeight = drm.mode.vdisplay;
+
+    // Set GL Viewport size, always needed!
+    glViewport(0, 0, desiredWidth, desiredHeight);
+
+    // Get GL Viewport size and test if it is correct.
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // viewport[2] and viewport[3] are viewport width and height respectively
+    printf("GL Viewport size: %dx%d\n", viewport[2], viewport[3]);
+
+    if (viewport[2] != desiredWidth || viewport[3] != desiredHeight)   {
+        fprintf(stderr, "Error! The glViewport returned incorrect values! Something is wrong!\n");
+        EGLcleanup(configPtr);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+GLconfig setup(int mode, int presentMode) {
+    drm.previousBo=NULL;
+    drm.previousFb = 0;
+    drm.pendingBo = NULL;
+    drm.flipPending = 0;
+    drm.modeSet = 0;
+    drm.drawn = 0;
+    memset(&frameClock, 0, sizeof(frameClock));
+
+    GLconfig config;
+    config.presentMode = presentMode;
+    config.timebase = TIMEBASE_CLOCK;
+    config.cacheMode = 0;
+    config.recovery = RECOVER_HOLD;
+    config.currentCache = NULL;
+    config.currentShaderPtr = NULL;
+    drm.damageFrames = 0;
+    drm.damaged = 0;
+    drm.rectDrawn = 0;
+    drm.patched = 0;
+    drm.dirtyFbFailed = 0;
+    atomic.active = 0;
+
+    if (presentMode == PRESENT_OFFSCREEN) {
+        // mode is ignored, the size comes from setOffscreenMode()
+        getOffscreenDisplay(&config);
+        syncVblankClock(config.device);
+        EGLinit(&config);
+        EGLGetOffscreenSurface(&config);
+    } else {
+        getDeviceDisplay(&config, mode);
+        if (presentMode == PRESENT_ATOMIC && initAtomic(config.device) < 0) {
+            config.presentMode = PRESENT_PAGEFLIP;
+        }
+        syncVblankClock(config.device);
+        EGLinit(&config);
+
+        EGLConfig *EGLconfigs;
+        int configIndex;
+        EGLGetConfig(&EGLconfigs, &configIndex, &config);
+        EGLGetContext(EGLconfigs[configIndex], &config);
+        EGLGetSurface(EGLconfigs[configIndex], &config);
+        free(EGLconfigs); //configs is malloced in EGLGetConfig()
+    }
+    eglMakeCurrent(config.display, config.surface, config.surface, config.context);
+    const char* eglExtensions = eglQueryString(config.display, EGL_EXTENSIONS);
+    config.damageTracking = eglExtensions && strstr(eglExtensions, "EGL_EXT_buffer_age") != NULL;
+
+    const char* version = (const char*)glGetString(GL_VERSION);
+    printf("OpenGL Version: %s\n", version);
+    const char* glslVersion = (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION);
+    printf("GLSL Version: %s\n", glslVersion);
+
+
+    //checkViewport(&config);
+    return config;
+}
+
+// Drive another connected connector, with mode from its mode list, alongside
+// the one setup() took. Outputs can only be added to a session that scans
+// out, and stay until EGLcleanup(). Stimuli are built with the first
+// output's aspect ratio, so outputs should run modes of the same shape.
+// Returns the output's index, or -1.
+int addOutput(GLconfig* configPtr, uint32_t connectorId, int mode) {
+    if (configPtr->presentMode == PRESENT_OFFSCREEN) {
+        fprintf(stderr, "An offscreen session has no outputs to add\n");
+        return -1;
+    }
+    if (outputCount >= MAX_OUTPUTS) {
+        fprintf(stderr, "No more than %d outputs\n", MAX_OUTPUTS);
+        return -1;
+    }
+    for (int i = 0; i < outputCount; i++) {
+        if (outputs[i]->connectorId == connectorId) {
+            fprintf(stderr, "Connector %u is already an output\n", connectorId);
+            return -1;
+        }
+    }
+
+    int device = configPtr->device;
+    drmModeRes *resources = drmModeGetResources(device);
+    if (resources == NULL) {
+        fprintf(stderr, "Unable to get DRM resources\n");
+        return -1;
+    }
+    drmModeConnector *connector = drmModeGetConnector(device, connectorId);
+    if (connector == NULL || connector->connection != DRM_MODE_CONNECTED) {
+        fprintf(stderr, "Connector %u is not connected\n", connectorId);
+        if (connector) {
+            drmModeFreeConnector(connector);
+        }
+        drmModeFreeResources(resources);
+        return -1;
+    }
+    if (mode < 0 || mode >= connector->count_modes) {
+        fprintf(stderr, "Connector %u has no mode %d\n", connectorId, mode);
+        drmModeFreeConnector(connector);
+        drmModeFreeResources(resources);
+        return -1;
+    }
+    int crtcIndex = findFreeCrtc(resources, connector, device);
+    if (crtcIndex < 0) {
+        fprintf(stderr, "No free CRTC for connector %u\n", connectorId);
+        drmModeFreeConnector(connector);
+        drmModeFreeResources(resources);
+        return -1;
+    }
+
+    drmConfig* out = calloc(1, sizeof(drmConfig));
+    out->connectorId = connectorId;
+    out->mode = connector->modes[mode];
+    out->crtc = drmModeGetCrtc(device, resources->crtcs[crtcIndex]);
+    out->crtcIndex = crtcIndex;
+    out->gbmDevice = drm.gbmDevice;
+    drmModeFreeConnector(connector);
+    drmModeFreeResources(resources);
+    printf("Output %d resolution: %ix%i\n", outputCount, out->mode.hdisplay, out->mode.vdisplay);
+
+    // the surface must be compatible with the context, so use its config
+    EGLint configId;
+    EGLConfig config;
+    EGLint numConfigs;
+    eglQueryContext(configPtr->display, configPtr->context, EGL_CONFIG_ID, &configId);
+    const EGLint configIdAttribs[] = {EGL_CONFIG_ID, configId, EGL_NONE};
+    out->gbmSurface = gbm_surface_create(drm.gbmDevice, out->mode.hdisplay, out->mode.vdisplay, GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+    if (out->gbmSurface == NULL ||
+        !eglChooseConfig(configPtr->display, configIdAttribs, &config, 1, &numConfigs) || numConfigs < 1 ||
+        (out->surface = eglCreateWindowSurface(configPtr->display, config, out->gbmSurface, NULL)) == EGL_NO_SURFACE) {
+        fprintf(stderr, "Failed to create a surface for connector %u! Error: %s\n", connectorId, eglGetErrorStr());
+        if (out->gbmSurface) {
+            gbm_surface_destroy(out->gbmSurface);
+        }
+        drmModeFreeCrtc(out->crtc);
+        free(out);
+        return -1;
+    }
+
+    outputs[outputCount] = out;
+    outputCount++;
+    calibrateOutput(configPtr, out);
+    return outputCount - 1;
+}
+
+// Point GL at output index, with a viewport to match its mode.
+void useOutput(GLconfig* configPtr, int index) {
+    EGLSurface surface = index == 0 ? configPtr->surface : outputs[index]->surface;
+    eglMakeCurrent(configPtr->display, surface, surface, configPtr->context);
+    glViewport(0, 0, outputs[index]->mode.hdisplay, outputs[index]->mode.vdisplay);
+}
+
+// A frame has been drawn on output index (not the first). It is flipped
+// with the first output's next presentFrame().
+void finishOutput(GLconfig* configPtr, int index) {
+    eglSwapBuffers(configPtr->display, outputs[index]->surface);
+    outputs[index]->drawn = 1;
+}
+
+#define DISPLAY_FRAMES 400
+
+// Summary of one presentation. Intervals are between scanouts, in
+// microseconds.
+typedef struct {
+    int frames;
+    int dropped;        // frames that came late, by the vblank sequence
+    int missed;         // vblanks missed in all
+    long minInterval;
+    long maxInterval;
+    double meanInterval;
+    double jitter;        // standard deviation of the intervals
+    double baselineJitter; // jitter of the latest run without real-time mode, 0 before one
+    int realtime;         // REALTIME_* parts that were in effect
+    long triggerTime;     // kernel timestamp of the trigger edge, 0 without one
+    long triggerLatency;  // trigger edge to first scanout
+    long wakeLatency;     // trigger edge to the render loop running again
+} frameStats;
+
+// A frame that never reached the screen has time 0, and the intervals on
+// either side of it are left out.
+void computeFrameStats(frameStats* stats, long* photonTimes, int nFrames) {
+    memset(stats, 0, sizeof(frameStats));
+    stats->frames = nFrames;
+    int intervals = 0;
+    double sum = 0.0;
+    stats->minInterval = LONG_MAX;
+    for (int q = 1; q < nFrames; q++) {
+        if (photonTimes[q] == 0 || photonTimes[q-1] == 0) {
+            continue;
+        }
+        long interval = photonTimes[q] - photonTimes[q-1];
+        if (interval < stats->minInterval) {
+            stats->minInterval = interval;
+        }
+        if (interval > stats->maxInterval) {
+            stats->maxInterval = interval;
+        }
+        sum += interval;
+        intervals++;
+    }
+    if (intervals == 0) {
+        stats->minInterval = 0;
+        return;
+    }
+    stats->meanInterval = sum / intervals;
+
+    double sumSquares = 0.0;
+    for (int q = 1; q < nFrames; q++) {
+        if (photonTimes[q] == 0 || photonTimes[q-1] == 0) {
+            continue;
+        }
+        double deviation = photonTimes[q] - photonTimes[q-1] - stats->meanInterval;
+        sumSquares += deviation * deviation;
+    }
+    stats->jitter = sqrt(sumSquares / intervals);
+}
+
+// Opt-in real-time mode for whichever thread runs the render loop.
+//
+// For the length of a display the thread gets SCHED_FIFO at the given
+// priority and is pinned to cpuMask, and its stack is touched so it does not
+// fault. Memory locking and heap prefault are process wide, so they are
+// done once and stay; neither changes how malloc behaves. Each part that is
+// not permitted (no CAP_SYS_NICE, rtprio or memlock limits) is skipped with
+// a warning and the display runs without it. frameStats.realtime says which
+// parts were in effect, and frameStats.baselineJitter keeps the jitter of the
+// latest run without them, so every real-time run carries the before and
+// after figures.
+#define REALTIME_PRIORITY (1 << 0)
+#define REALTIME_AFFINITY (1 << 1)
+#define REALTIME_LOCKED (1 << 2)
+#define REALTIME_PREFAULTED (1 << 3)
+
+typedef struct {
+    int enabled;
+    int priority;           // SCHED_FIFO priority, 0 leaves the policy alone
+    unsigned long cpuMask;  // CPUs the render thread may run on, 0 for any
+    int lockMemory;
+    size_t stackBytes;      // stack to prefault on every display
+    size_t heapBytes;       // heap to prefault and keep, once
+} realtimeConfig;
+
+realtimeConfig realtime = {
+    .enabled = 0,
+    .priority = 50,
+    .cpuMask = 0,
+    .lockMemory = 1,
+    .stackBytes = 256 * 1024,
+    .heapBytes = 8 * 1024 * 1024,
+};
+
+// What enterRealtime() changed, for leaveRealtime() to undo.
+typedef struct {
+    int applied;
+    int policy;
+    struct sched_param param;
+    cpu_set_t cpus;
+} realtimeState;
+
+#define PREFAULT_CHUNK (64 * 1024) // under glibc's mmap threshold, so it comes from the heap
+
+static int memoryLocked = 0;
+static int heapPrefaulted = 0;
+static void* heapFence = NULL;
+static double baselineJitter = 0.0;
+
+static void prefaultStack(size_t bytes) {
+    volatile unsigned char* stack = alloca(bytes);
+    for (size_t i = 0; i < bytes; i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+// Grow the heap by bytes and touch it. malloc only gives memory back to the
+// kernel from the top of the heap, so the topmost chunk is kept and the
+// others, freed below it, stay resident for later allocations.
+static void prefaultHeap(size_t bytes) {
+    int count = bytes / PREFAULT_CHUNK;
+    void** chunks = calloc(count, sizeof(void*));
+    if (chunks == NULL) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        chunks[i] = malloc(PREFAULT_CHUNK);
+        if (chunks[i] == NULL) {
+            break;
+        }
+        for (size_t j = 0; j < PREFAULT_CHUNK; j += 4096) {
+            ((volatile unsigned char*)chunks[i])[j] = 0;
+        }
+        if ((uintptr_t)chunks[i] > (uintptr_t)heapFence) {
+            heapFence = chunks[i];
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (chunks[i] != heapFence) {
+            free(chunks[i]);
+        }
+    }
+    free(chunks);
+}
+
+static void lockMemory() {
+    // With a memlock limit MCL_FUTURE would make later allocations fail
+    // once the limit is reached, so only lock when there is none.
+    struct rlimit limit;
+    if (geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        fprintf(stderr, "Real-time: memlock limit is %lu kB, not locking memory\n", (unsigned long)limit.rlim_cur / 1024);
+        return;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "Real-time: unable to lock memory: %s\n", strerror(errno));
+        return;
+    }
+    memoryLocked = 1;
+}
+
+void enterRealtime(realtimeState* state) {
+    state->applied = 0;
+    if (!realtime.enabled) {
+        return;
+    }
+
+    if (realtime.lockMemory && !memoryLocked) {
+        lockMemory();
+    }
+    if (realtime.heapBytes && !heapPrefaulted) {
+        prefaultHeap(realtime.heapBytes);
+        heapPrefaulted = 1;
+    }
+    prefaultStack(realtime.stackBytes);
+    if (memoryLocked) {
+        state->applied |= REALTIME_LOCKED;
+    }
+    if (heapPrefaulted) {
+        state->applied |= REALTIME_PREFAULTED;
+    }
+
+    if (realtime.cpuMask && pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &state->cpus) == 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < (int)(8 * sizeof(realtime.cpuMask)); cpu++) {
+            if (realtime.cpuMask & (1UL << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+        if (error) {
+            fprintf(stderr, "Real-time: unable to set CPU affinity: %s\n", strerror(error));
+        } else {
+            state->applied |= REALTIME_AFFINITY;
+        }
+    }
+
+    if (realtime.priority > 0 && pthread_getschedparam(pthread_self(), &state->policy, &state->param) == 0) {
+        struct sched_param param = {.sched_priority = realtime.priority};
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error) {
+            fprintf(stderr, "Real-time: unable to use SCHED_FIFO priority %d: %s\n", realtime.priority, strerror(error));
+        } else {
+            state->applied |= REALTIME_PRIORITY;
+        }
+    }
+}
+
+void leaveRealtime(realtimeState* state) {
+    if (state->applied & REALTIME_PRIORITY) {
+        pthread_setschedparam(pthread_self(), state->policy, &state->param);
+    }
+    if (state->applied & REALTIME_AFFINITY) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &state->cpus);
+    }
+}
+
+// Per-frame telemetry.
+//
+// Every presented frame, from any render loop, leaves one frameRecord in a
+// preallocated single producer, single consumer ring. The render loop only
+// ever writes into the ring and never waits: when the reader falls a whole
+// ring behind, new records are dropped and counted as overruns. Python maps
+// the ring itself as a structured array and reads it while a run goes on.
+//
+// Times are CLOCK_MONOTONIC microseconds.
+#define TELEMETRY_FRAMES 65536 // a power of two
+#define FRAMES_IN_FLIGHT 4
+
+typedef struct {
+    uint64_t frame;      // counts every frame since the module was loaded
+    int64_t submitTime;  // before the frame was drawn
+    int64_t swapTime;    // presentFrame() returned
+    int64_t vblankTime;  // scanout
+    uint32_t sequence;   // vblank counter of the scanout
+    uint32_t dropped;    // vblanks skipped before this frame
+} frameRecord;
+
+typedef struct {
+    frameRecord records[TELEMETRY_FRAMES];
+    atomic_ulong head;          // records written, only the render loop moves it
+    atomic_ulong tail;          // records read, only the reader moves it
+    atomic_ulong overruns;
+    uint64_t frames;
+} telemetryRing;
+
+telemetryRing telemetry;
+
+static void publishFrame(frameRecord* record) {
+    unsigned long head = atomic_load_explicit(&telemetry.head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&telemetry.tail, memory_order_acquire);
+    if (head - tail >= TELEMETRY_FRAMES) {
+        atomic_fetch_add_explicit(&telemetry.overruns, 1, memory_order_relaxed);
+        return;
+    }
+    telemetry.records[head & (TELEMETRY_FRAMES - 1)] = *record;
+    atomic_store_explicit(&telemetry.head, head + 1, memory_order_release);
+}
+
+// Frames between presentFrame() and their flip completing. A render loop
+// calls trackSubmit() for each frame it presents and trackPresents() after,
+// which publishes a record for every frame that has reached the screen.
+//
+// A frame is late when its vblank sequence is more than one past the
+// previous frame's (the first frame is compared with the vblank the clock
+// was synced to), and the gap is the exact number of vblanks missed. They
+// are also added up per tag, if missedPerTag is set.
+typedef struct {
+    unsigned long firstPresent;
+    unsigned long submitted;
+    unsigned long presented;
+    long submitTimes[FRAMES_IN_FLIGHT];
+    long swapTimes[FRAMES_IN_FLIGHT];
+    int tags[FRAMES_IN_FLIGHT];
+    unsigned int lastSequence;
+    int late;
+    long missed;
+    int* missedPerTag;
+} frameTracker;
+
+// Call right after syncVblankClock().
+static void startTracking(frameTracker* tracker, int* missedPerTag) {
+    memset(tracker, 0, sizeof(frameTracker));
+    tracker->firstPresent = frameClock.presentCount;
+    tracker->lastSequence = frameClock.lastSequence;
+    tracker->missedPerTag = missedPerTag;
+}
+
+static void trackSubmit(frameTracker* tracker, long submitTime, long swapTime, int tag) {
+    tracker->submitTimes[tracker->submitted % FRAMES_IN_FLIGHT] = submitTime;
+    tracker->swapTimes[tracker->submitted % FRAMES_IN_FLIGHT] = swapTime;
+    tracker->tags[tracker->submitted % FRAMES_IN_FLIGHT] = tag;
+    tracker->submitted++;
+}
+
+// photonTimes, if not NULL, gets the scanout time of the first capacity frames.
+static void trackPresents(frameTracker* tracker, long* photonTimes, int capacity) {
+    while (tracker->presented < frameClock.presentCount - tracker->firstPresent &&
+           tracker->presented < tracker->submitted) {
+        unsigned long k = tracker->presented % FRAMES_IN_FLIGHT;
+        frameRecord record = {
+            .frame = telemetry.frames++,
+            .submitTime = tracker->submitTimes[k],
+            .swapTime = tracker->swapTimes[k],
+            .vblankTime = frameClock.lastVblank,
+            .sequence = frameClock.lastSequence,
+            .dropped = 0,
+        };
+        unsigned int gap = frameClock.lastSequence - tracker->lastSequence;
+        if (gap > 1 && gap < UINT_MAX / 2) {
+            record.dropped = gap - 1;
+            tracker->late++;
+            tracker->missed += record.dropped;
+            if (tracker->missedPerTag) {
+                tracker->missedPerTag[tracker->tags[k]] += record.dropped;
+            }
+        }
+        tracker->lastSequence = frameClock.lastSequence;
+        publishFrame(&record);
+
+        if (photonTimes && tracker->presented < (unsigned long)capacity) {
+            photonTimes[tracker->presented] = frameClock.lastVblank;
+        }
+        tracker->presented++;
+    }
+}
+
+// One trial of a sequence: shaderPtr for frames frames, then blankFrames
+// frames of background. runSequence() fills in missed. outputShaders gives
+// the stimulus for each output after the first; where it is NULL the
+// output's own shaderPtr is used, and failing that the trial's.
+typedef struct {
+    shader* shaderPtr;
+    int frames;
+    int blankFrames;
+    int missed;     // vblanks missed during the trial
+    shader* outputShaders[MAX_OUTPUTS];
+} sequenceEntry;
+
+int sequenceLength(sequenceEntry* entries, int count) {
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        total += entries[i].frames + entries[i].blankFrames;
+    }
+    return total;
+}
+
+// Stalls so far of every movie in shaders, each counted once.
+static long movieStalls(shader** shaders, int count) {
+    long stalls = 0;
+    for (int i = 0; i < count; i++) {
+        movie* mv = shaders[i] ? shaders[i]->movie : NULL;
+        int seen = 0;
+        for (int j = 0; j < i && mv && !seen; j++) {
+            seen = shaders[j] && shaders[j]->movie == mv;
+        }
+        if (mv && !seen) {
+            stalls += mv->stalls;
+        }
+    }
+    return stalls;
+}
+
+// Show a list of trials without going back to Python. Every program, its
+// uniforms and, in cache mode, its cycle are set up before the first frame,
+// so starting the next trial is only a glUseProgram in the frame that shows
+// it, and its onset is exactly that frame's vblank. Each trial's phase starts
+// from zero at its own onset.
+//
+// The schedule is counted in vblanks. Missed vblanks are handled as set by
+// configPtr->recovery. With RECOVER_ADVANCE the frame in flight when a miss
+// is seen was drawn for its planned vblank, so the schedule catches up from
+// the frame after it.
+//
+// With triggerPin >= 0 the first frame waits for a rising edge on that line.
+// presentTimes, if not NULL, receives the scanout time of every frame shown,
+// 0 for one whose flip never completed,
+// onsetTimes, if not NULL, that of the first frame of every trial (0 for a
+// trial skipped altogether), and stats, if not NULL, the frame statistics.
+// Returns the number of frames shown.
+int runSequence(GLconfig* configPtr, sequenceEntry* entries, int count, int triggerPin,
+                long* presentTimes, long* onsetTimes, frameStats* stats) {
+    int nFrames = sequenceLength(entries, count);
+    frameStats localStats;
+    if (stats == NULL) {
+        stats = &localStats;
+    }
+    memset(stats, 0, sizeof(frameStats));
+    for (int i = 0; i < count; i++) {
+        entries[i].missed = 0;
+    }
+    if (nFrames < 1) {
+        return 0;
+    }
+    long* photonTimes = malloc(nFrames * sizeof(long));
+    // what each trial shows on each output, entry * MAX_OUTPUTS + output
+    shader** shaders = malloc(count * MAX_OUTPUTS * sizeof(shader*));
+    int* phaseLocations = malloc(count * MAX_OUTPUTS * sizeof(int));
+    int* missed = calloc(count, sizeof(int));
+    long* onsetFrames = malloc(count * sizeof(long));
+    cycleCache** caches = calloc(count, sizeof(cycleCache*));
+    if (photonTimes == NULL || shaders == NULL || phaseLocations == NULL || missed == NULL || onsetFrames == NULL || caches == NULL) {
+        fprintf(stderr, "Memory allocation for the sequence failed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++) {
+        onsetFrames[i] = -1;
+        if (configPtr->cacheMode && entries[i].frames > 0) {
+            caches[i] = getCycleCache(entries[i].shaderPtr);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        // a later trial's cycle can push an earlier one out of the budget
+        if (!cacheContains(caches[i])) {
+            caches[i] = NULL;
+        }
+        for (int o = 0; o < outputCount; o++) {
+            shader* s = o > 0 ? entries[i].outputShaders[o] : NULL;
+            if (s == NULL) {
+                s = o > 0 && outputs[o]->shaderPtr ? outputs[o]->shaderPtr : entries[i].shaderPtr;
+            }
+            shaders[i * MAX_OUTPUTS + o] = s;
+            glUseProgram(s->programId);
+            setStimulusUniforms(s, &s->params);
+            phaseLocations[i * MAX_OUTPUTS + o] = glGetUniformLocation(s->programId, "phase");
+            if (s->movie && primeMovie(s->movie) < 0) {
+                fprintf(stderr, "Movie frames that are not loaded in time are shown as stalls\n");
+            }
+        }
+    }
+    glActiveTexture(GL_TEXTURE0);
+    // unused slots are NULL for movieStalls()
+    for (int i = 0; i < count; i++) {
+        for (int o = outputCount; o < MAX_OUTPUTS; o++) {
+            shaders[i * MAX_OUTPUTS + o] = NULL;
+        }
+    }
+    long stallsBefore = movieStalls(shaders, count * MAX_OUTPUTS);
+
+    // Clear whole screen (front buffer)
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    resetDamage();
+
+    realtimeState rt;
+    enterRealtime(&rt);
+
+    long triggerTime = 0;
+    long wakeTime = 0;
+    if (triggerPin >= 0 && waitForTrigger(triggerPin, &triggerTime, &wakeTime) < 0) {
+        fprintf(stderr, "No trigger, starting now\n");
+        triggerTime = 0;
+    }
+
+    syncVblankClock(configPtr->device);
+    frameTracker tracker;
+    startTracking(&tracker, missed);
+    resetSkew();
+
+    // The stimulus clock starts at the vblank the first frame will be shown on.
+    long start_time = predictNextVblank();
+    long entryStart = start_time;
+    int entry = 0;
+    long entryFirstSlot = 0;
+    GLuint currentProgram = 0;
+    long slot = 0; // place in the schedule, in vblanks
+    while (slot < nFrames) {
+        while (slot >= entryFirstSlot + entries[entry].frames + entries[entry].blankFrames) {
+            entryFirstSlot += entries[entry].frames + entries[entry].blankFrames;
+            entry++;
+        }
+        sequenceEntry* e = &entries[entry];
+        long entryFrame = slot - entryFirstSlot;
+        if (onsetFrames[entry] < 0) {
+            // when catching up lands inside a trial, its clock still starts
+            // at the vblank it was scheduled for
+            onsetFrames[entry] = tracker.submitted;
+            entryStart = predictNextVblank() - (long)(entryFrame * frameClock.refreshPeriod + 0.5);
+        }
+        long submitTime = get_time_micros();
+
+        long elapsed = predictNextVblank() - entryStart;
+        // the first output last, so its surface is current again for the present
+        for (int o = outputCount - 1; o >= 0; o--) {
+            if (outputCount > 1) {
+                useOutput(configPtr, o);
+            }
+            struct drm_mode_rect damage;
+            struct drm_mode_rect patch;
+            if (syncPatch.enabled) {
+                syncPatchRect(outputs[o], &patch);
+            }
+            if (entryFrame < e->frames) {
+                shader* s = shaders[entry * MAX_OUTPUTS + o];
+                stimulusDamage(s, outputs[o], &damage);
+                beginDamage(configPtr, o, &damage, syncPatch.enabled ? &patch : NULL);
+                cycleCache* cache = s == e->shaderPtr ? caches[entry] : NULL;
+                float phase = stimulusPhase(configPtr->timebase, cache ? cache->cyclesPerSecond : s->params.cyclesPerSecond, entryFrame, elapsed);
+                GLuint program = cache ? getBlitProgram() : s->programId;
+                if (program != currentProgram) {
+                    glUseProgram(program);
+                    currentProgram = program;
+                }
+                if (cache) {
+                    drawCachedFrame(cache, phase, s->VBOlength);
+                } else {
+                    glUniform1f(phaseLocations[entry * MAX_OUTPUTS + o], phase);
+                    drawStimulus(s, entryFrame);
+                }
+            } else {
+                fullDamage(outputs[o], &damage);
+                beginDamage(configPtr, o, &damage, syncPatch.enabled ? &patch : NULL);
+                glClear(GL_COLOR_BUFFER_BIT);
+            }
+            if (syncPatch.enabled) {
+                drawSyncPatch(outputs[o], tracker.submitted);
+            }
+            endDamage();
+            if (o > 0) {
+                finishOutput(configPtr, o);
+            }
+        }
+        presentFrame(configPtr);
+        trackSubmit(&tracker, submitTime, get_time_micros(), entry);
+        trackPresents(&tracker, photonTimes, nFrames);
+
+        slot++;
+        if (configPtr->recovery == RECOVER_ADVANCE && slot < (long)tracker.submitted + tracker.missed) {
+            slot = tracker.submitted + tracker.missed;
+        }
+    }
+
+    // the last flip is still queued
+    waitForFlip(configPtr->device);
+    trackPresents(&tracker, photonTimes, nFrames);
+    int shown = (int)tracker.submitted;
+    int presented = (int)tracker.presented;
+    // frames whose flip never completed have no scanout time
+    for (int q = presented; q < shown; q++) {
+        photonTimes[q] = 0;
+    }
+    if (presentTimes) {
+        memcpy(presentTimes, photonTimes, shown * sizeof(long));
+    }
+    leaveRealtime(&rt);
+    computeFrameStats(stats, photonTimes, shown);
+    stats->dropped = tracker.late;
+    stats->missed = tracker.missed;
+    stats->realtime = rt.applied;
+    if (!rt.applied && stats->jitter > 0.0) {
+        baselineJitter = stats->jitter;
+    } else if (rt.applied && baselineJitter > 0.0) {
+        printf("Jitter %.1f us, %.1f us without real-time mode\n", stats->jitter, baselineJitter);
+    }
+    stats->baselineJitter = baselineJitter;
+    if (triggerTime && photonTimes[0]) {
+        recordTriggerLatency(photonTimes[0] - triggerTime);
+        printf("Trigger to first frame %ld us, woke after %ld us\n", photonTimes[0] - triggerTime, wakeTime - triggerTime);
+        stats->triggerTime = triggerTime;
+        stats->triggerLatency = photonTimes[0] - triggerTime;
+        stats->wakeLatency = wakeTime - triggerTime;
+    }
+    for (int i = 0; i < count; i++) {
+        entries[i].missed = missed[i];
+        if (onsetTimes) {
+            onsetTimes[i] = onsetFrames[i] >= 0 ? photonTimes[onsetFrames[i]] : 0;
+        }
+    }
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    printf("We did %d frames in %f\n", shown, presented > 1 ? (double)(photonTimes[presented-1] - photonTimes[0])/1000000 : 0.0);
+    if (shown > 1) {
+        printf("Min frame %ld, max frame %ld\n", stats->minInterval, stats->maxInterval);
+    }
+    printf("Number of dropped frames is %i, %i vblanks missed\n", stats->dropped, stats->missed);
+    long stalls = movieStalls(shaders, count * MAX_OUTPUTS) - stallsBefore;
+    if (stalls > 0) {
+        printf("Movie frames not loaded in time: %ld\n", stalls);
+    }
+    for (int o = 1; o < outputCount; o++) {
+        drmConfig* out = outputs[o];
+        if (out->skewCount > 0) {
+            printf("Output %d skew mean %.1f us, max %ld us, %d frames a vblank apart\n",
+                   o, out->skewSum / out->skewCount, out->skewMax, out->slipped);
+        }
+    }
+
+    if (configPtr->currentShaderPtr) {
+        glUseProgram(configPtr->currentShaderPtr->programId);
+    }
+    free(photonTimes);
+    free(shaders);
+    free(phaseLocations);
+    free(missed);
+    free(onsetFrames);
+    free(caches);
+    return shown;
+}
+
+// The loaded shader for DISPLAY_FRAMES frames. presentTimes, if not NULL,
+// receives the scanout timestamp of each frame shown. Returns how many.
+int mainloop(GLconfig* configPtr, int triggerPin, long* presentTimes) {
+    sequenceEntry entry = {configPtr->currentShaderPtr, DISPLAY_FRAMES, 0, 0, {NULL}};
+    return runSequence(configPtr, &entry, 1, triggerPin, presentTimes, NULL, NULL);
+}
+
+// A presentation on its own thread, for callers that must keep working while
+// it plays. The GL context moves to the display thread for the run and is
+// taken back by finishDisplayJob(). eventFd becomes readable when the run is
+// over, and stays readable, so it can be polled or given to an event loop.
+typedef struct {
+    GLconfig* configPtr;
+    sequenceEntry* entries;
+    int count;
+    int triggerPin;
+    long* presentTimes;
+    long* onsetTimes;
+    frameStats stats;
+    int eventFd;
+    atomic_int done;
+    atomic_int joined;  // claimed by whichever thread joins the display thread
+    pthread_t thread;
+} displayJob;
+
+static void* displayJobThread(void* arg) {
+    displayJob* job = arg;
+    GLconfig* configPtr = job->configPtr;
+    eglMakeCurrent(configPtr->display, configPtr->surface, configPtr->surface, configPtr->context);
+    runSequence(configPtr, job->entries, job->count, job->triggerPin, job->presentTimes, job->onsetTimes, &job->stats);
+    eglMakeCurrent(configPtr->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    atomic_store(&job->done, 1);
+    uint64_t one = 1;
+    if (write(job->eventFd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "Unable to signal display completion: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+void freeDisplayJob(displayJob* job);
+
+// Takes ownership of entries, which must be malloced.
+displayJob* startDisplayJob(GLconfig* configPtr, sequenceEntry* entries, int count, int triggerPin) {
+    displayJob* job = calloc(1, sizeof(displayJob));
+    if (job == NULL) {
+        free(entries);
+        return NULL;
+    }
+    int nFrames = sequenceLength(entries, count);
+    job->configPtr = configPtr;
+    job->entries = entries;
+    job->count = count;
+    job->triggerPin = triggerPin;
+    job->presentTimes = malloc((nFrames > 0 ? nFrames : 1) * sizeof(long));
+    job->onsetTimes = malloc((count > 0 ? count : 1) * sizeof(long));
+    job->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    job->joined = 1;
+    if (job->presentTimes == NULL || job->onsetTimes == NULL || job->eventFd < 0) {
+        freeDisplayJob(job);
+        return NULL;
+    }
+
+    // a context can only be current on one thread
+    eglMakeCurrent(configPtr->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (pthread_create(&job->thread, NULL, displayJobThread, job) != 0) {
+        eglMakeCurrent(configPtr->display, configPtr->surface, configPtr->surface, configPtr->context);
+        freeDisplayJob(job);
+        return NULL;
+    }
+    job->joined = 0;
+    return job;
+}
+
+// Wait for the run to end and make the context current on this thread again.
+void finishDisplayJob(displayJob* job) {
+    if (atomic_exchange(&job->joined, 1)) {
+        return;
+    }
+    pthread_join(job->thread, NULL);
+    GLconfig* configPtr = job->configPtr;
+    eglMakeCurrent(configPtr->display, configPtr->surface, configPtr->surface, configPtr->context);
+}
+
+void freeDisplayJob(displayJob* job) {
+    finishDisplayJob(job);
+    if (job->eventFd >= 0) {
+        close(job->eventFd);
+    }
+    free(job->entries);
+    free(job->presentTimes);
+    free(job->onsetTimes);
+    free(job);
+}
+
+// CPU reference renderer.
+//
+// Evaluates exactly the same per-pixel math as the composed sine, square and
+// Gabor (sine carrier, Gaussian envelope) drifting programs, including the
+// smoothstep edge, in single precision, eight pixels at a time with GCC vector
+// extensions. That compiles to NEON on the Pi and SSE on x86, and on x86 an
+// AVX2 clone is picked at load time when the CPU has it. Rows are split into
+// tiles that are shared out between one thread per core.
+//
+// Pixels are evaluated at the same positions the fragment shader sees them
+// (pixel centres in [-1, 1]) and rows go bottom to top, like glReadPixels.
+
+#define CPU_SIN 0
+#define CPU_SQUARE 1
+#define CPU_GABOR 2
+
+#define CPU_LANES 8
+#define CPU_TILE_ROWS 16
+#define CPU_MAX_THREADS 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_KERNEL_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define CPU_KERNEL_TARGETS
+#endif
+
+// Vectors never go through a function call by value: without AVX that has
+// a different ABI and GCC warns about it at the end of the file, where no
+// diagnostic pragma can scope it. The small helpers are macros and the
+// polynomials work in place.
+
+typedef float vfloat __attribute__((vector_size(CPU_LANES * sizeof(float))));
+typedef int32_t vint __attribute__((vector_size(CPU_LANES * sizeof(int32_t))));
+
+typedef struct {
+    int program;        // CPU_SIN, CPU_SQUARE or CPU_GABOR
+    float angle;
+    float spatial;
+    float aspectRatio;
+    float phase;
+    float sigma;        // Gabor envelope
+    float centerX;
+    float centerY;
+} cpuStimulus;
+
+typedef struct {
+    const cpuStimulus* stim;
+    void* pixels;       // float or uint8, width * height
+    int isFloat;
+    int width;
+    int height;
+    int nextTile;
+} cpuRenderJob;
+
+#define CPU_INLINE static inline __attribute__((always_inline))
+
+#define vsplat(x) ((vfloat){(x), (x), (x), (x), (x), (x), (x), (x)})
+
+#define vselect(mask, a, b) ((vfloat)(((mask) & (vint)(a)) | (~(mask) & (vint)(b))))
+
+// Round to nearest for |x| < 2^22.
+#define vround(x) (((x) + 12582912.0f) - 12582912.0f)
+
+// *v = sin(*v)
+CPU_INLINE void vsin(vfloat* v) {
+    vfloat x = *v;
+    // x - k*2pi, with 2pi split in two so the reduction stays accurate
+    vfloat k = vround(x * 0.15915494309189535f);
+    x = x - k * 6.28125f;
+    x = x - k * 1.9353071795864769e-3f;
+
+    // fold [-pi, pi] onto [-pi/2, pi/2]
+    x = vselect(x > 1.5707963267948966f, 3.14159265358979f - x, x);
+    x = vselect(x < -1.5707963267948966f, -3.14159265358979f - x, x);
+
+    vfloat x2 = x * x;
+    vfloat p = vsplat(-2.5052108385441720e-8f);
+    p = p * x2 + 2.7557319223985893e-6f;
+    p = p * x2 - 1.9841269841269841e-4f;
+    p = p * x2 + 8.3333333333333333e-3f;
+    p = p * x2 - 1.6666666666666667e-1f;
+    p = p * x2 + 1.0f;
+    *v = p * x;
+}
+
+// *v = exp(*v) for *v <= 0, which is all the Gaussian envelope needs.
+CPU_INLINE void vexp(vfloat* v) {
+    vfloat x = vselect(*v < -87.0f, vsplat(-87.0f), *v);
+    vfloat n = vround(x * 1.4426950408889634f);
+    vfloat r = x - n * 0.693145751953125f;
+    r = r - n * 1.428606765330187e-6f;
+
+    vfloat p = vsplat(1.3888888888888889e-3f);
+    p = p * r + 8.3333333333333333e-3f;
+    p = p * r + 4.1666666666666667e-2f;
+    p = p * r + 1.6666666666666667e-1f;
+    p = p * r + 0.5f;
+    p = p * r + 1.0f;
+    p = p * r + 1.0f;
+
+    vint bits = (__builtin_convertvector(n, vint) + 127) << 23;
+    *v = p * (vfloat)bits;
+}
+
+// One row of the stimulus as floats. out must have room for width rounded
+// up to a multiple of CPU_LANES.
+CPU_KERNEL_TARGETS
+static void renderRowCpu(const cpuStimulus* stim, int width, int height, int row, float* out) {
+    float cosine = cosf(stim->angle) * stim->spatial;
+    float sine = sinf(stim->angle) * stim->spatial;
+    float y = (2.0f * row + 1.0f) / height - 1.0f;
+    float sineY = sine * y;
+    float dy = (y - stim->centerY) * (y - stim->centerY);
+    float centerX = stim->centerX * stim->aspectRatio;
+    vfloat lane = {0, 1, 2, 3, 4, 5, 6, 7};
+
+    for (int i = 0; i < width; i += CPU_LANES) {
+        vfloat x = (((lane + (float)i) * 2.0f + 1.0f) / (float)width - 1.0f) * stim->aspectRatio;
+        vfloat s = (cosine * x + sineY) + stim->phase;
+        vsin(&s);
+        vfloat m;
+
+        if (stim->program == CPU_SQUARE) {
+            // smoothstep(-0.05, 0.05, s)
+            vfloat t = (s + 0.05f) / 0.1f;
+            t = vselect(t < 0.0f, vsplat(0.0f), t);
+            t = vselect(t > 1.0f, vsplat(1.0f), t);
+            m = t * t * (3.0f - 2.0f * t);
+        } else if (stim->program == CPU_GABOR) {
+            vfloat dx = x - centerX;
+            vfloat gaussian = -(dx * dx + dy) / stim->sigma;
+            vexp(&gaussian);
+            m = gaussian * s * 0.5f + 0.5f;
+        } else {
+            m = s * 0.5f + 0.5f;
+        }
+        memcpy(out + i, &m, sizeof(m));
     }
-    return "Unknown error!";
 }
 
-static const char *glGetErrorStr(GLenum errorCheckValue) {
-    switch (errorCheckValue) {
-        case GL_NO_ERROR:
-            return "The last function succeeded without error.";
-        case GL_INVALID_ENUM:
-            return "An unacceptable value is specified for an enumerated argument. The offending command is ignored and has no other side effect than to set the error flag.";
-        case GL_INVALID_VALUE:
-            return "A numeric argument is out of range. The offending command is ignored and has no other side effect than to set the error flag.";
-        case GL_INVALID_OPERATION:
-            return "The specified operation is not allowed in the current state. The offending command is ignored and has no other side effect than to set the error flag.";
-        case GL_INVALID_FRAMEBUFFER_OPERATION:
-            return "The framebuffer object is not complete. The offending command is ignored and has no other side effect than to set the error flag.";
-        case GL_OUT_OF_MEMORY:
-            return "There is not enough memory left to execute the command. The state of the GL is undefined, except for the state of the error flags, after this error is recorded.";
-        default:
+static void* cpuRenderWorker(void* arg) {
+    cpuRenderJob* job = arg;
+    int paddedWidth = (job->width + CPU_LANES - 1) / CPU_LANES * CPU_LANES;
+    float* row = malloc(paddedWidth * sizeof(float));
+    if (row == NULL) {
+        fprintf(stderr, "Memory allocation for the CPU renderer failed!\n");
+        return NULL;
+    }
+
+    for (;;) {
+        int first = __atomic_fetch_add(&job->nextTile, 1, __ATOMIC_RELAXED) * CPU_TILE_ROWS;
+        if (first >= job->height) {
             break;
+        }
+        int last = first + CPU_TILE_ROWS < job->height ? first + CPU_TILE_ROWS : job->height;
+
+        for (int r = first; r < last; r++) {
+            renderRowCpu(job->stim, job->width, job->height, r, row);
+            if (job->isFloat) {
+                memcpy((float*)job->pixels + (size_t)r * job->width, row, job->width * sizeof(float));
+            } else {
+                // same rounding as a GL unorm8 colour buffer
+                uint8_t* out = (uint8_t*)job->pixels + (size_t)r * job->width;
+                for (int i = 0; i < job->width; i++) {
+                    float v = row[i] * 255.0f + 0.5f;
+                    out[i] = v <= 0.0f ? 0 : v >= 255.0f ? 255 : (uint8_t)v;
+                }
+            }
+        }
     }
-    return "Unknown error!";
+    free(row);
+    return NULL;
 }
 
-void createCircle(GLfloat *vertices) {
-    float aspectRatio = (float)drm.mode.hdisplay / drm.mode.vdisplay;
-    float cx = 0.0;
-    float cy = 0.0;
-    float r = 0.5;
-    float delTheta = PI * 2 / trisPerCirc;
+// Render one frame into pixels (width * height floats, or bytes if isFloat
+// is 0) using every core.
+void renderCpu(const cpuStimulus* stim, void* pixels, int width, int height, int isFloat) {
+    cpuRenderJob job = {
+        .stim = stim,
+        .pixels = pixels,
+        .isFloat = isFloat,
+        .width = width,
+        .height = height,
+        .nextTile = 0,
+    };
 
-    float x = r;
-    float y = 0;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nThreads = cores < 1 ? 1 : cores > CPU_MAX_THREADS ? CPU_MAX_THREADS : (int)cores;
+    pthread_t threads[CPU_MAX_THREADS];
+    int started = 0;
+    for (int t = 1; t < nThreads; t++) {
+        if (pthread_create(&threads[started], NULL, cpuRenderWorker, &job) == 0) {
+            started++;
+        }
+    }
+    cpuRenderWorker(&job);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
 
-    for (int i = 0; i < trisPerCirc; i++) {
-        vertices[i*9+0] = x + cx;
-        vertices[i*9+1] = y*aspectRatio + cy;
-        vertices[i*9+2] = 0.0f;
+// Frame frame of a noise carrier at full contrast times params->contrast,
+// rows bottom first as glReadPixels() gives them, with no envelope or
+// temporal modulation. As floats these are the shader's own values; bytes
+// are rounded to nearest, which the driver's conversion to an 8 bit
+// framebuffer need not be, so they can differ from it by one step.
+void renderNoiseCpu(int carrier, const stimulusParams* params, long frame, void* pixels, int width, int height,
+                    int isFloat) {
+    stimulusType type = {carrier, ENVELOPE_NONE, TEMPORAL_DRIFT, 0};
+    int octaves = noiseOctaves(&type, params);
+    float weights[NOISE_OCTAVES];
+    int keys[NOISE_OCTAVES][2];
+    float blockSizes[NOISE_OCTAVES];
+    noiseWeights(params, octaves, weights);
+    for (int k = 0; k < octaves; k++) {
+        noiseKey(params->seed, noiseFrame(params, frame), k, keys[k]);
+        blockSizes[k] = roundf(params->blockSize) * (float)(1 << k);
+    }
 
-        x = (float)r*cosf(delTheta*(i+1));
-        y = (float)r*sinf(delTheta*(i+1));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float u[NOISE_OCTAVES];
+            for (int k = 0; k < octaves; k++) {
+                int bx = (int)floorf((x + 0.5f) / blockSizes[k]);
+                int by = (int)floorf((y + 0.5f) / blockSizes[k]);
+                u[k] = noiseBlockValue(keys[k], bx, by);
+            }
+            float m = 0.5f + 0.5f * params->contrast * noiseCarrierValue(carrier, params, octaves, weights, u);
+            if (isFloat) {
+                ((float*)pixels)[(size_t)y * width + x] = m;
+            } else {
+                // same rounding as a GL unorm8 colour buffer
+                float v = m * 255.0f + 0.5f;
+                ((uint8_t*)pixels)[(size_t)y * width + x] = v <= 0.0f ? 0 : v >= 255.0f ? 255 : (uint8_t)v;
+            }
+        }
+    }
+}
 
-        vertices[i*9+3] = x + cx;
-        vertices[i*9+4] = y*aspectRatio + cy;
-        vertices[i*9+5] = 0.0f;
+// Parameter channel from Python to the render thread.
+//
+// A triple buffer. The writer fills the slot it owns and swaps it with the
+// shared middle slot in one atomic exchange. Once per frame, just before
+// drawing, the render thread swaps its own slot with the middle one if the
+// fresh bit says something new was published. Neither side ever waits, and
+// the render thread always reads a whole parameter block, the newest one.
+//
+// There must only be one writer at a time. From Python that is guaranteed
+// by the GIL.
+#define CHANNEL_FRESH 4
 
-        vertices[i*9+6] = cx;
-        vertices[i*9+7] = cy;
-        vertices[i*9+8] = 0.0f;
+typedef struct {
+    stimulusParams slots[3];
+    atomic_int middle;      // index of the shared slot, plus CHANNEL_FRESH
+    int writeSlot;          // owned by the writer
+    int readSlot;           // owned by the render thread
+    stimulusParams latest;  // writer's copy of what it last published
+} paramChannel;
+
+void initParamChannel(paramChannel* channel, const stimulusParams* params) {
+    for (int i = 0; i < 3; i++) {
+        channel->slots[i] = *params;
     }
-
-    vertices[(trisPerCirc-1)*9+3] = vertices[0];
-    vertices[(trisPerCirc-1)*9+4] = vertices[1];
-    vertices[(trisPerCirc-1)*9+5] = vertices[2];
+    channel->latest = *params;
+    channel->writeSlot = 0;
+    channel->readSlot = 2;
+    atomic_store(&channel->middle, 1);
 }
 
-void createRect(GLfloat *vertices) {
+void publishParams(paramChannel* channel, const stimulusParams* params) {
+    channel->latest = *params;
+    channel->slots[channel->writeSlot] = *params;
+    int previous = atomic_exchange_explicit(&channel->middle, channel->writeSlot | CHANNEL_FRESH,
+                                            memory_order_acq_rel);
+    channel->writeSlot = previous & 3;
+}
 
-    float top = 1.0;
-    float right = 1.0;
-    float left = -1.0;
-    float bottom = -1.0;
-    float rect[] = {left,  top,    0.0,
-                    right, top,    0.0,
-                    left,  bottom, 0.0,
-                    left,  bottom, 0.0,
-                    right, top,    0.0,
-                    right, bottom, 0.0};
-    
-    memcpy(vertices, rect, sizeof(rect));   
+// Newest published block; *changed is set if it differs from the last call.
+const stimulusParams* consumeParams(paramChannel* channel, int* changed) {
+    *changed = 0;
+    if (atomic_load_explicit(&channel->middle, memory_order_relaxed) & CHANNEL_FRESH) {
+        int previous = atomic_exchange_explicit(&channel->middle, channel->readSlot, memory_order_acq_rel);
+        channel->readSlot = previous & 3;
+        *changed = 1;
+    }
+    return &channel->slots[channel->readSlot];
 }
 
-void createVBO(shader* shaderPtr) {
+// Only used for the start up handshake, never while rendering.
+pthread_cond_t displayStartCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t setupStartCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
+int setupDone = 0;
+int displayStarted = 0;
+GLconfig* globalConfigPtr;
+shader* globalShaderPtr;
+paramChannel globalParams;
 
-    int shape = 0;
+void thread_mainloop() {
+    shader* shaderPtr = globalConfigPtr->currentShaderPtr;
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    GLfloat *vertices;
+    int phaseLocation = glGetUniformLocation(shaderPtr->programId, "phase");
+
+    realtimeState rt;
+    enterRealtime(&rt);
+    syncVblankClock(globalConfigPtr->device);
+    frameTracker tracker;
+    startTracking(&tracker, NULL);
+    long start_time = predictNextVblank();
+
+    // A new drift rate takes over from the current phase rather than
+    // restarting the clock, so the grating does not jump.
+    float cyclesPerSecond = shaderPtr->params.cyclesPerSecond;
+    double baseCycles = 0.0;
+    long baseFrame = 0;
+    long baseTime = start_time;
+    for (int q = 0; q < 1000; q++) {
+        long submitTime = get_time_micros();
+        int changed;
+        const stimulusParams* params = consumeParams(&globalParams, &changed);
+        if (changed) {
+            setStimulusUniforms(shaderPtr, params);
+            if (params->cyclesPerSecond != cyclesPerSecond) {
+                baseCycles += stimulusPhase(globalConfigPtr->timebase, cyclesPerSecond, q - baseFrame,
+                                            predictNextVblank() - baseTime) / (2.0 * M_PI);
+                baseFrame = q;
+                baseTime = predictNextVblank();
+                cyclesPerSecond = params->cyclesPerSecond;
+            }
+        }
 
-    if (shape) {
-        shaderPtr->VBOlength = trisPerCirc * 3 * 3;
-        vertices = (GLfloat *)malloc(shaderPtr->VBOlength * sizeof(GLfloat));
-        createCircle(vertices);
-    } else {
-        shaderPtr->VBOlength = 2 * 3 * 3;
-        vertices = (GLfloat *)malloc(shaderPtr->VBOlength * sizeof(GLfloat));
-        createRect(vertices);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        float phase = stimulusPhase(globalConfigPtr->timebase, cyclesPerSecond, q - baseFrame,
+                                    predictNextVblank() - baseTime);
+        glUniform1f(phaseLocation, wrapPhase(baseCycles + phase / (2.0 * M_PI)));
+        drawStimulus(shaderPtr, q);
+        presentFrame(globalConfigPtr);
+        trackSubmit(&tracker, submitTime, get_time_micros(), 0);
+        trackPresents(&tracker, NULL, 0);
     }
+    waitForFlip(globalConfigPtr->device);
+    trackPresents(&tracker, NULL, 0);
+    leaveRealtime(&rt);
+    printf("We did 240 frames in %f\n", (double)(get_time_micros() - start_time)/1000000);
+}
 
-    if (vertices == NULL) {
-        fprintf(stderr, "Memory allocation for vertices failed!\n");
-        exit(EXIT_FAILURE);
-    }
 
-    glGenBuffers(1, &(shaderPtr->VBOId));
-    glBindBuffer(GL_ARRAY_BUFFER, shaderPtr->VBOId);
-    glBufferData(GL_ARRAY_BUFFER, shaderPtr->VBOlength * sizeof(GLfloat), vertices, GL_STATIC_DRAW);
+void* threadSetup(void* arg) {
+    int* modePtr = (int*) arg;
+    globalConfigPtr = malloc(sizeof(GLconfig));
+    *globalConfigPtr = setup(*modePtr, PRESENT_PAGEFLIP);
 
-    // Specify the layout of the vertex data
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
-    glEnableVertexAttribArray(0);
+    // every parameter stays a uniform so any of them can be changed live
+    stimulusType type = {CARRIER_SQUARE, ENVELOPE_NONE, TEMPORAL_DRIFT, PARAM_ALL};
+    stimulusParams params = defaultParams();
+    params.cyclesPerSecond = 3.5;
+    globalShaderPtr = malloc(sizeof(shader));
+    *globalShaderPtr = buildStimulus(type, params);
+    initParamChannel(&globalParams, &params);
 
-    free(vertices);
+    loadShader(globalConfigPtr, globalShaderPtr);
 
-    GLenum ErrorCheckValue = glGetError();
-    if (ErrorCheckValue != GL_NO_ERROR) {
-        fprintf(stderr, "ERROR: Could not create a VBO\n");
-        exit(EXIT_FAILURE);
+    //setup done signal to main thread, then wait until display is ready.
+    pthread_mutex_lock(&globalLock);
+    setupDone = 1;
+    pthread_cond_signal(&setupStartCond);
+    while (!displayStarted) {
+        pthread_cond_wait(&displayStartCond, &globalLock);
     }
+    pthread_mutex_unlock(&globalLock);
+    thread_mainloop();
+
+    return NULL;
+
 }
 
-void destroyVBO(shader* shaderPtr) {
-    GLenum errorCheckValue = glGetError();
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(0);
+void thread_update(float angle) {
+    stimulusParams params = globalParams.latest;
+    params.angle = angle;
+    publishParams(&globalParams, &params);
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    glDeleteBuffers(1, &(shaderPtr->VBOId));
 
-    errorCheckValue = glGetError();
-    if (errorCheckValue != GL_NO_ERROR) {
-        fprintf(stderr, "ERROR: Could not destroy the VBO.\n");
-        exit(EXIT_FAILURE);
+#ifndef RPG_NO_PYTHON
+
+// The render loop runs with the GIL released, so other Python threads carry
+// on while it plays. They must not use the GL context meanwhile, and after
+// display_async() the context has to be taken back from the display thread.
+static int displayBusy = 0;
+static displayJob* pendingJob = NULL;
+
+// Join job with the GIL released. It stops being pending before the GIL goes,
+// and the display stays busy for other threads until the context is current
+// on this one again.
+static void waitForDisplayJob(displayJob* job) {
+    if (job == pendingJob) {
+        pendingJob = NULL;
     }
+    displayBusy++;
+    Py_BEGIN_ALLOW_THREADS
+    finishDisplayJob(job);
+    Py_END_ALLOW_THREADS
+    displayBusy--;
 }
 
-void createShaders(shader* shaderPtr, const char* fragSource) {
+static int claimContext() {
+    if (displayBusy || (pendingJob && !atomic_load(&pendingJob->done))) {
+        PyErr_SetString(PyExc_RuntimeError, "A display is still running");
+        return -1;
+    }
+    if (pendingJob) {
+        finishDisplayJob(pendingJob);
+        pendingJob = NULL;
+    }
+    return 0;
+}
 
-    GLenum errorCheckValue = glGetError();
-    GLint compile_ok = GL_FALSE;
+static PyObject* py_showModes(PyObject *self, PyObject *args) {
+    int device = open("/dev/dri/card1", O_RDWR | O_CLOEXEC);
+    drmModeRes *resources = drmModeGetResources(device);
+    if (resources == NULL)  {
+        fprintf(stderr, "Unable to get DRM resources\n");
+        return NULL;
+    }
 
-    shaderPtr->programId = glCreateProgram();
+    drmModeConnector *connector = getConnector(resources, device);
+    if (connector == NULL)  {
+        fprintf(stderr, "Unable to get connector\n");
+        drmModeFreeResources(resources);
+        return NULL;
+    }
 
-    shaderPtr->vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(shaderPtr->vertexShaderId, 1, &vertexShaderSource, NULL);
-    glCompileShader(shaderPtr->vertexShaderId);
+    for (int i = 0; i< connector->count_modes; i++) {
+        printf("Details for mode %i. Horizontal Resolution: %u. Vertical Resolution: %u. Refresh Rate: %u, Clock Speed: %u\n",
+        i, connector->modes[i].hdisplay, connector->modes[i].vdisplay,connector->modes[i].vrefresh, connector->modes[i].clock);
+    }
+    close(device);
+    Py_RETURN_NONE;
+}
 
-    glGetShaderiv(shaderPtr->vertexShaderId, GL_COMPILE_STATUS, &compile_ok);
-    if(!compile_ok) {
-        GLchar infoLog[512];
-        glGetShaderInfoLog(shaderPtr->vertexShaderId, 512, NULL, infoLog);
-        fprintf(stderr, "Vertex shader compilation failed: %s\n", infoLog);
-        exit(EXIT_FAILURE);
+static const char* connectorTypeNames[] = {
+    "Unknown", "VGA", "DVI-I", "DVI-D", "DVI-A", "Composite", "SVIDEO", "LVDS", "Component",
+    "DIN", "DP", "HDMI-A", "HDMI-B", "TV", "eDP", "Virtual", "DSI", "DPI", "Writeback", "SPI", "USB",
+};
+
+// Every connector on the card, for add_output(): a list of dicts with its
+// id, name as in /sys/class/drm, whether something is plugged in and its
+// modes as (width, height, refresh).
+static PyObject* py_listOutputs(PyObject *self, PyObject *args) {
+    int device = open("/dev/dri/card1", O_RDWR | O_CLOEXEC);
+    drmModeRes *resources = drmModeGetResources(device);
+    if (resources == NULL)  {
+        if (device >= 0) {
+            close(device);
+        }
+        PyErr_SetString(PyExc_OSError, "Unable to get DRM resources");
+        return NULL;
     }
 
-    shaderPtr->fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(shaderPtr->fragmentShaderId,1, &fragSource, NULL);
-    glCompileShader(shaderPtr->fragmentShaderId);
+    PyObject* list = PyList_New(0);
+    for (int i = 0; i < resources->count_connectors; i++) {
+        drmModeConnector *connector = drmModeGetConnector(device, resources->connectors[i]);
+        if (connector == NULL) {
+            continue;
+        }
+        char name[64];
+        int typeCount = sizeof(connectorTypeNames) / sizeof(connectorTypeNames[0]);
+        snprintf(name, sizeof(name), "%s-%u",
+                 connector->connector_type < (uint32_t)typeCount ? connectorTypeNames[connector->connector_type] : "Unknown",
+                 connector->connector_type_id);
+        PyObject* modes = PyList_New(connector->count_modes);
+        for (int m = 0; m < connector->count_modes; m++) {
+            PyList_SET_ITEM(modes, m, Py_BuildValue("(iii)", connector->modes[m].hdisplay,
+                                                    connector->modes[m].vdisplay, connector->modes[m].vrefresh));
+        }
+        PyObject* item = Py_BuildValue("{s:I,s:s,s:O,s:N}", "connector", connector->connector_id, "name", name,
+                                       "connected", connector->connection == DRM_MODE_CONNECTED ? Py_True : Py_False,
+                                       "modes", modes);
+        PyList_Append(list, item);
+        Py_DECREF(item);
+        drmModeFreeConnector(connector);
+    }
+    drmModeFreeResources(resources);
+    close(device);
+    return list;
+}
 
-    glGetShaderiv(shaderPtr->fragmentShaderId, GL_COMPILE_STATUS, &compile_ok);
-    if(!compile_ok) {
-        GLchar infoLog[512];
-        glGetShaderInfoLog(shaderPtr->fragmentShaderId, 512, NULL, infoLog);
-        fprintf(stderr, "Fragment shader compilation failed: %s\n", infoLog);
-        exit(EXIT_FAILURE);
+static PyObject* py_setup(PyObject *self, PyObject *args) {
+
+    int mode;
+    int presentMode = PRESENT_PAGEFLIP;
+    int width = offscreenMode.hdisplay;
+    int height = offscreenMode.vdisplay;
+    if (!PyArg_ParseTuple(args, "i|iii", &mode, &presentMode, &width, &height)) {
+         return NULL;
+    }  
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    if (presentMode == PRESENT_OFFSCREEN) {
+        setOffscreenMode(width, height, 60);
     }
 
-    errorCheckValue = glGetError();
-    if (errorCheckValue != GL_NO_ERROR) {
-         fprintf(stderr, "ERROR: Could not create the at the end of shaders %s.\n", glGetErrorStr(errorCheckValue));
+    GLconfig* configPtr = malloc(sizeof(GLconfig));
+    *configPtr = setup(mode, presentMode);
+
+    PyObject* config_capsule = PyCapsule_New(configPtr, "config", NULL);
+    Py_INCREF(config_capsule);
+    return config_capsule;
+}
+
+static PyObject* py_buildShader(PyObject *self, PyObject *args) {
+
+    float angle;
+    float spatial;
+    float cyclesPerSecond;
+    if (!PyArg_ParseTuple(args, "fff", &angle, &spatial, &cyclesPerSecond)) {
+         return NULL;
+    }
+    if (claimContext() < 0) {
+        return NULL;
     }
+
+    shader* shaderPtr = malloc(sizeof(shader));
+    *shaderPtr = buildShaders(angle, spatial, cyclesPerSecond);
+    
+    PyObject* shader_capsule = PyCapsule_New(shaderPtr, "shader", NULL);
+    Py_INCREF(shader_capsule);
+    return shader_capsule;
 }
 
-void destroyShaders(shader* shaderPtr) {
-    GLenum errorCheckValue = glGetError();
-    glUseProgram(0);
+static PyObject* py_buildStimulus(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"carrier", "envelope", "temporal", "angle", "spatial", "cycles_per_second",
+                             "contrast", "angle2", "center_x", "center_y", "sigma", "radius",
+                             "inner_radius", "uniforms", "seed", "block_size", "spectrum", "density",
+                             "frames_per_update", "lut", NULL};
+    stimulusType type = {CARRIER_SINE, ENVELOPE_NONE, TEMPORAL_DRIFT, 0};
+    stimulusParams params = defaultParams();
+    params.angle2 = NAN;
+    int lut = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iiiffffffffffiIfffip", kwlist,
+                                     &type.carrier, &type.envelope, &type.temporal,
+                                     &params.angle, &params.spatial, &params.cyclesPerSecond,
+                                     &params.contrast, &params.angle2, &params.centerX, &params.centerY,
+                                     &params.sigma, &params.radius, &params.innerRadius, &type.uniforms,
+                                     &params.seed, &params.blockSize, &params.spectrum, &params.density,
+                                     &params.framesPerUpdate, &lut)) {
+        return NULL;
+    }
+    if (isNoiseCarrier(type.carrier) && (params.blockSize < 1.0f || params.framesPerUpdate < 1)) {
+        PyErr_SetString(PyExc_ValueError, "block_size and frames_per_update must be at least 1");
+        return NULL;
+    }
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    if (isnan(params.angle2)) {
+        // plaids default to a right angle between the components
+        params.angle2 = params.angle + M_PI / 2;
+    }
+
+    shader* shaderPtr = malloc(sizeof(shader));
+    *shaderPtr = lut ? buildLutStimulus(type, params) : buildStimulus(type, params);
+
+    PyObject* shader_capsule = PyCapsule_New(shaderPtr, "shader", NULL);
+    Py_INCREF(shader_capsule);
+    return shader_capsule;
+}
 
-    glDetachShader(shaderPtr->programId, shaderPtr->vertexShaderId);
-    glDetachShader(shaderPtr->programId, shaderPtr->fragmentShaderId);
+// A batched patch set, drawn blank until set_patches(). Takes the carrier,
+// envelope and temporal modulation of build_stimulus(); angle2 and
+// inner_radius, relative to angle and radius, set the plaid angle and the
+// annulus hole for every patch.
+static PyObject* py_buildPatches(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"carrier", "envelope", "temporal", "cycles_per_second", "angle2", "radius",
+                             "inner_radius", NULL};
+    stimulusType type = {CARRIER_SINE, ENVELOPE_GAUSSIAN, TEMPORAL_DRIFT, 0};
+    stimulusParams params = defaultParams();
+    params.angle = 0.0f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iiiffff", kwlist, &type.carrier, &type.envelope,
+                                     &type.temporal, &params.cyclesPerSecond, &params.angle2,
+                                     &params.radius, &params.innerRadius)) {
+        return NULL;
+    }
+    if (isNoiseCarrier(type.carrier)) {
+        PyErr_SetString(PyExc_ValueError, "patches cannot have a noise carrier");
+        return NULL;
+    }
+    if (claimContext() < 0) {
+        return NULL;
+    }
 
-    glDeleteShader(shaderPtr->fragmentShaderId);
-    glDeleteShader(shaderPtr->vertexShaderId);
+    shader* shaderPtr = malloc(sizeof(shader));
+    *shaderPtr = buildPatches(type, params);
 
-    glDeleteProgram(shaderPtr->programId);
+    PyObject* shader_capsule = PyCapsule_New(shaderPtr, "shader", NULL);
+    Py_INCREF(shader_capsule);
+    return shader_capsule;
+}
 
-    errorCheckValue = glGetError();
-    if (errorCheckValue != GL_NO_ERROR) {
-        fprintf(stderr, "ERROR: Could not destroy %s.\n", glGetErrorStr(errorCheckValue));
-        exit(EXIT_FAILURE);
+// patches is a C-contiguous float32 array of (count, 7) or (frames, count,
+// 7), or a list of (x, y, size, angle, spatial, contrast, phase) for a single
+// frame.
+static PyObject* py_setPatches(PyObject* self, PyObject* args) {
+    PyObject* shader_capsule;
+    PyObject* patches;
+    if (!PyArg_ParseTuple(args, "OO", &shader_capsule, &patches)) {
+        return NULL;
+    }
+    shader* shaderPtr = PyCapsule_GetPointer(shader_capsule, "shader");
+    if (shaderPtr == NULL || claimContext() < 0) {
+        return NULL;
+    }
+    if (shaderPtr->patches == NULL) {
+        PyErr_SetString(PyExc_ValueError, "not a patch set, see build_patches()");
+        return NULL;
     }
-}
 
+    if (PyObject_CheckBuffer(patches)) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(patches, &view, PyBUF_CONTIG_RO | PyBUF_FORMAT) != 0) {
+            return NULL;
+        }
+        if (strcmp(view.format, "f") != 0 || view.ndim < 2 || view.ndim > 3 ||
+            view.shape[view.ndim - 1] != PATCH_FLOATS) {
+            PyBuffer_Release(&view);
+            PyErr_SetString(PyExc_ValueError, "patches must be a C-contiguous float32 array of (count, 7) or (frames, count, 7)");
+            return NULL;
+        }
+        int frames = view.ndim == 3 ? (int)view.shape[0] : 1;
+        setPatches(shaderPtr, view.buf, (int)view.shape[view.ndim - 2], frames);
+        PyBuffer_Release(&view);
+        Py_RETURN_NONE;
+    }
 
-void updateShader(shader* shaderPtr, const char* uniformName, float uniformValue) {
-    int location  = glGetUniformLocation(shaderPtr->programId, uniformName);
-    if (location == -1) {
-        printf("Uniform '%s' not found or optimized out.\n", uniformName);
-        exit(EXIT_FAILURE);
+    PyObject* seq = PySequence_Fast(patches, "patches must be an array or a list of patches");
+    if (seq == NULL) {
+        return NULL;
+    }
+    int count = (int)PySequence_Fast_GET_SIZE(seq);
+    float* values = malloc((count > 0 ? count : 1) * PATCH_FLOATS * sizeof(float));
+    for (int i = 0; i < count; i++) {
+        float* p = values + i * PATCH_FLOATS;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "fffffff;a patch is (x, y, size, angle, spatial, contrast, phase)",
+                              &p[0], &p[1], &p[2], &p[3], &p[4], &p[5], &p[6])) {
+            free(values);
+            Py_DECREF(seq);
+            return NULL;
+        }
     }
-    glUniform1f(location, uniformValue);
+    Py_DECREF(seq);
+    setPatches(shaderPtr, values, count, 1);
+    free(values);
+    Py_RETURN_NONE;
 }
 
-shader buildShaders(float angle, float spatial, float cyclesPerSecond) {
-    shader myShader;
+static PyObject* py_loadMovie(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    const char* path;
+    if (!PyArg_ParseTuple(args, "Os", &config_capsule, &path)) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL || claimContext() < 0) {
+        return NULL;
+    }
 
-    //createShaders(&myShader, sinFragSource);
-    //createShaders(gaborFragSource, &myShader);
-    createShaders(&myShader, squareFragSource);
-    createVBO(&myShader);
+    shader* shaderPtr = malloc(sizeof(shader));
+    if (buildMovie(configPtr, path, shaderPtr) < 0) {
+        free(shaderPtr);
+        PyErr_Format(PyExc_OSError, "unable to play %s as a movie", path);
+        return NULL;
+    }
+    glUseProgram(configPtr->currentShaderPtr ? configPtr->currentShaderPtr->programId : 0);
 
-    myShader.angle = angle;
-    myShader.spatial = spatial;
-    myShader.cyclesPerSecond = cyclesPerSecond;
-    myShader.aspectRatio = (float)drm.mode.hdisplay / drm.mode.vdisplay;
+    PyObject* shader_capsule = PyCapsule_New(shaderPtr, "shader", NULL);
+    Py_INCREF(shader_capsule);
+    return shader_capsule;
+}
 
-    glAttachShader(myShader.programId, myShader.vertexShaderId);
-    glAttachShader(myShader.programId, myShader.fragmentShaderId);
-    glLinkProgram(myShader.programId);
-    GLenum errorCheckValue = glGetError();
-    if (errorCheckValue != GL_NO_ERROR) {
-        fprintf(stderr, "ERROR: Could not attach shaders %s.\n", glGetErrorStr(errorCheckValue));
+static PyObject* py_movieStats(PyObject* self, PyObject* args) {
+    PyObject* shader_capsule;
+    if (!PyArg_ParseTuple(args, "O", &shader_capsule)) {
+        return NULL;
     }
-    return myShader;
+    shader* shaderPtr = PyCapsule_GetPointer(shader_capsule, "shader");
+    if (shaderPtr == NULL) {
+        return NULL;
+    }
+    movie* mv = shaderPtr->movie;
+    if (mv == NULL) {
+        PyErr_SetString(PyExc_ValueError, "not a movie, see load_movie()");
+        return NULL;
+    }
+    return Py_BuildValue("{s:I,s:I,s:I,s:I,s:d,s:l,s:l,s:l}", "width", mv->header.width, "height",
+                         mv->header.height, "channels", mv->header.channels, "frames", mv->header.frames,
+                         "frame_rate", (double)mv->header.frameRate, "shown", atomic_load(&mv->wanted),
+                         "loaded", atomic_load(&mv->loaded), "stalls", mv->stalls);
 }
 
-void loadShader(GLconfig* configPtr, shader* shaderPtr) {
-
-    glUseProgram(shaderPtr->programId);
-
-    updateShader(shaderPtr, "angle", shaderPtr->angle);
-    updateShader(shaderPtr, "spatial", shaderPtr->spatial);
-    updateShader(shaderPtr, "aspectRatio", shaderPtr->aspectRatio);
-    updateShader(shaderPtr, "cyclesPerSecond", shaderPtr->cyclesPerSecond);
-
-    GLenum errorCheckValue = glGetError();
-    if (errorCheckValue != GL_NO_ERROR) {
-        fprintf(stderr, "ERROR: Could not use shader program %s.\n", glGetErrorStr(errorCheckValue));
+// Get a C-contiguous uint8 or float32 (height, width) or (height, width,
+// channels) buffer, and the GL type of its pixels.
+static int getImageBuffer(PyObject* pixels, Py_buffer* view, int* channels, GLenum* type) {
+    if (PyObject_GetBuffer(pixels, view, PyBUF_CONTIG_RO | PyBUF_FORMAT) != 0) {
+        return -1;
     }
-    configPtr->currentShaderPtr = shaderPtr;
+    *channels = view->ndim == 3 ? (int)view->shape[2] : 1;
+    *type = strcmp(view->format, "B") == 0 ? GL_UNSIGNED_BYTE : strcmp(view->format, "f") == 0 ? GL_FLOAT : 0;
+    if (*type == 0 || view->ndim < 2 || view->ndim > 3 || imageFormat(*channels) == 0) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "pixels must be a C-contiguous uint8 or float32 array of (height, width) or (height, width, 3 or 4)");
+        return -1;
+    }
+    if (*type == GL_FLOAT && !floatPixelsSupported()) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "float32 pixels need GL_OES_texture_float, which this GPU lacks; use uint8");
+        return -1;
+    }
+    return 0;
 }
 
-int getDeviceDisplay(GLconfig* configPtr, int mode) {
-    // You can try chaning this to "card0" if "card1" does not work.
-    configPtr->device = open("/dev/dri/card1", O_RDWR | O_CLOEXEC);
-    if (getDisplay(&(configPtr->display), configPtr->device, mode) != 0)  {
-        fprintf(stderr, "Unable to get EGL display\n");
-        close(configPtr->device);
-        return EXIT_FAILURE;
+// The pixels are handed to GL from the exporter's own memory.
+static PyObject* py_buildImage(PyObject* self, PyObject* args) {
+    PyObject* pixels;
+    if (!PyArg_ParseTuple(args, "O", &pixels)) {
+        return NULL;
+    }
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    Py_buffer view;
+    int channels;
+    GLenum type;
+    if (getImageBuffer(pixels, &view, &channels, &type) < 0) {
+        return NULL;
     }
-    return 1;
-} 
 
-int EGLinit(GLconfig* configPtr) {
-    int major, minor;
-    if (eglInitialize(configPtr->display, &major, &minor) && eglBindAPI(EGL_OPENGL_API)) {
-        printf("Initialized EGL version: %d.%d\n", major, minor);            
-        return 1;
+    shader* shaderPtr = malloc(sizeof(shader));
+    int result = buildImage((int)view.shape[1], (int)view.shape[0], channels, type, view.buf, shaderPtr);
+    PyBuffer_Release(&view);
+    if (result < 0) {
+        free(shaderPtr);
+        PyErr_SetString(PyExc_ValueError, "unable to show the image");
+        return NULL;
     }
 
-    fprintf(stderr, "Failed to get EGL version! Error: %s\n",  eglGetErrorStr());
-    eglTerminate(configPtr->display);
-    gbmClean(configPtr->device);
-    return EXIT_FAILURE;
-    
+    PyObject* shader_capsule = PyCapsule_New(shaderPtr, "shader", NULL);
+    Py_INCREF(shader_capsule);
+    return shader_capsule;
 }
 
-int EGLGetConfig(EGLConfig **configs, int *configIndex, GLconfig* configPtr) {
-    EGLint count, numConfigs;
-    eglGetConfigs(configPtr->display, NULL, 0, &count);
-    *configs = malloc(count * sizeof(EGLConfig));
-    if (!eglChooseConfig(configPtr->display, configAttribs, *configs, count, &numConfigs))  {
-        fprintf(stderr, "Failed to get EGL configs! Error: %s\n", eglGetErrorStr());
-        eglTerminate(configPtr->display);
-        gbmClean(configPtr->device);
-        return EXIT_FAILURE;
+static PyObject* py_updateImage(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"shader", "pixels", "x", "y", NULL};
+    PyObject* shader_capsule;
+    PyObject* pixels;
+    int x = 0;
+    int y = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|ii", kwlist, &shader_capsule, &pixels, &x, &y)) {
+        return NULL;
+    }
+    shader* shaderPtr = PyCapsule_GetPointer(shader_capsule, "shader");
+    if (shaderPtr == NULL || claimContext() < 0) {
+        return NULL;
+    }
+    if (shaderPtr->image == NULL) {
+        PyErr_SetString(PyExc_ValueError, "not an image, see build_image()");
+        return NULL;
+    }
+    Py_buffer view;
+    int channels;
+    GLenum type;
+    if (getImageBuffer(pixels, &view, &channels, &type) < 0) {
+        return NULL;
+    }
+    if (channels != shaderPtr->image->channels) {
+        PyBuffer_Release(&view);
+        PyErr_Format(PyExc_ValueError, "the image has %d channels, not %d", shaderPtr->image->channels, channels);
+        return NULL;
     }
+    int result = updateImage(shaderPtr, x, y, (int)view.shape[1], (int)view.shape[0], type, view.buf);
+    PyBuffer_Release(&view);
+    if (result == -1) {
+        PyErr_SetString(PyExc_ValueError, "the region does not fit in the image");
+        return NULL;
+    }
+    if (result < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "GL did not take the pixels");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
 
-    // I am not exactly sure why the EGL config must match the GBM format.
-    // But it works!
+static PyObject* py_loadShader(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    PyObject* shader_capsule;
 
-    
-    *configIndex = matchConfigToVisual(configPtr->display, GBM_FORMAT_XRGB8888, *configs, numConfigs);
-    if (configIndex < 0)  {
-        fprintf(stderr, "Failed to find matching EGL config! Error: %s\n",  eglGetErrorStr());
-        eglTerminate(configPtr->display);
-        gbm_surface_destroy(drm.gbmSurface);
-        gbm_device_destroy(drm.gbmDevice);
-        free(configs);
-        return EXIT_FAILURE;
+    if (!PyArg_ParseTuple(args, "OO", &config_capsule, &shader_capsule)) {
+        return NULL;
     }
-
-    return EXIT_SUCCESS;
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    shader* shaderPtr = PyCapsule_GetPointer(shader_capsule, "shader");
+    loadShader(configPtr, shaderPtr);
+    Py_RETURN_NONE;
 }
 
-int EGLGetContext(EGLConfig config, GLconfig* configPtr) {
-    
-    configPtr->context = eglCreateContext(configPtr->display, config, EGL_NO_CONTEXT, contextAttribs);
-    if (configPtr->context == EGL_NO_CONTEXT)  {
-        fprintf(stderr, "Failed to create EGL context! Error: %s\n",  eglGetErrorStr());
-        eglTerminate(configPtr->display);
-        gbmClean(configPtr->device);
-        return EXIT_FAILURE;
+// Seconds, NaN for a frame that never reached the screen.
+static PyObject* timesToList(long* times, int count) {
+    PyObject* list = PyList_New(count);
+    for (int i = 0; i < count; i++) {
+        PyList_SET_ITEM(list, i, PyFloat_FromDouble(times[i] ? (double)times[i] / 1000000 : NAN));
     }
-    return EXIT_SUCCESS;
+    return list;
 }
 
-int EGLGetSurface(EGLConfig config, GLconfig* configPtr) {
-    configPtr->surface = eglCreateWindowSurface(configPtr->display, config, drm.gbmSurface, NULL);
-    if (configPtr->surface == EGL_NO_SURFACE)  {
-        fprintf(stderr, "Failed to create EGL surface! Error: %s\n",  eglGetErrorStr());
-        eglDestroyContext(configPtr->display, configPtr->context);
-        eglTerminate(configPtr->display);
-        gbmClean(configPtr->device);
-        return EXIT_FAILURE;
+static PyObject* py_display(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    int triggerPin = -1;
+    if (!PyArg_ParseTuple(args, "O|i", &config_capsule, &triggerPin)) {
+        return NULL;
     }
-    return EXIT_SUCCESS;
-
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule,"config");
+    long presentTimes[DISPLAY_FRAMES];
+    int shown;
+    displayBusy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    shown = mainloop(configPtr, triggerPin, presentTimes);
+    Py_END_ALLOW_THREADS
+    displayBusy = 0;
+
+    // Scanout time of every frame, CLOCK_MONOTONIC seconds
+    return timesToList(presentTimes, shown);
 }
 
-void EGLcleanup(GLconfig* configPtr) {
-    eglDestroyContext(configPtr->display, configPtr->context);
-    eglDestroySurface(configPtr->display, configPtr->surface);
-    eglTerminate(configPtr->display);
-    gbmClean(configPtr->device);
+// A trial's shader, or a sequence of them with one for each output (None
+// for the output's default). Returns 0, or -1 with an exception set.
+static int parseEntryShaders(PyObject* obj, sequenceEntry* e) {
+    memset(e->outputShaders, 0, sizeof(e->outputShaders));
+    if (PyCapsule_CheckExact(obj)) {
+        e->shaderPtr = PyCapsule_GetPointer(obj, "shader");
+        return e->shaderPtr ? 0 : -1;
+    }
+    PyObject* seq = PySequence_Fast(obj, "a trial needs a shader or one shader for each output");
+    if (seq == NULL) {
+        return -1;
+    }
+    int n = (int)PySequence_Fast_GET_SIZE(seq);
+    if (n < 1 || n > outputCount) {
+        PyErr_Format(PyExc_ValueError, "a trial needs between 1 and %d shaders", outputCount);
+        Py_DECREF(seq);
+        return -1;
+    }
+    e->shaderPtr = PyCapsule_GetPointer(PySequence_Fast_GET_ITEM(seq, 0), "shader");
+    for (int o = 1; o < n && e->shaderPtr; o++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, o);
+        if (item != Py_None && (e->outputShaders[o] = PyCapsule_GetPointer(item, "shader")) == NULL) {
+            e->shaderPtr = NULL;
+        }
+    }
+    Py_DECREF(seq);
+    return e->shaderPtr ? 0 : -1;
 }
 
-int checkViewport(GLconfig* configPtr) {
-    int desiredWidth = drm.mode.hdisplay;
-    int desiredHeight = drm.mode.vdisplay;
-
-    // Set GL Viewport size, always needed!
-    glViewport(0, 0, desiredWidth, desiredHeight);
-
-    // Get GL Viewport size and test if it is correct.
-    GLint viewport[4];
-    glGetIntegerv(GL_VIEWPORT, viewport);
-
-    // viewport[2] and viewport[3] are viewport width and height respectively
-    printf("GL Viewport size: %dx%d\n", viewport[2], viewport[3]);
+// entries is a list of (shader, frames, blank_frames), where shader can also
+// be a tuple with one for each output. Returns the number of entries, or -1
+// with an exception set.
+static int parseSequence(PyObject* list, sequenceEntry** entriesPtr) {
+    PyObject* seq = PySequence_Fast(list, "entries must be a sequence of (shader, frames, blank_frames)");
+    if (seq == NULL) {
+        return -1;
+    }
+    int count = (int)PySequence_Fast_GET_SIZE(seq);
+    sequenceEntry* entries = malloc((count > 0 ? count : 1) * sizeof(sequenceEntry));
+    for (int i = 0; i < count; i++) {
+        PyObject* shader_capsule;
+        sequenceEntry* e = &entries[i];
+        e->blankFrames = 0;
+        e->missed = 0;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "Oi|i;entries must be (shader, frames, blank_frames)",
+                              &shader_capsule, &e->frames, &e->blankFrames) ||
+            parseEntryShaders(shader_capsule, e) < 0) {
+            free(entries);
+            Py_DECREF(seq);
+            return -1;
+        }
+        if (e->frames < 0 || e->blankFrames < 0) {
+            PyErr_SetString(PyExc_ValueError, "frame counts must not be negative");
+            free(entries);
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+    *entriesPtr = entries;
+    return count;
+}
 
-    if (viewport[2] != desiredWidth || viewport[3] != desiredHeight)   {
-        fprintf(stderr, "Error! The glViewport returned incorrect values! Something is wrong!\n");
-        EGLcleanup(configPtr);
-        return EXIT_FAILURE;
+static PyObject* missedToList(sequenceEntry* entries, int count) {
+    PyObject* list = PyList_New(count);
+    for (int i = 0; i < count; i++) {
+        PyList_SET_ITEM(list, i, PyLong_FromLong(entries[i].missed));
     }
-    return EXIT_SUCCESS;
+    return list;
 }
 
-GLconfig setup(int mode) {
-    
+// entries is a list of (shader, frames, blank_frames). Returns the scanout
+// time of every frame shown, the onset time of every trial, in seconds, and
+// the vblanks missed in every trial.
+static PyObject* py_displaySequence(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    PyObject* list;
+    int triggerPin = -1;
+    if (!PyArg_ParseTuple(args, "OO|i", &config_capsule, &list, &triggerPin)) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL || claimContext() < 0) {
+        return NULL;
+    }
+    sequenceEntry* entries;
+    int count = parseSequence(list, &entries);
+    if (count < 0) {
+        return NULL;
+    }
 
-    wiringPiSetupGpio();
-    pinMode(25, INPUT);
+    int nFrames = sequenceLength(entries, count);
+    long* presentTimes = malloc((nFrames > 0 ? nFrames : 1) * sizeof(long));
+    long* onsetTimes = malloc((count > 0 ? count : 1) * sizeof(long));
+    int shown;
+    displayBusy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    shown = runSequence(configPtr, entries, count, triggerPin, presentTimes, onsetTimes, NULL);
+    Py_END_ALLOW_THREADS
+    displayBusy = 0;
+
+    PyObject* times = timesToList(presentTimes, shown);
+    PyObject* onsets = timesToList(onsetTimes, nFrames > 0 ? count : 0);
+    PyObject* missed = missedToList(entries, nFrames > 0 ? count : 0);
+    free(entries);
+    free(presentTimes);
+    free(onsetTimes);
+    return Py_BuildValue("(NNN)", times, onsets, missed);
+}
 
-    drm.previousBo=NULL;
+static void displayJobDestructor(PyObject* job_capsule) {
+    displayJob* job = PyCapsule_GetPointer(job_capsule, "display_job");
+    waitForDisplayJob(job);
+    freeDisplayJob(job);
+    Py_XDECREF((PyObject*)PyCapsule_GetContext(job_capsule));
+}
 
-    GLconfig config;
-    getDeviceDisplay(&config, mode);
-    EGLinit(&config);
-
-    EGLConfig *EGLconfigs;
-    int configIndex;
-    EGLGetConfig(&EGLconfigs, &configIndex, &config);
-    EGLGetContext(EGLconfigs[configIndex], &config);
-    EGLGetSurface(EGLconfigs[configIndex], &config);
-    free(EGLconfigs); //configs is malloced in EGLGetConfig()
-    eglMakeCurrent(config.display, config.surface, config.surface, config.context);
+// Start a presentation and return at once. Without entries it shows the
+// loaded shader like display(). The handle's file descriptor becomes
+// readable when the run is over, see display_fileno() and display_result().
+static PyObject* py_displayAsync(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    int triggerPin = -1;
+    PyObject* list = Py_None;
+    if (!PyArg_ParseTuple(args, "O|iO", &config_capsule, &triggerPin, &list)) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL || claimContext() < 0) {
+        return NULL;
+    }
+    sequenceEntry* entries;
+    int count = 1;
+    if (list == Py_None) {
+        if (configPtr->currentShaderPtr == NULL) {
+            PyErr_SetString(PyExc_ValueError, "No shader loaded");
+            return NULL;
+        }
+        entries = malloc(sizeof(sequenceEntry));
+        entries[0] = (sequenceEntry){configPtr->currentShaderPtr, DISPLAY_FRAMES, 0, 0, {NULL}};
+    } else if ((count = parseSequence(list, &entries)) < 0) {
+        return NULL;
+    }
 
-    const char* version = (const char*)glGetString(GL_VERSION);
-    printf("OpenGL Version: %s\n", version);
-    const char* glslVersion = (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION);
-    printf("GLSL Version: %s\n", glslVersion);
+    displayJob* job = startDisplayJob(configPtr, entries, count, triggerPin);
+    if (job == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to start the display thread");
+        return NULL;
+    }
+    pendingJob = job;
 
+    PyObject* job_capsule = PyCapsule_New(job, "display_job", displayJobDestructor);
+    // the shaders in the sequence must outlive the run
+    Py_INCREF(list);
+    PyCapsule_SetContext(job_capsule, list);
+    return job_capsule;
+}
 
-    //checkViewport(&config);
-    return config;
+static PyObject* py_displayFileno(PyObject* self, PyObject* args) {
+    PyObject* job_capsule;
+    if (!PyArg_ParseTuple(args, "O", &job_capsule)) {
+        return NULL;
+    }
+    displayJob* job = PyCapsule_GetPointer(job_capsule, "display_job");
+    if (job == NULL) {
+        return NULL;
+    }
+    return PyLong_FromLong(job->eventFd);
 }
 
-long getMin(long* arr, int size) {
-    long min = LONG_MAX;
-    for (int i = 0; i<size-1; i++) {
-        if (arr[i] < min) {
-            min = arr[i];
-        }
+static PyObject* py_displayDone(PyObject* self, PyObject* args) {
+    PyObject* job_capsule;
+    if (!PyArg_ParseTuple(args, "O", &job_capsule)) {
+        return NULL;
+    }
+    displayJob* job = PyCapsule_GetPointer(job_capsule, "display_job");
+    if (job == NULL) {
+        return NULL;
     }
-    printf("The first four values are %ld, %ld, %ld, %ld\n", arr[0], arr[1], arr[2], arr[3]); 
-    return min;
+    return PyBool_FromLong(atomic_load(&job->done));
 }
 
-long getMax(long* arr, int size) {
-    long max = 0;
-    for (int i = 0; i<size-1; i++) {
-        if (arr[i] > max) {
-            max = arr[i];
-        }
+// Wait for the run if needed, then return its frame times and statistics.
+// Times are CLOCK_MONOTONIC seconds, intervals seconds.
+static PyObject* py_displayResult(PyObject* self, PyObject* args) {
+    PyObject* job_capsule;
+    if (!PyArg_ParseTuple(args, "O", &job_capsule)) {
+        return NULL;
+    }
+    displayJob* job = PyCapsule_GetPointer(job_capsule, "display_job");
+    if (job == NULL) {
+        return NULL;
     }
-    return max;   
+    if (job != pendingJob && !atomic_load(&job->done)) {
+        PyErr_SetString(PyExc_RuntimeError, "Another thread is waiting for this display");
+        return NULL;
+    }
+    waitForDisplayJob(job);
+
+    int nFrames = job->stats.frames;
+    PyObject* triggerLatency = Py_None;
+    PyObject* wakeLatency = Py_None;
+    if (job->stats.triggerTime) {
+        triggerLatency = PyFloat_FromDouble((double)job->stats.triggerLatency / 1000000);
+        wakeLatency = PyFloat_FromDouble((double)job->stats.wakeLatency / 1000000);
+    } else {
+        Py_INCREF(triggerLatency);
+        Py_INCREF(wakeLatency);
+    }
+    int count = sequenceLength(job->entries, job->count) > 0 ? job->count : 0;
+    return Py_BuildValue("{s:N,s:N,s:N,s:i,s:i,s:i,s:d,s:d,s:d,s:d,s:d,s:i,s:N,s:N}",
+                         "times", timesToList(job->presentTimes, nFrames),
+                         "onsets", timesToList(job->onsetTimes, count),
+                         "missed_per_trial", missedToList(job->entries, count),
+                         "frames", nFrames,
+                         "dropped", job->stats.dropped,
+                         "missed", job->stats.missed,
+                         "min_interval", (double)job->stats.minInterval / 1000000,
+                         "max_interval", (double)job->stats.maxInterval / 1000000,
+                         "mean_interval", job->stats.meanInterval / 1000000,
+                         "jitter", job->stats.jitter / 1000000,
+                         "baseline_jitter", job->stats.baselineJitter / 1000000,
+                         "realtime", job->stats.realtime,
+                         "trigger_latency", triggerLatency,
+                         "wake_latency", wakeLatency);
 }
 
-int countDropped(long* arr, int size, long thresh) {
-    int count = 0;
-    for (int i = 0; i<size-1; i++) {
-        if (arr[i] > thresh) {
-            count++;
-        }
+static PyObject* py_setTimebase(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    int timebase;
+    if (!PyArg_ParseTuple(args, "Oi", &config_capsule, &timebase)) {
+        return NULL;
     }
-    return count;
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL) {
+        return NULL;
+    }
+    if (timebase != TIMEBASE_CLOCK && timebase != TIMEBASE_FRAME) {
+        PyErr_SetString(PyExc_ValueError, "timebase must be TIMEBASE_CLOCK or TIMEBASE_FRAME");
+        return NULL;
+    }
+    configPtr->timebase = timebase;
+    Py_RETURN_NONE;
 }
 
-void mainloop(GLconfig* configPtr, int triggerPin) {
-    u_int16_t nFrames = 400;
-    long interFrameTimes[nFrames-1];
-
-    // Clear whole screen (front buffer)
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    float elapsed_time;
-    int timeLocation = glGetUniformLocation(configPtr->currentShaderPtr->programId, "time");
-
-    if (triggerPin) {
-        while(!digitalRead(triggerPin)) {
-            continue;
-        }
+static PyObject* py_setRecovery(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    int recovery;
+    if (!PyArg_ParseTuple(args, "Oi", &config_capsule, &recovery)) {
+        return NULL;
     }
-
-    long start_time = get_time_micros();
-    long frame_time;
-    for (int q = 0; q < nFrames; q++) {
-        if (q > 0) {
-            interFrameTimes[q-1] = get_time_micros() - frame_time;
-        }
-        frame_time = get_time_micros();
-        //glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        elapsed_time = (float) (frame_time - start_time)/1000000;
-
-        glUniform1f(timeLocation, elapsed_time/10);
-        glDrawArrays(GL_TRIANGLES, 0, configPtr->currentShaderPtr->VBOlength);
-        gbmSwapBuffers(&(configPtr->display), &(configPtr->surface), configPtr->device);
-
-                //int value = digitalRead(25);
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL) {
+        return NULL;
     }
-
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    printf("We did %u frames in %f\n", nFrames, (double)(get_time_micros() - start_time)/1000000);
-    printf("Max frame %ld, min frame, %ld\n", getMin(interFrameTimes, nFrames-1), getMax(interFrameTimes, nFrames-1) );
-    printf("Number of dropped frames is %i\n", countDropped(interFrameTimes, nFrames, (long) 24000));
+    if (recovery != RECOVER_HOLD && recovery != RECOVER_ADVANCE) {
+        PyErr_SetString(PyExc_ValueError, "recovery must be RECOVER_HOLD or RECOVER_ADVANCE");
+        return NULL;
+    }
+    configPtr->recovery = recovery;
+    Py_RETURN_NONE;
 }
 
-pthread_cond_t displayStartCond = PTHREAD_COND_INITIALIZER;
-pthread_cond_t setupStartCond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
-GLconfig* globalConfigPtr;
-shader* globalShaderPtr;
-float ang;
-void thread_mainloop() {
-    ang = 0.0;
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    float elapsed_time;
-    pthread_mutex_lock(&globalLock);
-    int timeLocation = glGetUniformLocation(globalConfigPtr->currentShaderPtr->programId, "time");
-    int angleLocation = glGetUniformLocation(globalConfigPtr->currentShaderPtr->programId, "angle");
-    pthread_mutex_unlock(&globalLock);
-
-    long start_time = get_time_micros();
+// Scissor sequence frames to the stimulus aperture. Only takes where EGL
+// reports back buffer ages; returns whether tracking is on.
+static PyObject* py_setDamageTracking(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    int on;
+    if (!PyArg_ParseTuple(args, "Op", &config_capsule, &on)) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL) {
+        return NULL;
+    }
+    const char* eglExtensions = eglQueryString(configPtr->display, EGL_EXTENSIONS);
+    configPtr->damageTracking = on && eglExtensions && strstr(eglExtensions, "EGL_EXT_buffer_age") != NULL;
+    return PyBool_FromLong(configPtr->damageTracking);
+}
 
-    for (int q = 0; q < 1000; q++) {
+// Sequences draw the sync patch unless enabled is false. Other settings
+// keep their values when left out.
+static PyObject* py_setSyncPatch(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"enabled", "corner", "code", "bits", "cell_size", NULL};
+    int enabled;
+    int corner = syncPatch.corner;
+    int code = syncPatch.code;
+    int bits = syncPatch.bits;
+    int cellSize = syncPatch.cellSize;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "p|iiii", kwlist, &enabled, &corner, &code, &bits, &cellSize)) {
+        return NULL;
+    }
+    if (setSyncPatch(enabled, corner, code, bits, cellSize) < 0) {
+        PyErr_Format(PyExc_ValueError, "corner must be a SYNC_ corner, code SYNC_BINARY or SYNC_GRAY, bits 1 to %d "
+                     "and cell_size positive", SYNC_MAX_BITS);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        elapsed_time = (float) (get_time_micros() - start_time)/1000000;
-        glUniform1f(timeLocation, elapsed_time);
-        pthread_mutex_lock(&globalLock);
-        glUniform1f(angleLocation, ang);
-        glDrawArrays(GL_TRIANGLES, 0, globalConfigPtr->currentShaderPtr->VBOlength);
-        gbmSwapBuffers(&(globalConfigPtr->display), &(globalConfigPtr->surface), globalConfigPtr->device);
-        pthread_mutex_unlock(&globalLock);
+static PyObject* py_syncCode(PyObject* self, PyObject* args) {
+    unsigned long frame;
+    if (!PyArg_ParseTuple(args, "k", &frame)) {
+        return NULL;
     }
-    printf("We did 240 frames in %f\n", (double)(get_time_micros() - start_time)/1000000);
+    return PyLong_FromUnsignedLong(syncCode(frame));
 }
 
+// Which layers the display controller composes, with the plane ids, 0 for
+// a layer the GPU draws.
+static PyObject* py_planeLayout(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    if (!PyArg_ParseTuple(args, "O", &config_capsule)) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL) {
+        return NULL;
+    }
+    int planes = atomic.active && atomic.useStimulus;
+    return Py_BuildValue("{s:N,s:I,s:I,s:I}", "atomic", PyBool_FromLong(atomic.active),
+                         "background", planes ? atomic.primary.id : 0,
+                         "stimulus", planes ? atomic.stimulus.id : 0,
+                         "sync", atomic.active && atomic.useSync ? atomic.sync.id : 0);
+}
 
-void* threadSetup(void* arg) {
-    int* modePtr = (int*) arg;
-    globalConfigPtr = malloc(sizeof(GLconfig));
-    *globalConfigPtr = setup(*modePtr);
+// Drive another connector (an id from list_outputs()) as well. Returns the
+// output's index.
+static PyObject* py_addOutput(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    unsigned int connectorId;
+    int mode = 0;
+    if (!PyArg_ParseTuple(args, "OI|i", &config_capsule, &connectorId, &mode)) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL || claimContext() < 0) {
+        return NULL;
+    }
+    int index = addOutput(configPtr, connectorId, mode);
+    if (index < 0) {
+        PyErr_Format(PyExc_RuntimeError, "Unable to drive connector %u", connectorId);
+        return NULL;
+    }
+    return PyLong_FromLong(index);
+}
 
-    globalShaderPtr= malloc(sizeof(shader));
-    *globalShaderPtr = buildShaders(0.0, 20.0, 3.5);
+// What an output after the first shows when a trial does not say, None for
+// the same stimulus as the first output.
+static PyObject* py_setOutputShader(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    int index;
+    PyObject* shader_capsule;
+    if (!PyArg_ParseTuple(args, "OiO", &config_capsule, &index, &shader_capsule)) {
+        return NULL;
+    }
+    if (PyCapsule_GetPointer(config_capsule, "config") == NULL || claimContext() < 0) {
+        return NULL;
+    }
+    if (index < 1 || index >= outputCount) {
+        PyErr_SetString(PyExc_IndexError, "no such output after the first");
+        return NULL;
+    }
+    shader* shaderPtr = NULL;
+    if (shader_capsule != Py_None && (shaderPtr = PyCapsule_GetPointer(shader_capsule, "shader")) == NULL) {
+        return NULL;
+    }
+    outputs[index]->shaderPtr = shaderPtr;
+    Py_RETURN_NONE;
+}
 
-    loadShader(globalConfigPtr, globalShaderPtr);
+// Flip timing of each output after the first against the first over the
+// last display, in seconds, and the frames the two went out a vblank apart.
+static PyObject* py_outputSkew(PyObject* self, PyObject* args) {
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    PyObject* list = PyList_New(outputCount - 1);
+    for (int i = 1; i < outputCount; i++) {
+        drmConfig* out = outputs[i];
+        PyList_SET_ITEM(list, i - 1, Py_BuildValue("{s:I,s:l,s:d,s:d,s:i}", "connector", out->connectorId,
+                        "frames", out->skewCount,
+                        "mean_skew", out->skewCount ? out->skewSum / out->skewCount / 1000000 : 0.0,
+                        "max_skew", (double)out->skewMax / 1000000, "slipped", out->slipped));
+    }
+    return list;
+}
 
-    //setup done signal to main thread.
-    pthread_mutex_lock(&globalLock);
-    pthread_cond_signal(&setupStartCond);
-    pthread_mutex_unlock(&globalLock);
+// luminance is a list of the luminance measured at evenly spaced drive
+// levels from 0 to 1, or None to go back to the uncalibrated display.
+// Returns GAMMA_HARDWARE or GAMMA_SHADER, where the calibration is applied.
+static PyObject* py_setCalibration(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    PyObject* luminance;
+    if (!PyArg_ParseTuple(args, "OO", &config_capsule, &luminance)) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL || claimContext() < 0) {
+        return NULL;
+    }
+    if (luminance == Py_None) {
+        return PyLong_FromLong(setCalibration(configPtr, NULL, 0));
+    }
 
-    //wait until display is ready.
-    pthread_cond_wait(&displayStartCond, &globalLock);
-    pthread_mutex_unlock(&globalLock);
-    thread_mainloop();
+    PyObject* seq = PySequence_Fast(luminance, "luminance must be a sequence of numbers");
+    if (seq == NULL) {
+        return NULL;
+    }
+    int count = (int)PySequence_Fast_GET_SIZE(seq);
+    float* measured = malloc((count > 0 ? count : 1) * sizeof(float));
+    for (int i = 0; i < count; i++) {
+        measured[i] = (float)PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+    }
+    Py_DECREF(seq);
+    if (PyErr_Occurred()) {
+        free(measured);
+        return NULL;
+    }
+    int mode = setCalibration(configPtr, measured, count);
+    free(measured);
+    if (mode < 0) {
+        PyErr_SetString(PyExc_ValueError, "luminance must rise from the first level to the last");
+        return NULL;
+    }
+    return PyLong_FromLong(mode);
+}
 
-    return NULL;
+static PyObject* py_setCache(PyObject* self, PyObject* args) {
+    PyObject* config_capsule;
+    int enabled;
+    int budgetMB = (int)(cacheBudget >> 20);
+    if (!PyArg_ParseTuple(args, "Op|i", &config_capsule, &enabled, &budgetMB)) {
+        return NULL;
+    }
+    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
+    if (configPtr == NULL) {
+        return NULL;
+    }
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    configPtr->cacheMode = enabled;
+    cacheBudget = (size_t)budgetMB << 20;
+    evictCycleCaches(0);
+    if (!enabled || !cacheContains(configPtr->currentCache)) {
+        configPtr->currentCache = NULL;
+    }
+    Py_RETURN_NONE;
+}
 
+// Path of the program binary cache, or None to always compile. Takes effect
+// from the next program built.
+static PyObject* py_setProgramCache(PyObject* self, PyObject* args) {
+    const char* path;
+    if (!PyArg_ParseTuple(args, "z", &path)) {
+        return NULL;
+    }
+    closeProgramCache();
+    programCacheEnabled = path != NULL;
+    if (path) {
+        snprintf(programCachePath, sizeof(programCachePath), "%s", path);
+    }
+    Py_RETURN_NONE;
 }
 
-void thread_update(float angle) {
-    pthread_mutex_lock(&globalLock);
-    ang = angle;
-    pthread_mutex_unlock(&globalLock);
+static PyObject* py_programCacheStats(PyObject* self, PyObject* args) {
+    return Py_BuildValue("{s:l,s:l,s:l}", "hits", programCacheHits, "misses", programCacheMisses,
+                         "rejected", programCacheRejects);
 }
 
+// Real-time mode for the render loop. cpus is a list of CPU numbers, None
+// for any. Takes effect from the next display.
+static PyObject* py_setRealtime(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"enabled", "priority", "cpus", "lock_memory", "prefault_stack", "prefault_heap", NULL};
+    realtimeConfig config = realtime;
+    PyObject* cpus = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "p|iOpnn", kwlist, &config.enabled, &config.priority,
+                                     &cpus, &config.lockMemory, &config.stackBytes, &config.heapBytes)) {
+        return NULL;
+    }
+    config.cpuMask = 0;
+    if (cpus != Py_None) {
+        PyObject* seq = PySequence_Fast(cpus, "cpus must be a list of CPU numbers");
+        if (seq == NULL) {
+            return NULL;
+        }
+        for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+            long cpu = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+            if (cpu < 0 || cpu >= (long)(8 * sizeof(config.cpuMask))) {
+                if (!PyErr_Occurred()) {
+                    PyErr_SetString(PyExc_ValueError, "CPU number out of range");
+                }
+                Py_DECREF(seq);
+                return NULL;
+            }
+            config.cpuMask |= 1UL << cpu;
+        }
+        Py_DECREF(seq);
+    }
+    realtime = config;
+    Py_RETURN_NONE;
+}
 
+// The whole telemetry ring as a read-only memoryview of frameRecord structs,
+// with a PEP 3118 format numpy turns into named fields:
+// numpy.asarray(rpg.telemetry_buffer()) shares memory with the ring.
+static PyObject* py_telemetryBuffer(PyObject* self, PyObject* args) {
+    static Py_ssize_t shape[1] = {TELEMETRY_FRAMES};
+    static Py_ssize_t strides[1] = {sizeof(frameRecord)};
+    static char format[] = "T{=Q:frame:=q:submit_time:=q:swap_time:=q:vblank_time:=I:sequence:=I:dropped:}";
+    Py_buffer view = {
+        .buf = telemetry.records,
+        .obj = NULL,
+        .len = sizeof(telemetry.records),
+        .itemsize = sizeof(frameRecord),
+        .readonly = 1,
+        .ndim = 1,
+        .format = format,
+        .shape = shape,
+        .strides = strides,
+    };
+    return PyMemoryView_FromBuffer(&view);
+}
 
+// Unread records as (start, count, overruns): the next count records are
+// telemetry_buffer()[start:start + count]. count stops at the end of the
+// ring, so a wrapped backlog takes two calls.
+static PyObject* py_telemetryPoll(PyObject* self, PyObject* args) {
+    unsigned long head = atomic_load_explicit(&telemetry.head, memory_order_acquire);
+    unsigned long tail = atomic_load_explicit(&telemetry.tail, memory_order_relaxed);
+    unsigned long start = tail & (TELEMETRY_FRAMES - 1);
+    unsigned long count = head - tail;
+    if (start + count > TELEMETRY_FRAMES) {
+        count = TELEMETRY_FRAMES - start;
+    }
+    return Py_BuildValue("(kkk)", start, count, atomic_load(&telemetry.overruns));
+}
 
-static PyObject* py_showModes(PyObject *self, PyObject *args) {
-    int device = open("/dev/dri/card1", O_RDWR | O_CLOEXEC);
-    drmModeRes *resources = drmModeGetResources(device);
-    if (resources == NULL)  {
-        fprintf(stderr, "Unable to get DRM resources\n");
+// Hand count records back to the render loop once they have been read.
+static PyObject* py_telemetryRelease(PyObject* self, PyObject* args) {
+    unsigned long count;
+    if (!PyArg_ParseTuple(args, "k", &count)) {
         return NULL;
     }
-
-    drmModeConnector *connector = getConnector(resources, device);
-    if (connector == NULL)  {
-        fprintf(stderr, "Unable to get connector\n");
-        drmModeFreeResources(resources);
+    unsigned long head = atomic_load_explicit(&telemetry.head, memory_order_acquire);
+    unsigned long tail = atomic_load_explicit(&telemetry.tail, memory_order_relaxed);
+    if (count > head - tail) {
+        PyErr_SetString(PyExc_ValueError, "releasing more records than were written");
         return NULL;
     }
+    atomic_store_explicit(&telemetry.tail, tail + count, memory_order_release);
+    Py_RETURN_NONE;
+}
 
-    for (int i = 0; i< connector->count_modes; i++) {
-        printf("Details for mode %i. Horizontal Resolution: %u. Vertical Resolution: %u. Refresh Rate: %u, Clock Speed: %u\n",
-        i, connector->modes[i].hdisplay, connector->modes[i].vdisplay,connector->modes[i].vrefresh, connector->modes[i].clock);
+static PyObject* py_setGpioChip(PyObject* self, PyObject* args) {
+    const char* path;
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
     }
-    close(device);
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    closeGpio();
+    snprintf(gpio.chipPath, sizeof(gpio.chipPath), "%s", path);
     Py_RETURN_NONE;
 }
 
-static PyObject* py_setup(PyObject *self, PyObject *args) {
-
-    int mode;
-    if (!PyArg_ParseTuple(args, "i", &mode)) {
-         return NULL;
-    }  
+// Pulse line on every flip, -1 to turn it off. Width in microseconds.
+static PyObject* py_setFramePulse(PyObject* self, PyObject* args) {
+    int line;
+    long width = 1000;
+    if (!PyArg_ParseTuple(args, "i|l", &line, &width)) {
+        return NULL;
+    }
+    if (claimContext() < 0) {
+        return NULL;
+    }
+    if (setFramePulse(line, width) < 0) {
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, gpio.chipPath);
+    }
+    Py_RETURN_NONE;
+}
 
-    GLconfig* configPtr = malloc(sizeof(GLconfig));
-    *configPtr = setup(mode);
+static int compareLong(const void* a, const void* b) {
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return (x > y) - (x < y);
+}
 
-    PyObject* config_capsule = PyCapsule_New(configPtr, "config", NULL);
-    Py_INCREF(config_capsule);
-    return config_capsule;
+// Distribution of trigger edge to first scanout over the last
+// TRIGGER_HISTORY triggered displays, in seconds.
+static PyObject* py_triggerStats(PyObject* self, PyObject* args) {
+    int count = gpio.latencyCount < TRIGGER_HISTORY ? gpio.latencyCount : TRIGGER_HISTORY;
+    if (count == 0) {
+        return Py_BuildValue("{s:i}", "count", 0);
+    }
+    long sorted[TRIGGER_HISTORY];
+    memcpy(sorted, gpio.latencies, count * sizeof(long));
+    qsort(sorted, count, sizeof(long), compareLong);
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        sum += sorted[i];
+    }
+    return Py_BuildValue("{s:i,s:d,s:d,s:d,s:d,s:d,s:d}",
+                         "count", count,
+                         "min", (double)sorted[0] / 1000000,
+                         "max", (double)sorted[count - 1] / 1000000,
+                         "mean", sum / count / 1000000,
+                         "median", (double)sorted[count / 2] / 1000000,
+                         "p95", (double)sorted[(int)(count * 0.95)] / 1000000,
+                         "p99", (double)sorted[(int)(count * 0.99)] / 1000000);
 }
 
-static PyObject* py_buildShader(PyObject *self, PyObject *args) {
+static PyObject* py_renderCpu(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"out", "program", "angle", "spatial", "phase",
+                             "aspect_ratio", "sigma", "center_x", "center_y", NULL};
+    PyObject* out;
+    cpuStimulus stim = {
+        .aspectRatio = 0.0f,
+        .sigma = 0.1f,
+        .centerX = 0.0f,
+        .centerY = 0.0f,
+    };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oifff|ffff", kwlist, &out, &stim.program,
+                                     &stim.angle, &stim.spatial, &stim.phase, &stim.aspectRatio,
+                                     &stim.sigma, &stim.centerX, &stim.centerY)) {
+        return NULL;
+    }
+    if (stim.program < CPU_SIN || stim.program > CPU_GABOR) {
+        PyErr_SetString(PyExc_ValueError, "program must be CPU_SIN, CPU_SQUARE or CPU_GABOR");
+        return NULL;
+    }
 
-    float angle;
-    float spatial;
-    float cyclesPerSecond;
-    if (!PyArg_ParseTuple(args, "fff", &angle, &spatial, &cyclesPerSecond)) {
-         return NULL;
+    Py_buffer view;
+    if (PyObject_GetBuffer(out, &view, PyBUF_CONTIG | PyBUF_FORMAT) != 0) {
+        return NULL;
+    }
+    int isFloat = strcmp(view.format, "f") == 0;
+    if (view.ndim != 2 || (!isFloat && strcmp(view.format, "B") != 0)) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "out must be a 2D C-contiguous float32 or uint8 array");
+        return NULL;
+    }
+    int height = (int)view.shape[0];
+    int width = (int)view.shape[1];
+    if (stim.aspectRatio <= 0.0f) {
+        stim.aspectRatio = (float)width / height;
     }
 
-    shader* shaderPtr = malloc(sizeof(shader));
-    *shaderPtr = buildShaders(angle, spatial, cyclesPerSecond);
-    
-    PyObject* shader_capsule = PyCapsule_New(shaderPtr, "shader", NULL);
-    Py_INCREF(shader_capsule);
-    return shader_capsule;
+    Py_BEGIN_ALLOW_THREADS
+    renderCpu(&stim, view.buf, width, height, isFloat);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
 }
 
-static PyObject* py_loadShader(PyObject* self, PyObject* args) {
-    PyObject* config_capsule;
-    PyObject* shader_capsule;
+// Frame frame of a noise carrier, as build_stimulus() with the same noise
+// arguments draws it without an envelope.
+static PyObject* py_renderNoise(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"out", "carrier", "frame", "seed", "block_size", "spectrum", "density",
+                             "frames_per_update", "contrast", NULL};
+    PyObject* out;
+    int carrier;
+    long frame;
+    stimulusParams params = defaultParams();
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oil|Ifffif", kwlist, &out, &carrier, &frame, &params.seed,
+                                     &params.blockSize, &params.spectrum, &params.density,
+                                     &params.framesPerUpdate, &params.contrast)) {
+        return NULL;
+    }
+    if (!isNoiseCarrier(carrier)) {
+        PyErr_SetString(PyExc_ValueError, "carrier must be CARRIER_NOISE, CARRIER_BINARY_NOISE or CARRIER_SPARSE_NOISE");
+        return NULL;
+    }
+    if (params.blockSize < 1.0f || params.framesPerUpdate < 1 || frame < 0) {
+        PyErr_SetString(PyExc_ValueError, "block_size and frames_per_update must be at least 1, frame at least 0");
+        return NULL;
+    }
 
-    if (!PyArg_ParseTuple(args, "OO", &config_capsule, &shader_capsule)) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(out, &view, PyBUF_CONTIG | PyBUF_FORMAT) != 0) {
         return NULL;
     }
-    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule, "config");
-    shader* shaderPtr = PyCapsule_GetPointer(shader_capsule, "shader");
-    loadShader(configPtr, shaderPtr);
+    int isFloat = strcmp(view.format, "f") == 0;
+    if (view.ndim != 2 || (!isFloat && strcmp(view.format, "B") != 0)) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "out must be a 2D C-contiguous float32 or uint8 array");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    renderNoiseCpu(carrier, &params, frame, view.buf, (int)view.shape[1], (int)view.shape[0], isFloat);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&view);
     Py_RETURN_NONE;
 }
 
-static PyObject* py_display(PyObject* self, PyObject* args) {
-    PyObject* config_capsule;
-    int triggerPin;
-    if (!PyArg_ParseTuple(args, "Oi", &config_capsule, &triggerPin)) {
+static PyObject* py_framePhase(PyObject* self, PyObject* args) {
+    float cyclesPerSecond;
+    long frameIndex;
+    double refreshRate;
+    if (!PyArg_ParseTuple(args, "fld", &cyclesPerSecond, &frameIndex, &refreshRate)) {
         return NULL;
     }
-    GLconfig* configPtr = PyCapsule_GetPointer(config_capsule,"config");
-    mainloop(configPtr, triggerPin);
-    Py_RETURN_NONE;
+    return PyFloat_FromDouble(framePhase(1000000.0 / refreshRate, cyclesPerSecond, frameIndex));
 }
 
-
 static PyObject* py_threadSetup(PyObject* self, PyObject* args) {
 
     int mode;
@@ -914,13 +6843,16 @@ static PyObject* py_threadSetup(PyObject* self, PyObject* args) {
         return NULL;
     };
     pthread_mutex_lock(&globalLock);
-    pthread_cond_wait(&setupStartCond, &globalLock);
+    while (!setupDone) {
+        pthread_cond_wait(&setupStartCond, &globalLock);
+    }
     pthread_mutex_unlock(&globalLock);
     Py_RETURN_NONE;
 }
 
 static PyObject* py_threadDisplay(PyObject* self, PyObject* args) {
     pthread_mutex_lock(&globalLock);
+    displayStarted = 1;
     pthread_cond_signal(&displayStartCond);
     pthread_mutex_unlock(&globalLock);
     Py_RETURN_NONE;    
@@ -935,15 +6867,68 @@ static PyObject* py_threadUpdate(PyObject* self, PyObject* args) {
     Py_RETURN_NONE;
 }
 
+// Publish any of the stimulus parameters to the render thread. Ones not
+// given keep their last published value.
+static PyObject* py_threadSetParams(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"angle", "spatial", "cycles_per_second", "contrast", "angle2",
+                             "center_x", "center_y", "sigma", "radius", "inner_radius", NULL};
+    stimulusParams params = globalParams.latest;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ffffffffff", kwlist,
+                                     &params.angle, &params.spatial, &params.cyclesPerSecond,
+                                     &params.contrast, &params.angle2, &params.centerX, &params.centerY,
+                                     &params.sigma, &params.radius, &params.innerRadius)) {
+        return NULL;
+    }
+    publishParams(&globalParams, &params);
+    Py_RETURN_NONE;
+}
+
 // Method definition table
 static PyMethodDef methods[] = {
     {"show_modes", py_showModes, METH_NOARGS, "Show available display modes"},
+    {"list_outputs", py_listOutputs, METH_NOARGS, "Connectors on the card, with their ids and modes"},
     {"setup", py_setup, METH_VARARGS, "Config EGL context"},
+    {"add_output", py_addOutput, METH_VARARGS, "Drive another connector, flipped together with the first"},
+    {"set_output_shader", py_setOutputShader, METH_VARARGS, "Default stimulus of an output after the first, None to mirror the first"},
+    {"output_skew", py_outputSkew, METH_NOARGS, "Flip skew of each output against the first over the last display"},
     {"build_shader", py_buildShader, METH_VARARGS, "Build Shaders"}, 
+    {"build_stimulus", (PyCFunction)(void(*)(void))py_buildStimulus, METH_VARARGS | METH_KEYWORDS, "Build a composed carrier/envelope/temporal stimulus program"},
+    {"build_patches", (PyCFunction)(void(*)(void))py_buildPatches, METH_VARARGS | METH_KEYWORDS, "Build a set of patches drawn in one batched draw"},
+    {"set_patches", py_setPatches, METH_VARARGS, "Upload the patches of a patch set, one or more frames of them"},
+    {"load_movie", py_loadMovie, METH_VARARGS, "Play a movie file, streamed from disk into textures by a loader thread"},
+    {"movie_stats", py_movieStats, METH_VARARGS, "Frames loaded and stalls of a movie"},
+    {"build_image", py_buildImage, METH_VARARGS, "Build an image stimulus from a uint8 or float32 array, uploaded without a copy"},
+    {"update_image", (PyCFunction)(void(*)(void))py_updateImage, METH_VARARGS | METH_KEYWORDS, "Replace a region of an image stimulus, from its top left corner"},
     {"load_shader", py_loadShader, METH_VARARGS, "Use Shader"},
     {"display", py_display, METH_VARARGS, "Display Something"},
+    {"display_async", py_displayAsync, METH_VARARGS, "Start a display on its own thread and return a handle at once"},
+    {"display_fileno", py_displayFileno, METH_VARARGS, "File descriptor that becomes readable when a display_async run is over"},
+    {"display_done", py_displayDone, METH_VARARGS, "Whether a display_async run is over"},
+    {"display_result", py_displayResult, METH_VARARGS, "Wait for a display_async run, return its frame times and statistics"},
+    {"display_sequence", py_displaySequence, METH_VARARGS, "Show a list of (shader, frames, blank_frames) trials back to back"},
+    {"set_timebase", py_setTimebase, METH_VARARGS, "Choose clock or frame locked stimulus phase"},
+    {"set_recovery", py_setRecovery, METH_VARARGS, "What a display does after missed vblanks, RECOVER_HOLD or RECOVER_ADVANCE"},
+    {"set_damage_tracking", py_setDamageTracking, METH_VARARGS, "Redraw only what the stimulus aperture changes, where the driver reports buffer ages"},
+    {"set_sync_patch", (PyCFunction)(void(*)(void))py_setSyncPatch, METH_VARARGS | METH_KEYWORDS, "Corner, code and size of the frame number patch sequences draw for a photodiode or camera"},
+    {"sync_code", py_syncCode, METH_VARARGS, "The cells of the sync patch for a frame number, bit i for cell i from the corner"},
+    {"plane_layout", py_planeLayout, METH_VARARGS, "Which of background, stimulus and sync layer have hardware planes of their own"},
+    {"set_calibration", py_setCalibration, METH_VARARGS, "Linearise luminance from a measured table, in the CRTC gamma ramp where there is one"},
+    {"set_cache", py_setCache, METH_VARARGS, "Pre-render stimulus cycles into textures on load_shader, with a budget in MB"},
+    {"set_program_cache", py_setProgramCache, METH_VARARGS, "Set the program binary cache file, None to disable"},
+    {"program_cache_stats", py_programCacheStats, METH_NOARGS, "Program binary cache hits, misses and rejected binaries"},
+    {"set_realtime", (PyCFunction)(void(*)(void))py_setRealtime, METH_VARARGS | METH_KEYWORDS, "SCHED_FIFO, CPU pinning, memory locking and prefault for the render loop"},
+    {"telemetry_buffer", py_telemetryBuffer, METH_NOARGS, "The per-frame telemetry ring as a zero-copy buffer of records"},
+    {"telemetry_poll", py_telemetryPoll, METH_NOARGS, "Start, count and overruns of the unread telemetry records"},
+    {"telemetry_release", py_telemetryRelease, METH_VARARGS, "Mark telemetry records as read"},
+    {"set_gpio_chip", py_setGpioChip, METH_VARARGS, "GPIO character device for the trigger and frame pulse lines"},
+    {"set_frame_pulse", py_setFramePulse, METH_VARARGS, "Raise a GPIO line on every flip, -1 to turn it off"},
+    {"trigger_stats", py_triggerStats, METH_NOARGS, "Distribution of trigger to first frame latency"},
+    {"render_cpu", (PyCFunction)(void(*)(void))py_renderCpu, METH_VARARGS | METH_KEYWORDS, "Render a frame on the CPU into a 2D float32 or uint8 array"},
+    {"render_noise", (PyCFunction)(void(*)(void))py_renderNoise, METH_VARARGS | METH_KEYWORDS, "Reproduce a frame of a noise stimulus on the CPU, rows bottom first"},
+    {"frame_phase", py_framePhase, METH_VARARGS, "Stimulus phase of a frame in a frame locked run"},
     {"thread_setup", py_threadSetup, METH_VARARGS, "Setup the global shader on a separate display"},
     {"thread_display", py_threadDisplay, METH_NOARGS, "Start the thread displaying the global shader"},
+    {"thread_set_params", (PyCFunction)(void(*)(void))py_threadSetParams, METH_VARARGS | METH_KEYWORDS, "Publish stimulus parameters to the render thread without blocking"},
     {"thread_update", py_threadUpdate, METH_VARARGS, "Update the shader on the other thread"},
     {NULL, NULL, 0, NULL}  // Sentinel
 };
@@ -959,5 +6944,55 @@ static struct PyModuleDef module = {
 // Module initialization function
 PyMODINIT_FUNC PyInit_rpg(void) {
     Py_Initialize();
-    return PyModule_Create(&module);
+    PyObject* m = PyModule_Create(&module);
+    if (m == NULL) {
+        return NULL;
+    }
+    PyModule_AddIntConstant(m, "PRESENT_SETCRTC", PRESENT_SETCRTC);
+    PyModule_AddIntConstant(m, "PRESENT_PAGEFLIP", PRESENT_PAGEFLIP);
+    PyModule_AddIntConstant(m, "PRESENT_ATOMIC", PRESENT_ATOMIC);
+    PyModule_AddIntConstant(m, "SYNC_TOP_LEFT", SYNC_TOP_LEFT);
+    PyModule_AddIntConstant(m, "SYNC_TOP_RIGHT", SYNC_TOP_RIGHT);
+    PyModule_AddIntConstant(m, "SYNC_BOTTOM_LEFT", SYNC_BOTTOM_LEFT);
+    PyModule_AddIntConstant(m, "SYNC_BOTTOM_RIGHT", SYNC_BOTTOM_RIGHT);
+    PyModule_AddIntConstant(m, "SYNC_BINARY", SYNC_BINARY);
+    PyModule_AddIntConstant(m, "SYNC_GRAY", SYNC_GRAY);
+    PyModule_AddIntConstant(m, "PRESENT_OFFSCREEN", PRESENT_OFFSCREEN);
+    PyModule_AddIntConstant(m, "TIMEBASE_CLOCK", TIMEBASE_CLOCK);
+    PyModule_AddIntConstant(m, "TIMEBASE_FRAME", TIMEBASE_FRAME);
+    PyModule_AddIntConstant(m, "RECOVER_HOLD", RECOVER_HOLD);
+    PyModule_AddIntConstant(m, "RECOVER_ADVANCE", RECOVER_ADVANCE);
+    PyModule_AddIntConstant(m, "GAMMA_NONE", GAMMA_NONE);
+    PyModule_AddIntConstant(m, "GAMMA_HARDWARE", GAMMA_HARDWARE);
+    PyModule_AddIntConstant(m, "GAMMA_SHADER", GAMMA_SHADER);
+    PyModule_AddIntConstant(m, "CARRIER_SINE", CARRIER_SINE);
+    PyModule_AddIntConstant(m, "CARRIER_SQUARE", CARRIER_SQUARE);
+    PyModule_AddIntConstant(m, "CARRIER_SAWTOOTH", CARRIER_SAWTOOTH);
+    PyModule_AddIntConstant(m, "CARRIER_PLAID", CARRIER_PLAID);
+    PyModule_AddIntConstant(m, "CARRIER_NOISE", CARRIER_NOISE);
+    PyModule_AddIntConstant(m, "CARRIER_BINARY_NOISE", CARRIER_BINARY_NOISE);
+    PyModule_AddIntConstant(m, "CARRIER_SPARSE_NOISE", CARRIER_SPARSE_NOISE);
+    PyModule_AddIntConstant(m, "ENVELOPE_NONE", ENVELOPE_NONE);
+    PyModule_AddIntConstant(m, "ENVELOPE_GAUSSIAN", ENVELOPE_GAUSSIAN);
+    PyModule_AddIntConstant(m, "ENVELOPE_CIRCLE", ENVELOPE_CIRCLE);
+    PyModule_AddIntConstant(m, "ENVELOPE_ANNULUS", ENVELOPE_ANNULUS);
+    PyModule_AddIntConstant(m, "TEMPORAL_DRIFT", TEMPORAL_DRIFT);
+    PyModule_AddIntConstant(m, "TEMPORAL_COUNTERPHASE", TEMPORAL_COUNTERPHASE);
+    PyModule_AddIntConstant(m, "TEMPORAL_FLICKER", TEMPORAL_FLICKER);
+    PyModule_AddIntConstant(m, "PARAM_ANGLE", PARAM_ANGLE);
+    PyModule_AddIntConstant(m, "PARAM_SPATIAL", PARAM_SPATIAL);
+    PyModule_AddIntConstant(m, "PARAM_CONTRAST", PARAM_CONTRAST);
+    PyModule_AddIntConstant(m, "PARAM_CENTER", PARAM_CENTER);
+    PyModule_AddIntConstant(m, "PARAM_SIZE", PARAM_SIZE);
+    PyModule_AddIntConstant(m, "PARAM_ANGLE2", PARAM_ANGLE2);
+    PyModule_AddIntConstant(m, "REALTIME_PRIORITY", REALTIME_PRIORITY);
+    PyModule_AddIntConstant(m, "REALTIME_AFFINITY", REALTIME_AFFINITY);
+    PyModule_AddIntConstant(m, "REALTIME_LOCKED", REALTIME_LOCKED);
+    PyModule_AddIntConstant(m, "REALTIME_PREFAULTED", REALTIME_PREFAULTED);
+    PyModule_AddIntConstant(m, "CPU_SIN", CPU_SIN);
+    PyModule_AddIntConstant(m, "CPU_SQUARE", CPU_SQUARE);
+    PyModule_AddIntConstant(m, "CPU_GABOR", CPU_GABOR);
+    return m;
 }
+
+#endif // RPG_NO_PYTHON
@@ -13,7 +13,7 @@ config = rpg.setup(16)
 
 shader2 = rpg.build_shader(3.141/4, 20.1, 5 )
 rpg.load_shader(config, shader2)
-rpg.display(config, 0)
+rpg.display(config)
 #rpg.display(config, 25)
 
 